@@ -32,4 +32,511 @@ struct State {
     int file_entry_idx_sector;  // Found file has dir entry in this sector
     int numFree;                // How many free sectors in container
     char file_sector_type;      // curr_sector is: 'U', user file, or 'D' == Dir
+    int dir_extended;           // fileIdx_getArrIdx() had to create a dir extention
+    int alloc_goal;             // sector the next get2FreeSectors() should allocate near, -1 == none
+    int alloc_len;              // sectors expected in the file being written
+    int alloc_dir;              // next allocation is a new dir (spread over allocation groups)
+    int inline_size;            // bytes expected in user file being created, -1 == not inline
+    int stream;                 // user file data being read or written, see dio_sector()
 };
+
+struct DirEntryPlus {
+    char name[10];              // 9 + NULL
+    char type;                  // 'D' == Dir, 'U' == user file
+    int sector;                 // Entry-sector number of file or dir
+    int entry_sector;           // Sector holding the directory entry
+    int entry_idx;              // Array index of entry in entry_sector
+    int parent;                 // Entry-sector of dir holding the entry
+    int sectors;                // Length of frwd chain (files only)
+    long size;                  // Full size in bytes (files only)
+    int depth;                  // 0 == entry of the dir being walked
+    char* path;                 // Path relative to walked dir, valid until next call
+};
+
+struct DirWalkFrame {
+    int dirSector;              // Entry-sector of dir being walked
+    int sector;                 // Sector of dir (or dir extention) in ram
+    int idx;                    // Next Idx[] to look at
+    int pathLen;                // Length of path prefix for this dir
+    struct Dir d;
+};
+
+struct DirWalk {
+    int recursive;              // descend into sub-dirs
+    int depth;                  // top of frame stack, -1 == done
+    int maxDepth;               // allocated frames
+    int pending;                // sector of sub-dir to descend into on next call, 0 == none
+    int dirSectors;             // dir sectors (and extentions) read so far
+    struct DirWalkFrame* frames;
+    char path[1024];
+};
+
+/* Super sector: root .filler links to it. Containers made before it existed
+ *  have NO_SUPER in root .filler and run without any of the features below.
+ */
+#define SUPER_MAGIC 0x4C4F564A      // "JVOL" in a hex display
+#define SUPER_VERSION 1
+#define NO_SUPER 0xEFBEEFBE         // root .filler of containers without super sector
+
+#define FEAT_AGGREGATES 0x0001      // per-dir subtree totals kept in aggregate table
+
+/* Allocation policies: where get2FreeSectors() takes the next sector from.
+ *  Each one does what the one before it does, plus its own placement.
+ */
+#define ALLOC_HEAD 0                // first sector of free list
+#define ALLOC_NEAR 1                // first free sector after parent dir, or after previous sector of file
+#define ALLOC_CONTIG 2              // start new files where their expected length fits in one run
+#define ALLOC_GROUP 3               // new dirs go to the emptiest allocation group, their files follow them
+#define ALLOC_GROUP_SIZE 64         // sectors per allocation group
+
+#define SNAP_MAX 8                  // snapshots a container keeps, see struct Snapshot
+
+struct Super {
+    int magic;                  // SUPER_MAGIC
+    int version;                // SUPER_VERSION
+    int features;               // FEAT_* bits
+    int numSectors;             // Sectors in container
+    int self;                   // Sector holding the super sector
+    int aggTable;               // First sector of aggregate table
+    int aggTableLen;            // Sectors in aggregate table
+    int nameIdx;                // Root node of name index, 0 == none
+    int allocPolicy;            // ALLOC_* used unless a command gives -a
+    int crcTable;               // First sector of checksum table, 0 == none
+    int crcTableLen;            // Sectors in checksum table
+    int inlineMax;              // Largest user file kept inline, see FEAT_INLINE
+    int dedupTable;             // First sector of dedup table, 0 == none
+    int dedupTableLen;          // Sectors in dedup table
+    int stripes;                // Backing files the container is striped over, 0 == one file
+    int stripeUnit;             // Sectors of a stripe unit, see STRIPE_UNIT
+    int growMax;                // Most sectors container may grow to, see FEAT_GROW
+    int snapCount;              // Snapshots kept, see struct Snapshot
+    char snapName[SNAP_MAX][10];    // 9 + NULL
+    int genTable;               // First sector of change table, 0 == none
+    int genTableLen;            // Sectors in change table
+    int generation;             // Stamped on sectors written now, see FEAT_CHANGES
+};
+
+/* Aggregate table holds one record per container sector, indexed by sector
+ *  number. Only records of dir and user-file entry-sectors are meaningful.
+ */
+struct Aggregate {
+    long long bytes;            // Bytes of file, or of all files in dir subtree
+    int sectors;                // Sectors used, dir subtree counts dir sectors and extentions
+    int files;                  // User files in subtree (1 for a file)
+};
+#define AGG_PER_SECTOR (512 / 16)
+
+/* Name index: B+tree of sectors mapping names to the dir entry holding them.
+ *  Key is name, then sector and index of the dir entry, so equal names in
+ *  different dirs stay in order. Internal node records point to the child
+ *  holding keys >= their own; leaves are chained through frwd.
+ */
+#define FEAT_NAMEIDX 0x0002         // name index kept by create_file() and rm_file()
+
+struct NameRec {
+    char name[10];              // 9 + NULL
+    char type;                  // 'D' == Dir, 'U' == user file
+    char idx;                   // Array index of entry in sector
+    int sector;                 // Sector holding the dir entry
+    int child;                  // Node below this key (internal nodes only)
+};
+
+#define NAMEREC_PER_NODE 24     // (512 - 16) / 20
+struct NameNode {
+    int count;                  // records in use
+    int level;                  // 0 == leaf
+    int frwd;                   // next leaf, 0 == last
+    int filler;
+    struct NameRec rec[NAMEREC_PER_NODE];
+};
+
+/* Defrag: what every sector is and what points at it, so a sector can be
+ *  moved and everything linking to it fixed up without searching.
+ */
+struct SectorRef {
+    char kind;                  // 'U' user file sector, 'E' dir extention, 'F' free, 0 == may not move
+    int prev;                   // Sector whose frwd links here, 0 for first sector of a file
+    int entry_sector;           // First sector of a file: sector holding its dir entry
+    int entry_idx;              // First sector of a file: array index of its dir entry
+};
+
+struct Defrag {
+    struct SectorRef* ref;      // one per container sector
+    int numSectors;
+    int cursor;                 // next sector to lay out
+    int moved;                  // sectors moved
+    int chains;                 // chains (files or dir extentions) that had to move
+    int extMoved;               // dir extentions moved
+    long long deadline;         // msec on CLOCK_MONOTONIC, 0 == no budget
+    int stopped;                // budget used (or no free sector) before layout was done
+};
+
+/* Analyze: layout of a container image, see analyze() */
+#define ANALYZE_WORST 10            // files listed as worst offenders
+
+struct ChainStat {
+    char path[256];
+    int sector;                 // First sector of chain
+    int sectors;                // Length of chain
+    int fragments;              // Runs of consecutive sectors in chain
+};
+
+struct Analysis {
+    int numSectors;
+    char* seen;                 // per sector: 0 unused, else 'M'eta, 'D'ir, 'U'ser file, 'B'lock, 'F'ree list
+    int metaSectors;            // root, super, aggregate table, name index
+    int dirs;
+    int dirSectors;             // dir sectors and extentions
+    int extDirs;                // dirs having at least one extention
+    int maxDirChain;            // longest dir chain (first sector and extentions)
+    int files;
+    int fileSectors;
+    int fileFragments;          // runs in all file chains
+    int fragmentedFiles;        // files in more than one run
+    int inlineFiles;            // files kept in their dir sector, no chain
+    int compressedFiles;        // files stored in compressed groups
+    int dedupFiles;             // files stored as block maps
+    int dedupBlocks;            // shared blocks those maps point to
+    int crossLinked;            // sectors reached more than once
+    int freeList;               // sectors on free list
+    int freeListBreaks;         // free list links not going to the next sector
+    int freeExtents;            // runs of free-list sectors by sector number
+    int largestFree;            // longest such run
+    struct ChainStat* file;     // every user file
+    int fileCount;
+    int fileMax;
+    struct ChainStat* dirChain; // every dir with extentions
+    int dirChainCount;
+    int dirChainMax;
+};
+
+/* Fsck: sector headers are read by worker threads in large sequential
+ *  chunks, the tree and free list are then followed in memory and every
+ *  sector is checked, again split over the workers. The tree is followed by
+ *  the workers as well, each taking the next dir off a queue and adding the
+ *  sub-dirs it finds, while the main thread follows the meta sectors, name
+ *  index and free list. A sector is reached by whoever sets its refs first.
+ */
+#define FSCK_CHUNK 2048             // sectors per read (1MB)
+#define FSCK_MAX_THREADS 16
+
+struct Fsck {
+    int numSectors;
+    int threads;
+    int* back;                  // .back of every sector
+    int* frwd;                  // .frwd of every sector
+    char* kind;                 // 'M'eta, 'D'ir, 'E'xtention, 'U'ser file, 'F'ree, 0 == not reached
+    int* prev;                  // sector that should be in .back, -1 == not checked
+    char* refs;                 // times reached, saturates at 2
+    char* err;                  // per sector: 'X' reached twice, 'B' bad .back, 'L' leaked, 0 == ok
+    int dirs;
+    int files;
+    int freeList;
+    int badEntries;             // malformed dir entries (reported as found)
+    int badLinks;               // links outside the container
+    int* ddRefs;                // per sector: block map references found, DD_MAP for map sectors
+    int badRefs;                // dedup table records not matching the block maps
+    struct FsckDir* queue;      // dirs found and not yet followed, from taken on
+    int queued;
+    int queueMax;
+    int taken;                  // next dir for a worker
+    int busy;                   // workers in a dir, which may queue more
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // dir queued or followed
+    pthread_t tid[FSCK_MAX_THREADS];
+};
+
+struct FsckDir {
+    int dir;
+    int parent;
+    char path[256];
+};
+
+struct FsckWorker {
+    struct Fsck* fs;
+    int id;                     // worker takes chunks id, id + threads, ...
+    int errors;                 // sectors found bad by this worker
+    char* page;                 // SC_PAGE aligned, for fsck_read()
+};
+
+/* Checksum table: CRC32C of every container sector, indexed by sector number.
+ *  Kept in memory while a command runs and written back when it ends. The
+ *  table's own sectors have no checksum.
+ */
+#define FEAT_CRC 0x0004             // sector checksums kept in checksum table
+#define CRC_PER_SECTOR (512 / 4)
+#define SCRUB_CHUNK 256             // sectors per read when scrubbing
+
+struct CrcTable {
+    unsigned int* crc;          // one per sector, NULL == container has no checksums
+    char* dirty;                // per table sector, needs writing back
+    int first;                  // first sector of table
+    int len;                    // sectors in table
+    int numSectors;
+};
+
+/* Inline files: user files up to super .inlineMax bytes live in the dir sector
+ *  holding their entry, so reading one takes no sector beyond the dir lookup.
+ *  The entry has type 'I', .link is the sector holding it and .size its bytes.
+ *  Its data is in the 'C' entries right after it, 15 bytes each (every byte
+ *  of the entry but .type). A file that outgrows .inlineMax gets sectors.
+ */
+#define FEAT_INLINE 0x0008          // small user files kept in their dir sector
+#define INLINE_PER_SLOT 15
+#define INLINE_MAX (30 * INLINE_PER_SLOT)      // 'I' and 30 'C' entries fill a dir sector
+#define INLINE_DEFAULT 210                      // two files of 200 bytes share a dir sector
+#define INLINE_SLOTS(n) ( ((n) + INLINE_PER_SLOT - 1) / INLINE_PER_SLOT )
+
+/* Compressed user files (gulp -z): data is cut in groups of CZ_GROUP bytes,
+ *  each compressed on its own (see lz.h) so reading part of a file only
+ *  decompresses the groups holding it. The chain holds the groups back to
+ *  back, each after a 4 byte header: stored length (with CZ_RAW when the group
+ *  did not shrink and is kept as is) and length before compression. Entry
+ *  .size has CZ_FLAG set; its low bits are bytes in the last sector, as for
+ *  any user file. Aggregate .bytes of the file is its uncompressed length.
+ */
+#define CZ_GROUP (32 * 504)         // bytes before compression, 32 sectors worth
+#define CZ_RAW 0x8000               // group header: stored uncompressed
+#define CZ_FLAG 0x8000              // entry .size: data is compressed
+#define CZ_SIZE(s) ( (s) & 0x1fff )  // entry .size without CZ_FLAG, DD_FLAG or SP_FLAG
+
+struct CzStream {               // compressed groups as one byte stream over a file chain
+    int fd;
+    int sector;                 // sector in f
+    int pos;                    // next byte of f.data
+    int last;                   // bytes in last sector of chain
+    int sectors;                // sectors of chain up to and including this one
+    struct File f;
+};
+
+/* Dedup (-O dedup): data of gulped user files goes in block sectors shared by
+ *  every file holding the same 504 bytes. The file's chain is then a block
+ *  map, each sector's data holding up to DD_PER_MAP block sector numbers, 0
+ *  after the last. Entry .size has DD_FLAG; its low bits are bytes in the
+ *  last block. Blocks are never written in place: a changed block is another
+ *  (new or shared) block, and the old one loses a reference. With -O sparse
+ *  as well, a whole block of zeros is DD_HOLE in the map and takes no sector.
+ *
+ *  The dedup table holds per container sector its reference count (DD_MAP for
+ *  block map sectors, 0 for any other sector) and the CRC32C of block data.
+ *  It is kept in memory with a hash index while a command runs and written
+ *  back when it ends, like the checksum table.
+ */
+#define FEAT_DEDUP 0x0010           // user file data shared between files in blocks
+#define DD_FLAG 0x4000              // entry .size: chain is a block map
+#define DD_MAP -1                   // dedup table: sector is part of a block map
+#define DD_HOLE -1                  // block map: 504 zeros with no block behind them
+#define DD_PER_SECTOR (512 / 8)     // table records (refs, hash) per sector
+#define DD_PER_MAP (504 / 4)        // block numbers per block map sector
+
+struct DedupTable {
+    int* refs;                  // one per sector, NULL == container has no dedup
+    unsigned int* hash;         // CRC32C of block data, when refs > 0
+    int* bucket;                // first block with hash & mask, 0 == none
+    int* next;                  // next block in same bucket
+    int mask;
+    char* dirty;                // per table sector, needs writing back
+    int first;                  // first sector of table
+    int len;                    // sectors in table
+    int numSectors;
+    int blocks;                 // sectors with refs > 0
+};
+
+/* Sparse files (-O sparse): gulp leaves whole SP_CHUNK byte runs of zeros in
+ *  the -i data out of the file. Like a compressed file the chain is one byte
+ *  stream (see struct CzStream), of extents each after an 8 byte header:
+ *  bytes of data that follow, then bytes of zeros after them that take no
+ *  sector. Entry .size has SP_FLAG; its low bits are bytes in the last sector.
+ *  Aggregate .bytes of the file counts the holes, .sectors does not.
+ */
+#define FEAT_SPARSE 0x0080          // gulp stores zero runs of user files as holes
+#define SP_FLAG 0x2000              // entry .size: chain is a stream of extents
+#define SP_CHUNK 504                // zeros shorter than this, or not aligned to it, are data
+#define SP_GROUP (32 * 504)         // most data bytes in one extent
+
+/* Change tracking (-O changes): the change table holds per container sector
+ *  the generation it was last written in, indexed by sector number. Sectors
+ *  written now get super .generation; export-delta moves it on, so what is
+ *  written after a delta is told apart from what is in it. Kept in memory
+ *  while a command runs and written back last when it ends. Like the checksum
+ *  table, its own sectors have no checksum (nor a generation).
+ *
+ *  A delta (export-delta, apply-delta) is a DELTA_HEADER byte header: magic,
+ *  generation it has the changes after, generation it brings the container
+ *  to, and sectors in the container. Runs of changed sectors follow, each as
+ *  first sector, count and CRC32C of the sectors, then the sectors. A run of
+ *  count 0 ends it; in place of a first sector it has the number of runs,
+ *  and in place of a CRC32C one of the header's and every run's, chained.
+ *  apply-delta writes nothing until it has checked all of it. The super
+ *  sector comes in the last run, so a replica is only at the new generation
+ *  once it has every sector of the delta.
+ */
+#define FEAT_CHANGES 0x0100         // generation of every sector kept in change table
+#define GEN_PER_SECTOR (512 / 4)
+#define DELTA_MAGIC 0x544C444A      // "JDLT" in a hex display
+#define DELTA_HEADER 16
+#define DELTA_RUN 256               // most sectors in one run of a delta
+
+struct GenTable {
+    unsigned int* gen;          // one per sector, NULL == container has no change table
+    char* dirty;                // per table sector, needs writing back
+    int first;                  // first sector of table
+    int len;                    // sectors in table
+    int numSectors;
+};
+
+/* Growth (-O grow): instead of running out of free sectors the container
+ *  doubles, up to super .growMax sectors. The new sectors go on the end of the
+ *  free list in one run. Tables indexed by sector (aggregate, checksum, dedup,
+ *  change) that no longer cover the container move to the start of the new
+ *  sectors and their old sectors are freed.
+ */
+#define FEAT_GROW 0x0020            // container grows when free sectors run low
+#define GROW_DEFAULT (1 << 20)      // sectors (512 MB) when grow is given without =N
+#define GROW_WATERMARK 16           // grow when fewer than 1/16 of sectors are free
+
+/* Trim (-O trim, and the trim command): whole pages of free sectors are
+ *  punched out of the backing file so they take no space on the host. Only a
+ *  free sector whose .frwd is the next sector is punched; it then reads back
+ *  as zeros, which readers of the free list take as just that (freeFix()).
+ *  With -O trim the sectors a command freed are punched when it ends.
+ */
+#define FEAT_TRIM 0x0040            // freed sectors punched out of backing file
+
+struct TrimList {
+    int* sector;                // sectors freed this command
+    int count;
+    int cap;
+    long punched;               // sectors punched this run of jvol
+    long ranges;                // holes punched for them
+    int unsupported;            // host file system can not punch holes
+};
+
+/* In-memory container (-M): the container file is read once and every sector
+ *  read and write after that is a memcpy. Nothing goes back to a file unless
+ *  a snapshot is saved (-S, or the save command).
+ */
+struct MemImage {
+    int active;                 // 1 == sector I/O goes to data, see devRead()
+    char* data;                 // whole container
+    long len;                   // bytes of container
+    long cap;                   // bytes allocated
+    char* saveTo;               // -S given to jvol, saved when it is done
+    int done;                   // commands finished without error
+};
+
+/* Striped container: -f a,b,c spreads the container over the files in turn,
+ *  STRIPE_UNIT sectors to each. Unit n of the container is unit n / files of
+ *  file n % files, so sectors 0 and 1 (root and super) are always at the
+ *  start of the first file. init records the file count in the super sector.
+ *  Reads and writes spanning several files go to them at once: through the
+ *  ring with -q, otherwise a thread per file (see stripe_run()).
+ */
+#define STRIPE_MAX 16               // backing files
+#define STRIPE_UNIT 64              // sectors, a whole number of -D cache pages
+
+struct Stripes {
+    int count;                  // backing files, 0 == container is one file
+    int unit;                   // sectors per stripe unit
+    char* name[STRIPE_MAX];
+    int fd[STRIPE_MAX];         // -1 == not open
+};
+
+struct StripeWork {             // pieces of a run on one backing file, see stripe_run()
+    struct UringOp* run;
+    int m;
+    int fd;
+};
+
+/* Snapshots (the snapshot command): the container as it was when the
+ *  snapshot was taken, in the file <container>@<name>. Taking one writes no
+ *  sector but the super sector's list of snapshots. From then on a sector
+ *  about to change for the first time is copied into every snapshot not
+ *  holding it yet. -f <container>@<name> reads a snapshot: the sectors it
+ *  holds come from its file, the rest from the container.
+ *
+ *  The file has a SNAP_HEADER byte header, then per container sector (up to
+ *  .numSectors when taken) the slot of its copy plus one, 0 == not copied.
+ *  The copies follow, one sector per slot. A copy is written before its slot
+ *  and both before the container sector, so a reader that reads the container
+ *  sector and then finds no slot for it has the sector as it was.
+ */
+#define SNAP_MAGIC 0x504E534A       // "JSNP" in a hex display
+#define SNAP_HEADER 512
+#define SNAP_DATA(n) ( SNAP_HEADER + ((long)(n) * 4 + 511) / 512 * 512 )  // offset of slot 0
+
+struct Snapshot {
+    char name[10];              // 9 + NULL
+    int fd;                     // -1 == not open
+    int numSectors;             // container sectors when taken
+    long slots;                 // copies held
+    int broken;                 // a sector changed without its copy being kept
+    int unsynced;               // copies written since the last fdatasync()
+    int* slot;                  // per sector: 0 not looked up, -1 in container, else slot + 1
+};
+
+struct SnapSet {
+    int count;                  // of super's snapshots open for copying, -1 == not loaded
+    struct Snapshot s[SNAP_MAX];
+    struct Snapshot view;       // -f <container>@<name>, .fd -1 == reading the container
+    long copied;                // sectors copied this run of jvol
+};
+
+/* Import (the import command): the host tree under -i is walked by reader
+ *  threads taking the next entry off one list, listing it if it is a dir or
+ *  reading it if it is a file. A dir's entries are added when it is listed,
+ *  so every entry comes after its dir and the writer (the main thread) makes
+ *  them in list order, each file gulped as gulp does. Readers read ahead of
+ *  it, up to IMPORT_AHEAD bytes not yet gulped, into the entry's data, which
+ *  the writer gulps from (see SrcData) instead of reading the file again. A
+ *  file bigger than IMPORT_AHEAD is left for the writer to read itself.
+ */
+#define IMPORT_MAX_THREADS 16
+#define IMPORT_AHEAD (64L << 20)    // bytes read but not yet gulped
+#define IMPORT_CHUNK (1 << 20)      // bytes per read
+
+struct ImportEntry {
+    char* host;                 // path on the host
+    char* path;                 // path in the container
+    char type;                  // 'D' or 'U'
+    long size;
+    int ready;                  // 1 == read (files), the writer may take it
+    char* data;                 // what the reader read, NULL == the writer reads host
+    long len;                   // bytes in data
+};
+
+struct Import {
+    struct ImportEntry* e;      // in the order the writer makes them
+    int count;
+    int max;
+    int next;                   // next entry for a reader
+    int busy;                   // readers listing or reading
+    long ahead;                 // bytes taken by readers and not yet gulped
+    int threads;
+    int skipped;                // names too long, or not files or dirs
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // entry ready, added or gulped
+};
+
+/* -i data already in memory: while .data is set, gulp reads it through
+ *  src_open() and friends instead of the file opt.src names (which is still
+ *  used in messages).
+ */
+#define SRC_MEM 0x7fffffff      // src_open() handle of .data, no fd is this big
+
+struct SrcData {
+    char* data;                 // NULL == read opt.src
+    long len;
+    long pos;                   // next byte src_read() gives
+};
+
+/* Export (the export command): a subtree as a ustar archive, TAR_BLOCK byte
+ *  headers each followed by the entry's data padded to a whole block, and
+ *  two zero blocks at the end. The container keeps no owners or times, so
+ *  entries get root, TAR_DIR_MODE or TAR_FILE_MODE and the time of export.
+ */
+#define TAR_BLOCK 512
+#define TAR_NAME 100                // bytes of name field, a longer path is split into prefix
+#define TAR_PREFIX 155
+#define TAR_DIR_MODE 0755
+#define TAR_FILE_MODE 0644
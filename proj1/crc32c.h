@@ -0,0 +1,125 @@
+/*
+ * CRC32C (Castagnoli) of a buffer, for sector checksums.
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it (checked once at
+ * run time), the ARMv8 crc32c instructions when built for them, and
+ * slicing-by-8 tables otherwise. All give the same result. Set up once,
+ * by whichever thread asks first (fsck's workers may all ask at once).
+ */
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78      // reversed Castagnoli polynomial
+
+uint32_t crc32c_table[8][256];
+int crc32c_hw = 0;
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;     // runs crc32c_init()
+
+void crc32c_init(void);
+uint32_t crc32c(const void*, size_t);
+uint32_t crc32c_sw(uint32_t, const unsigned char*, size_t);
+uint32_t crc32c_hwUpdate(uint32_t, const unsigned char*, size_t);
+
+void crc32c_init(void) {
+    for (int i=0; i<256; i++) {
+        uint32_t c = i;
+
+        for (int k=0; k<8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc32c_table[0][i] = c;
+    }
+    for (int i=0; i<256; i++) {
+        for (int t=1; t<8; t++) {
+            crc32c_table[t][i] = (crc32c_table[t-1][i] >> 8) ^ crc32c_table[0][ crc32c_table[t-1][i] & 0xff ];
+        }
+    }
+#if defined(CRC32C_X86)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#elif defined(CRC32C_ARM)
+    crc32c_hw = 1;
+#else
+    crc32c_hw = 0;
+#endif
+}
+
+uint32_t crc32c(const void* buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+
+    if (crc32c_hw) {
+        return ~crc32c_hwUpdate(~0u, buf, len);
+    }
+    return ~crc32c_sw(~0u, buf, len);
+}
+
+uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t len) {
+    // slicing-by-8: eight table lookups per 8 bytes instead of one per byte
+    while (len >= 8) {
+        uint32_t lo, hi;
+
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;      // little-endian, as the containers are
+        crc = crc32c_table[7][ lo & 0xff ] ^ crc32c_table[6][ (lo >> 8) & 0xff ]
+            ^ crc32c_table[5][ (lo >> 16) & 0xff ] ^ crc32c_table[4][ lo >> 24 ]
+            ^ crc32c_table[3][ hi & 0xff ] ^ crc32c_table[2][ (hi >> 8) & 0xff ]
+            ^ crc32c_table[1][ (hi >> 16) & 0xff ] ^ crc32c_table[0][ hi >> 24 ];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][ (crc ^ *p++) & 0xff ];
+    }
+    return crc;
+}
+
+#if defined(CRC32C_X86)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hwUpdate(uint32_t crc, const unsigned char* p, size_t len) {
+#if defined(__x86_64__)
+    uint64_t c = crc;
+
+    while (len >= 8) {
+        uint64_t v;
+
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+#endif
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#elif defined(CRC32C_ARM)
+uint32_t crc32c_hwUpdate(uint32_t crc, const unsigned char* p, size_t len) {
+    while (len >= 8) {
+        uint64_t v;
+
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#else
+uint32_t crc32c_hwUpdate(uint32_t crc, const unsigned char* p, size_t len) {
+    return crc32c_sw(crc, p, len);
+}
+#endif
@@ -0,0 +1,127 @@
+/*
+ * Dentry cache: remembers where a name was found in a dir so resolving the
+ * same path again does not re-read every dir sector on the way from root.
+ *
+ * Entries are keyed by entry-sector of the dir and name. Entries only change
+ * when a file is created or removed, so the cache is kept for as long as the
+ * container is open (whole batch in batch mode).
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#define DCACHE_BUCKETS 1024     // power of two
+#define DCACHE_MAX 8192         // entries held before cache is emptied
+
+struct Dentry {
+    int dir;                    // Entry-sector of dir holding name
+    char name[10];              // 9 + NULL
+    char type;                  // 'D' == Dir, 'U' == user file
+    int link;                   // Entry-sector of file or dir
+    int entry_sector;           // Sector holding the dir entry
+    int entry_idx;              // Array index of entry in entry_sector
+    struct Dentry* next;
+};
+
+struct DentryCache {
+    struct Dentry* bucket[DCACHE_BUCKETS];
+    int count;
+};
+
+unsigned int dcache_hash(int, char*);
+struct Dentry* dcache_lookup(struct DentryCache*, int, char*);
+void dcache_insert(struct DentryCache*, struct Dentry*);
+void dcache_remove(struct DentryCache*, int, char*);
+void dcache_invalidateDir(struct DentryCache*, int);
+void dcache_clear(struct DentryCache*);
+
+unsigned int dcache_hash(int dir, char* name) {
+    unsigned int h = 2166136261u ^ (unsigned int)dir;   // FNV-1a
+
+    for (int i=0; i<9 && name[i] != '\0'; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h & (DCACHE_BUCKETS - 1);
+}
+
+struct Dentry* dcache_lookup(struct DentryCache* dc, int dir, char* name) {
+    struct Dentry* de = dc->bucket[ dcache_hash(dir, name) ];
+
+    while (de != NULL) {
+        if (de->dir == dir && strncmp(de->name, name, 9) == 0) {
+            return de;
+        }
+        de = de->next;
+    }
+    return NULL;
+}
+
+void dcache_insert(struct DentryCache* dc, struct Dentry* src) {
+    // Copies src into cache, replacing any entry with the same key
+    unsigned int h = dcache_hash(src->dir, src->name);
+    struct Dentry* de = dcache_lookup(dc, src->dir, src->name);
+
+    if (de == NULL) {
+        if (dc->count == DCACHE_MAX) {
+            dcache_clear(dc);
+        }
+        de = (struct Dentry *)malloc( sizeof(struct Dentry) );
+        de->next = dc->bucket[h];
+        dc->bucket[h] = de;
+        dc->count++;
+    }
+    de->dir = src->dir;
+    memset(de->name, 0, sizeof(de->name));
+    strncpy(de->name, src->name, 9);
+    de->type = src->type;
+    de->link = src->link;
+    de->entry_sector = src->entry_sector;
+    de->entry_idx = src->entry_idx;
+}
+
+void dcache_remove(struct DentryCache* dc, int dir, char* name) {
+    struct Dentry** p = &dc->bucket[ dcache_hash(dir, name) ];
+
+    while (*p != NULL) {
+        if ((*p)->dir == dir && strncmp((*p)->name, name, 9) == 0) {
+            struct Dentry* de = *p;
+
+            *p = de->next;
+            free(de);
+            dc->count--;
+            return;
+        }
+        p = &(*p)->next;
+    }
+}
+
+void dcache_invalidateDir(struct DentryCache* dc, int dir) {
+    // Drops every name cached for dir
+    for (int i=0; i<DCACHE_BUCKETS; i++) {
+        struct Dentry** p = &dc->bucket[i];
+
+        while (*p != NULL) {
+            if ((*p)->dir == dir) {
+                struct Dentry* de = *p;
+
+                *p = de->next;
+                free(de);
+                dc->count--;
+            }
+            else {
+                p = &(*p)->next;
+            }
+        }
+    }
+}
+
+void dcache_clear(struct DentryCache* dc) {
+    for (int i=0; i<DCACHE_BUCKETS; i++) {
+        while (dc->bucket[i] != NULL) {
+            struct Dentry* de = dc->bucket[i];
+
+            dc->bucket[i] = de->next;
+            free(de);
+        }
+    }
+    dc->count = 0;
+}
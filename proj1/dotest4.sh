@@ -0,0 +1,12 @@
+#!/bin/bash
+
+INIT="./jvol -c init -f testfile"
+BATCH="./jvol -f testfile -c batch"
+LS_DIR="./jvol -f testfile -c ls -p /"
+
+eval "$INIT"
+
+# A line ending in a flag must not throw off the lines after it
+printf -- "-c ls -p / -l\n-c mkdir -p dirA\n-c touch -p dirA/file1 -z\n-c mkdir -p dirB\n" | eval "$BATCH"
+
+eval "$LS_DIR" -R
@@ -0,0 +1,30 @@
+#!/bin/bash
+
+INIT="./jvol -c init -f testfile -O grow"
+IMPORT="./jvol -f testfile -c import -p /imp -i "
+EXPORT="./jvol -f testfile -c export -p /imp"
+
+HOST=$(mktemp -d)
+OUT=$(mktemp -d)
+
+# Host tree with empty files, files around a sector and a dir of its own
+mkdir -p $HOST/src/dirA/dirB $HOST/src/dirC
+: > $HOST/src/empty
+: > $HOST/src/dirA/empty2
+cp txt.400b $HOST/src/dirA/
+cp txt.504b $HOST/src/dirA/dirB/
+cp txt.600b $HOST/src/dirC/
+cp skier.gif $HOST/src/
+
+eval "$INIT"
+eval "$IMPORT" $HOST/src > /dev/null
+
+# As files below -o, and as a tar archive
+mkdir $OUT/dir $OUT/tar
+eval "$EXPORT" -o $OUT/dir
+eval "$EXPORT" | tar x -C $OUT/tar
+
+diff -r $HOST/src $OUT/dir/imp && echo "export -o matches the host tree"
+diff -r $HOST/src $OUT/tar/imp && echo "export archive matches the host tree"
+
+rm -rf $HOST $OUT
@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# Gulp, then append to, files of each size in every storage mode; each must
+#  read back as the host bytes, whatever mode stored it
+CAT="./jvol -f testfile -c cat -p "
+
+HOST=$(mktemp -d)
+: > $HOST/empty
+head -c 3000 /dev/zero > $HOST/zeros
+
+for mode in plain inline z dedup sparse dedup,sparse
+do
+    FEATURES="grow"
+    FLAGS=""
+
+    case $mode in
+        inline|dedup|sparse|dedup,sparse) FEATURES="grow,$mode" ;;
+        z) FLAGS="-z" ;;
+    esac
+    INIT="./jvol -c init -f testfile -O $FEATURES"
+    GULP="./jvol -f testfile $FLAGS -c gulp -p "
+    APPEND="./jvol -f testfile $FLAGS -c append -p "
+
+    eval "$INIT" > /dev/null
+    n=0
+    for src in $HOST/empty $HOST/zeros txt.lorem200 txt.400b txt.504b txt.600b skier.gif
+    do
+        for add in none txt.lorem200 txt.504b txt.600b
+        do
+            n=$((n+1))
+            cat $src > $HOST/want
+
+            eval "$GULP" f$n -i $src > /dev/null
+            if [ $add != none ]; then
+                eval "$APPEND" f$n -i $add > /dev/null
+                cat $add >> $HOST/want
+            fi
+            eval "$CAT" f$n > $HOST/got 2> /dev/null
+
+            if ! cmp -s $HOST/want $HOST/got; then
+                echo "$mode: $(basename $src) + $add gave $(stat -c %s $HOST/got) bytes, want $(stat -c %s $HOST/want)"
+            fi
+        done
+    done
+    echo "$mode: $n files checked; 3000 zeros are kept as"
+    ./jvol -f testfile -c seek -p f5
+done
+
+rm -rf $HOST
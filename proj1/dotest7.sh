@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Replicate testfile into a second container a delta at a time; after each
+#  the two trees must export the same
+INIT="./jvol -c init -f testfile -O changes"
+GULP="./jvol -f testfile -c gulp -p "
+MK_DIR="./jvol -f testfile -c mkdir -p "
+RM_FILE="./jvol -f testfile -c rm -p "
+
+TMP=$(mktemp -d)
+REPLICA=$TMP/replica
+
+compare() {
+    rm -rf $TMP/a $TMP/b
+    mkdir $TMP/a $TMP/b
+    ./jvol -f testfile -c export -p / -o $TMP/a > /dev/null
+    ./jvol -f $REPLICA -c export -p / -o $TMP/b > /dev/null
+    diff -r $TMP/a $TMP/b && echo "replica matches after $1"
+}
+
+eval "$INIT"
+./jvol -f $REPLICA -c init > /dev/null
+
+eval "$MK_DIR" dirA > /dev/null
+eval "$GULP" dirA/file1 -i txt.600b > /dev/null
+./jvol -f testfile -c export-delta -g 0 > $TMP/delta1 2> $TMP/gen
+./jvol -f $REPLICA -c apply-delta -i $TMP/delta1
+compare "the delta from generation 0"
+
+GEN=$(sed -n 's/.*to generation \([0-9]*\)/\1/p' $TMP/gen)
+eval "$GULP" skier.gif -i skier.gif > /dev/null
+eval "$RM_FILE" dirA/file1 > /dev/null
+./jvol -f testfile -c export-delta -g $GEN > $TMP/delta2 2> /dev/null
+
+# A cut off delta changes nothing, the whole one catches the replica up
+cp $REPLICA $TMP/before
+head -c 5000 $TMP/delta2 > $TMP/short
+./jvol -f $REPLICA -c apply-delta -i $TMP/short
+cmp -s $REPLICA $TMP/before && echo "cut off delta left the replica as it was"
+./jvol -f $REPLICA -c apply-delta -i $TMP/delta2
+compare "the delta from generation $GEN"
+
+rm -rf $TMP
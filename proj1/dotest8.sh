@@ -0,0 +1,45 @@
+#!/bin/bash
+
+# fsck of a container big enough to split over every worker (2048 sectors each),
+#  then again once a file is cross-linked; the report says threads and msec
+INIT="./jvol -c init -f testfile -O grow=65536"
+BATCH="./jvol -f testfile -c batch"
+FSCK="./jvol -f testfile -c fsck"
+
+TMP=$(mktemp -d)
+
+eval "$INIT"
+
+for i in {1..30}
+do
+    echo "-c mkdir -p dir${i}"
+    echo "-c mkdir -p dir${i}/sub"
+
+    for j in {1..10}
+    do
+        echo "-c gulp -p dir${i}/file${j} -i skier.gif"
+        echo "-c gulp -p dir${i}/sub/txt${j} -i txt.600b"
+    done
+done > $TMP/lines
+eval "$BATCH" -i $TMP/lines > /dev/null
+
+eval "$FSCK" | tail -1
+
+# dir1/file1's entry now names dir2/file1's chain, so its own chain leaks
+./jvol -f testfile -c ls -p /dir1 -m > $TMP/one
+./jvol -f testfile -c ls -p /dir2 -m > $TMP/two
+FROM=$(awk '$NF ~ /file1$/ { print $2 }' $TMP/one)
+TO=$(awk '$NF ~ /file1$/ { print $2 }' $TMP/two)
+python3 - testfile $FROM $TO <<'EOF'
+import struct, sys
+name, old, new = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+with open(name, 'r+b') as f:
+    data = bytearray(f.read())
+    at = data.find(struct.pack('<i', old) + b'file1')
+    data[at:at+4] = struct.pack('<i', new)
+    f.seek(0)
+    f.write(data)
+EOF
+eval "$FSCK" | tail -3
+
+rm -rf $TMP
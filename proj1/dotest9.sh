@@ -0,0 +1,41 @@
+#!/bin/bash
+
+# A snapshot reads back as the container was when it was taken, while the
+#  container itself changes after it
+INIT="./jvol -c init -f testfile -O grow"
+GULP="./jvol -f testfile -c gulp -p "
+APPEND="./jvol -f testfile -c append -p "
+MK_DIR="./jvol -f testfile -c mkdir -p "
+RM_FILE="./jvol -f testfile -c rm -p "
+SNAP="./jvol -f testfile -c snapshot -p "
+CAT_SNAP="./jvol -f testfile@before -c cat -p "
+CAT="./jvol -f testfile -c cat -p "
+
+TMP=$(mktemp -d)
+
+eval "$INIT"
+eval "$MK_DIR" dirA > /dev/null
+eval "$GULP" dirA/file1 -i txt.600b > /dev/null
+eval "$GULP" dirA/file2 -i skier.gif > /dev/null
+eval "$SNAP" before
+
+# Overwrite, append to, remove and add files after it
+eval "$GULP" dirA/file1 -i txt.400b > /dev/null
+eval "$APPEND" dirA/file1 -i txt.lorem200 > /dev/null
+eval "$RM_FILE" dirA/file2 > /dev/null
+eval "$GULP" dirA/file3 -i skier.gif > /dev/null
+
+eval "$CAT_SNAP" dirA/file1 2> /dev/null | cmp -s - txt.600b && echo "snapshot keeps file1 as gulped"
+eval "$CAT_SNAP" dirA/file2 2> /dev/null | cmp -s - skier.gif && echo "snapshot keeps removed file2"
+cat txt.400b txt.lorem200 > $TMP/file1
+eval "$CAT" dirA/file1 2> /dev/null | cmp -s - $TMP/file1 && echo "container has file1 as changed"
+
+echo "Snapshot lists:"
+./jvol -f testfile@before -c ls -p /dirA
+echo "Container lists:"
+./jvol -f testfile -c ls -p /dirA
+
+./jvol -f testfile -c rmsnap -p before
+./jvol -f testfile -c fsck | tail -1
+
+rm -rf $TMP
@@ -0,0 +1,156 @@
+/*
+ * Free map: in-memory copy of the free sector linked-list, with the sector
+ * before and after each free sector, so the allocator can find a free sector
+ * (or a run of them) at any place in the container and unlink it without
+ * walking the list on disk.
+ *
+ * The map only mirrors the list; jvol.c does the disk writes and tells the map.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#define FREEMAP_USED -1         // .next of sectors not on the free list
+
+struct FreeMap {
+    int valid;                  // 0 == needs loading from container
+    int numSectors;
+    int head;                   // root .free, 0 == no free sectors
+    int tail;                   // last free sector
+    int count;                  // sectors on free list
+    int* next;                  // free sector after, 0 == end of list, FREEMAP_USED == in use
+    int* prev;                  // free sector before, 0 == first on list
+};
+
+void freeMap_reset(struct FreeMap*, int);
+void freeMap_append(struct FreeMap*, int);
+void freeMap_unlink(struct FreeMap*, int);
+void freeMap_prepend(struct FreeMap*, int);
+int freeMap_isFree(struct FreeMap*, int);
+int freeMap_findNear(struct FreeMap*, int, int, int);
+int freeMap_findRun(struct FreeMap*, int, int, int, int);
+int freeMap_countFree(struct FreeMap*, int, int);
+
+void freeMap_reset(struct FreeMap* fm, int numSectors) {
+    // Empty map (every sector in use) for a container of numSectors
+    if (fm->numSectors != numSectors) {
+        free(fm->next);
+        free(fm->prev);
+        fm->next = (int *)malloc( numSectors * sizeof(int) );
+        fm->prev = (int *)malloc( numSectors * sizeof(int) );
+        fm->numSectors = numSectors;
+    }
+    for (int i=0; i<numSectors; i++) {
+        fm->next[i] = FREEMAP_USED;
+        fm->prev[i] = 0;
+    }
+    fm->head = 0;
+    fm->tail = 0;
+    fm->count = 0;
+    fm->valid = 1;
+}
+
+void freeMap_append(struct FreeMap* fm, int sector) {
+    fm->next[sector] = 0;
+    fm->prev[sector] = fm->tail;
+
+    if (fm->tail == 0) {
+        fm->head = sector;
+    }
+    else {
+        fm->next[ fm->tail ] = sector;
+    }
+    fm->tail = sector;
+    fm->count++;
+}
+
+void freeMap_prepend(struct FreeMap* fm, int sector) {
+    fm->next[sector] = fm->head;
+    fm->prev[sector] = 0;
+
+    if (fm->head == 0) {
+        fm->tail = sector;
+    }
+    else {
+        fm->prev[ fm->head ] = sector;
+    }
+    fm->head = sector;
+    fm->count++;
+}
+
+void freeMap_unlink(struct FreeMap* fm, int sector) {
+    int p = fm->prev[sector];
+    int n = fm->next[sector];
+
+    if (p == 0) {
+        fm->head = n;
+    }
+    else {
+        fm->next[p] = n;
+    }
+    if (n == 0) {
+        fm->tail = p;
+    }
+    else {
+        fm->prev[n] = p;
+    }
+    fm->next[sector] = FREEMAP_USED;
+    fm->prev[sector] = 0;
+    fm->count--;
+}
+
+int freeMap_isFree(struct FreeMap* fm, int sector) {
+    return sector > 0 && sector < fm->numSectors && fm->next[sector] != FREEMAP_USED;
+}
+
+int freeMap_findNear(struct FreeMap* fm, int goal, int from, int to) {
+    // First free sector at or after goal in [from, to), wrapping to from; 0 if none
+    if (goal < from || goal >= to) {
+        goal = from;
+    }
+    for (int i=goal; i<to; i++) {
+        if (freeMap_isFree(fm, i)) {
+            return i;
+        }
+    }
+    for (int i=from; i<goal; i++) {
+        if (freeMap_isFree(fm, i)) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+int freeMap_findRun(struct FreeMap* fm, int goal, int len, int from, int to) {
+    // Start of first len free sectors in a row at or after goal in [from, to),
+    //  wrapping to from; 0 if there is no run that long
+    int run = 0;
+
+    if (goal < from || goal >= to) {
+        goal = from;
+    }
+    for (int i=goal; i<to; i++) {
+        run = freeMap_isFree(fm, i) ? run + 1 : 0;
+
+        if (run == len) {
+            return i - len + 1;
+        }
+    }
+    run = 0;
+    for (int i=from; i<to && i<goal+len-1; i++) {
+        run = freeMap_isFree(fm, i) ? run + 1 : 0;
+
+        if (run == len) {
+            return i - len + 1;
+        }
+    }
+    return 0;
+}
+
+int freeMap_countFree(struct FreeMap* fm, int from, int to) {
+    int n = 0;
+
+    for (int i=from; i<to && i<fm->numSectors; i++) {
+        n += freeMap_isFree(fm, i);
+    }
+    return n;
+}
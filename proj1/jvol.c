@@ -1,6 +1,7 @@
 /*
  *  jvol.c - a simple filesystem by Jason Gurtz-Cayla
  */
+#define _GNU_SOURCE                     // O_DIRECT
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -9,14 +10,26 @@
 #include <sys/types.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
 
 #include "container.h"      // contains data structures for sectors
 #include "pathElements.h"   // A dynamic char array 
 #include "userFile.h"       // Holds global state metadata of current open user file
+#include "dcache.h"         // Dentry cache for path resolution
+#include "freemap.h"        // In-memory copy of free list for the allocator
+#include "crc32c.h"         // Sector checksums
+#include "lz.h"             // Codec of compressed user files
+#include "uring.h"          // io_uring engine of -q
+#include "readahead.h"      // Windows read ahead of chain walks
+#include "scache.h"         // Aligned sector cache of -D
+#include "wback.h"          // Sectors written during a command, written out once
 
 #define BUF_SIZE 512                    // bytes
 #define CONTAINER_SIZE (BUF_SIZE * 1000) // Sectors 0 - 99
 #define CONTAINER_PERMS 00644           // wr--r--r-
+#define IMAGE_CHUNK 128                 // sectors per read when loading whole container
 
 #define CONTAINER_CREAT (O_CREAT | O_TRUNC | O_WRONLY) //overwrite allowed
 #define CONTAINER_INIT (O_CREAT | O_EXCL | O_TRUNC | O_WRONLY)
@@ -34,6 +47,20 @@ struct Options {
     char* output;
     int init;
     int cmdGiven;
+    int longList;       // ls -l: show sector and full size
+    int recursive;      // ls -R: walk whole subtree
+    int machine;        // machine-readable (tab separated, no header) output
+    char* features;     // init -O: comma list of features, "no" prefix turns one off
+    char* alloc;        // -a: allocation policy, saved as default by init
+    int budget;         // defrag -t: msec to spend, 0 == until done
+    int since;          // export-delta -g: changes after this generation, 0 == every sector
+    int repair;         // fsck -r: return leaked sectors to free list
+    int compress;       // gulp -z: store data in compressed groups
+    int queueDepth;     // -q: reads and writes in flight through io_uring, 0 == pread/pwrite
+    int direct;         // -D: KB of sector cache, container opened O_DIRECT; 0 == page cache
+    int memory;         // -M: container loaded into memory, -f file is not written
+    char* snapshot;     // -S: file the in-memory container is saved to
+    char* view;         // -f file@name: snapshot read in place of the container
 };
 
 /* Globals */
@@ -42,7 +69,24 @@ struct PathElements userPath = { .elementCount=0 };
 struct PathElements userDstPath = { .elementCount=0 };
 struct UserFile userFile = { .mode=' ', .name="         ", .rw_ptr=0 };
 struct State currState = { .curr_sector=0, .free=0, .next_free=0, .arr_idx_sector=0, .arr_idx=0,
-                           .file_first_sector=0, .file_last_sector_size=0 };
+                           .file_first_sector=0, .file_last_sector_size=0, .alloc_goal=-1 };
+int containerFd = -1;   // container stays open for the whole command (or batch), see containerOpen()
+struct Super super = { .magic=0 };  // loaded by superLoad(), .magic == 0 for containers without one
+struct DentryCache dcache = { .count=0 };   // names already found in dirs, see dirLookup()
+struct FreeMap freeMap = { .valid=0 };      // free list as seen by the allocator, see alloc_place()
+int allocPolicy = ALLOC_HEAD;               // ALLOC_* of this command, from -a or super
+struct CrcTable crcTable = { .crc=NULL };   // checksums of containers made with -O crc, see crc_load()
+struct DedupTable ddTable = { .refs=NULL }; // block references of containers made with -O dedup, see dd_load()
+struct GenTable genTable = { .gen=NULL };   // generations of containers made with -O changes, see gen_load()
+struct Uring ring = { .fd=-1 };             // set up by main() for -q, see ioRun()
+struct ReadAhead readAhead = { .clock=0 };  // sectors read ahead of frwd links, see chainRead()
+struct SectorCache scache = { .slots=0 };   // set up by main() for -D, see dio_sector()
+struct WriteBack wback = { .count=0 };      // held by sectorWrite() until wb_flush()
+struct MemImage memImage = { .active=0 };   // set up by mem_load() for -M
+struct Stripes stripes = { .count=0 };      // set up by stripe_parse() for a -f list
+struct TrimList trimList = { .count=0 };    // sectors freed this command, with -O trim
+struct SnapSet snaps = { .count=-1, .view={ .fd=-1 } };  // copies of changed sectors, see snap_cow()
+struct SrcData srcData = { .data=NULL };    // -i data an import reader read, see src_open()
 
 // User-looking functions : "file" is user data file or directory entry.
 //  Only one file may be open at a time, state held in global struct userFile
@@ -51,30 +95,218 @@ void open_file(char, char*);        // OPEN mode, name (mode={I}nput, {O}utput [
 void close_file();                  // CLOSE 
 void rm_file();                     // DELETE name (delete opt->path)
 void read_file(int, short);         // READ file starting at given sector,up to given bytes of data in last sector and display on stdout
-void write_2_file(int, int);        // WRITE writes to file iat sector at offset
+void write_2_file(int, int);        // WRITE -i data to file at sector, after the given bytes already in it
 void update_file(int, short);       // APPEND to file starting after given bytes of data in last sector.
 void seek_file(int, double);        // SEEK base offset 
 void ls_file();                     // like ls -l on the user-given path, calls ls_dir() on any input other than single user-file
-void ls_dir(int);                   // Opens give sector and recurses to display contents
+void ls_dir(int);                   // Walks given dir sector and displays contents (whole subtree with -R)
+void ls_print(struct DirEntryPlus*); // Display one walked entry in the format chosen by -l/-m
+void du_file();                     // like du -s on the user-given path, from aggregate table
+void find_file();                   // list every file named (or name* prefixed) like last path element, from name index
+void defrag();                      // lay out file chains and dir extentions in runs, free space to the tail
+void analyze();                     // fragmentation and layout report of whole container, JSON with -m
+int fsck();                         // check every sector is reached once and links agree, returns errors found
+int scrub();                        // verify checksum of every sector, returns sectors found bad
 
 // FS Logic helper functions
 int fileIdx_findUsed(struct Dir*);          // Search Dir->Idx for entries with .type != 'F' and return sector number (or -1)
 int fileIdx_search(char*, struct Dir*);     // Search for string in Dir->Idx and return sector number (or -1)
+int dirLookup(int, char*);                  // fileIdx_search() of dir at sector, through dentry cache
 int fileIdx_getArrIdx(struct Dir*);         // By all means return a free file index and store sector in state
+int fileIdx_getArrRun(struct Dir*, int, int); // fileIdx_getArrIdx() for given number of free entries in a row, flag skips sector 0
 int get2FreeSectors();                      // Returns free sector and stores that in currState
 int getLastFree();                          // returns sector number of last free sector in container
 int getFileSector();                        // returns sector num of last path element in userPath.elementArr
 int getDirOfLastPathElementSector();        // returns sector num of next to last path element in userPath.elementArr
+int getPathDirs(int*);                      // fills sectors of root and every dir leading to last path element, returns count
+int dirPathOf(int, char*, int);             // builds path of dir having given sector from .back links, 0 if not possible
+int allocSector();                          // takes first sector off the free list and returns it
 void append2FreeList();                     // Appends current block to end of free sector linked-list
 int extendDir(int);                         // Creates a directory extention for given sector, return sector of extention
 int extendFile(int);                        // Creates a file extention for given sector, return sector of extention
 void reapDir(struct Dir*);                  // recursively returns a directory-type sector to end of free list
 void reapFile(struct File*);                // recursively returns a file-type sector to end of free list
+int chainLength(int, int);                  // Count sectors in frwd chain starting at given sector
+void fileTotals(int, int, short, struct Aggregate*); // Aggregate of user file at sector from its chain, given entry .size
+
+// Inline files (see FEAT_INLINE)
+int inline_size(int);                       // Bytes of file once -i data is added to given bytes, -1 if it cannot be inline
+int inline_slots(struct Dir*, int);         // 'C' entries following entry at idx
+void inline_get(char*, int, char*, int);    // Copy bytes of inline file at idx out of dir sector buffer
+void inline_put(char*, int, char*, int);    // Copy bytes of inline file at idx into dir sector buffer
+void inline_write(char*, int);              // Store given bytes, then -i data, in inline file found last
+
+// -i data (see SrcData)
+int src_open();                             // Handle of -i data: an fd, SRC_MEM when in memory, -1 on error
+int src_read(int, void*, int);              // read() of handle, from memory for SRC_MEM
+off_t src_seek(int, off_t, int);            // lseek() of handle, SEEK_DATA finds no holes in memory
+int src_info(struct stat*);                 // stat() of -i data, a regular file of .len bytes in memory
+void src_close(int);                        // close() of handle
+
+// Compressed files (see CZ_GROUP)
+void cz_open(struct CzStream*, int, int, int);      // Stream over chain at sector, given bytes in its last sector
+int cz_get(struct CzStream*, unsigned char*, int);  // Read (NULL skips) bytes, returns fewer at end of chain
+void cz_put(struct CzStream*, unsigned char*, int); // Write bytes, chain is extended as needed
+int cz_close(struct CzStream*);                     // Write last sector, free chain past it; returns its bytes
+void cz_read(int, short);                           // cat of compressed file at sector, given entry .size
+void cz_write(int, int);                            // -i data compressed into file found last, flag appends
+long cz_rawSize(int, int, short);                   // Uncompressed length of file at sector, given entry .size
+
+// Sparse files (see SP_CHUNK)
+void sp_read(int, short);                           // cat of sparse file at sector, holes as zeros
+void sp_write(int, int);                            // -i data into file found last, zero runs as holes, flag appends
+void sp_put(struct CzStream*, char*, int, long);    // Extent of given data bytes and zeros after them
+long sp_seek(int, int, short, long, int);           // Offset of next data (SEEK_DATA) or hole (SEEK_HOLE) at or after offset, -1 past end
+void sp_map();                                      // seek command: data and hole extents of file at opt.path
+
+// Directory walk (readdir-plus): one pass over a dir or subtree returning name, type, sector, size, depth
+void dirWalk_open(struct DirWalk*, int, int);           // Start walk at dir sector, recursive flag
+int dirWalk_next(struct DirWalk*, struct DirEntryPlus*); // Fill next entry; returns 0 when walk is done
+void dirWalk_close(struct DirWalk*);                    // Release walk frames
+void dirWalk_prefetch(int, struct Dir*);                // Prefetch extention and linked sectors of loaded dir
+
+// Super sector and aggregate table (per-dir subtree totals)
+int superLoad();                                // Load super sector into global super, 0 if container has none
+void superWrite();                              // Write global super back to its sector
+void agg_get(int, struct Aggregate*);           // Read aggregate record of sector
+void agg_put(int, struct Aggregate*);           // Write aggregate record of sector
+void agg_add(int, long long, int, int);         // Add bytes, sectors, files to record of sector
+void agg_addPath(int*, int, long long, int, int); // agg_add() to each of given dir sectors
+
+// Name index (B+tree of sectors, see container.h)
+void nameIdx_insert(char*, char, int, int);             // Add name, type, dir entry sector and idx
+void nameIdx_delete(char*, int, int);                   // Remove name at dir entry sector and idx
+int nameIdx_insertNode(int, struct NameRec*, struct NameRec*); // Insert below node, returns 1 if node split
+int nameIdx_seek(struct NameRec*, struct NameNode*, int*);    // Load leaf for key, position of first record >= key
+void nameIdx_freeNode(int);                             // Return node and everything below it to free list
+void nameIdx_build();                                   // (Re)build index from a walk of the whole tree
+int nameRec_cmp(struct NameRec*, struct NameRec*);      // Key order: name, then sector, then idx
+int nameIdx_walk(int, char*, int (*)(void*, int), void*); // Every node below super's root, parents first, read from image or fd
+int parseFeatures(char*, int*, int*);                   // -O list -> FEAT_* bits, inline=N threshold and grow=N limit
+
+// Allocator
+int alloc_parse(char*);                         // -a name -> ALLOC_* policy
+void alloc_place();                             // Move sector chosen by policy to head of free list
+int alloc_target();                             // Free sector policy wants for currState.alloc_goal, 0 if none
+void alloc_loadMap();                           // Fill freeMap from free list on disk
+void alloc_sync(int);                           // Catch freeMap up with sectors taken off head of free list
+int containerGrow();                            // Double the container (up to super .growMax), returns sectors added
+int growWanted(int, int);                       // 1 if free list with given head and next is below the watermark
+void crc_resize(int, int, int);                 // Move checksum table to sector, len, for numSectors
+
+// Trim (see struct TrimList)
+int freeFix(char*, int);                        // Punched free sector read back as zeros becomes the empty dir it stands for
+void freeRead(char*, int, int);                 // sectorRead() of a sector on the free list, through freeFix()
+long devPunch(int, off_t, long);                // Hole in the backing file(s), zeros with -M; -1 on error
+int trim_punch(int, int*, int);                 // Punch whole pages of free sectors linking to the next, returns sectors punched
+void trim_flush(int);                           // -O trim: punch what this command freed
+void trim();                                    // trim command: punch pages of the whole free list
+void dd_resize(int, int, int);                  // Move dedup table to sector, len, for numSectors
+
+// Snapshots (see struct Snapshot)
+void snap_path(char*, int, char*);              // File of named snapshot
+int snap_open(struct Snapshot*, char*, int);    // Open named snapshot with mode, 0 if it can not be
+void snap_load();                               // Open every snapshot super lists, for copying into
+void snap_release();                            // Close them, super's list changed
+int snap_lookup(struct Snapshot*, int, int, int); // Fill .slot of sectors from map, flag looks up sectors in container again
+int snap_wanted(int, int);                      // 1 if a snapshot has not kept one of given sectors yet
+void snap_keep(int, int, char*);                // Old data of given sectors into every snapshot not holding them
+void snap_break(struct Snapshot*, int);         // Snapshot could not keep given sector, no longer whole
+void snap_cow(int, off_t, long);                // snap_keep() of bytes about to be written or punched
+void snap_sync();                               // fdatasync() snapshots copied into, before the container is written
+int snap_overlay(char*, long, off_t);           // Sectors just read from container replaced by what the -f snapshot holds
+void snapshot();                                // snapshot command: take one named -p, or list them
+void snap_rm();                                 // rmsnap command: drop snapshot named -p
+
+// Defrag (see struct Defrag)
+void defrag_mapDir(struct Defrag*, int);        // Record kind and back-reference of every sector below dir
+int defrag_placeDir(struct Defrag*, int);       // Lay out dir extentions, files, then sub-dirs; 0 when stopped
+int defrag_placeChain(struct Defrag*, int);     // Lay out chain starting at sector from cursor on; 0 when stopped
+void defrag_move(struct Defrag*, int, int);     // Copy sector to free sector and relink what points at it
+void defrag_rewriteFreeList(struct Defrag*);    // Free list in sector order, so allocation fills the tail from front
+long long msecNow();                            // CLOCK_MONOTONIC in msec
+
+// Analyze (see struct Analysis)
+void analyze_dir(struct Analysis*, char*, int, char*);  // Account dir chain, its files and sub-dirs in image
+void analyze_add(struct ChainStat**, int*, int*, char*, int, int, int); // Append chain to growing list
+int analyze_cmp(const void*, const void*);              // qsort: most fragments first
+int analyze_idxNode(void*, int);                        // nameIdx_walk() visitor: account index node
+void analyze_print(struct Analysis*);                   // Human readable report
+void analyze_json(struct Analysis*);                    // Same report as JSON
+
+// Fsck (see struct Fsck)
+void* fsck_readWorker(void*);                   // Read .back/.frwd of every sector in worker's chunks
+void* fsck_checkWorker(void*);                  // Check .back and reach count of every sector in worker's chunks
+void* fsck_walkWorker(void*);                   // Follow dirs off the queue until none are left or being followed
+void fsck_startWorkers(struct Fsck*, void* (*)(void*), struct FsckWorker*); // Start workers
+void fsck_joinWorkers(struct Fsck*);            // Wait for workers
+void fsck_runWorkers(struct Fsck*, void* (*)(void*), struct FsckWorker*); // Start workers and wait for them
+int fsck_reach(struct Fsck*, int, char, int);   // Mark sector reached as kind with expected .back; 0 if seen before
+int fsck_idxNode(void*, int);                   // nameIdx_walk() visitor: reach index node, 0 if it is not to be read
+void fsck_read(struct FsckWorker*, char*, int); // sectorRead() that workers may do at once
+void fsck_queue(struct Fsck*, int, int, char*); // Add dir of given parent and path for a worker to follow
+void fsck_dir(struct FsckWorker*, int, int, char*); // Reach dir chain, check its entries and files, queue sub-dirs
+void fsck_blockMap(struct FsckWorker*, int, char*); // Count references to blocks from map chain at sector
+
+// Sector checksums (see struct CrcTable)
+void crc_load();                                // Load checksum table named by super, or drop the one loaded
+void crc_setup(int, int, int);                  // Fresh all-dirty table at sector, len, for numSectors
+void crc_update(int, char*);                    // Checksum of sector just written
+int crc_verify(int, char*);                     // 0 if sector just read does not match its checksum
+void crc_flush(int);                            // Write dirty table sectors through given fd
+void crc_atexit(void);                          // crc_flush() of shared handle when exiting
+
+// Dedup (see struct DedupTable)
+void dd_load();                                 // Load dedup table named by super and index its blocks
+void dd_setup(int, int, int);                   // Fresh all-dirty table at sector, len, for numSectors
+void dd_set(int, int, unsigned int);            // Set refs and hash of sector in table
+void dd_index(int);                             // Add block at sector to hash index
+void dd_unindex(int);                           // Take block at sector out of hash index
+int dd_ref(char*, int);                         // Block holding 504 bytes of data (shared or new near goal), takes a reference
+void dd_unref(int);                             // Drop a reference to block, freed at none; needs currState.last_free
+int dd_mapRead(int, int, int**);                // Block list of map chain at sector into malloc'd array, returns count
+void dd_mapMark(int, int, int);                 // Set refs of every sector of chain at sector
+void dd_drop(int, int);                         // Map chain at sector becomes a plain chain, its blocks released
+void dd_read(int, short);                       // cat of block-mapped file at sector, given entry .size
+void dd_write(int, int);                        // -i data into file found last as shared blocks, flag appends
+void dd_stats();                                // stats: blocks, references and what sharing saves
+void ra_stats();                                // stats: what chainRead() read ahead and what of it was used
+void dd_flush(int);                             // Write dirty table sectors through given fd
+void dd_atexit(void);                           // dd_flush() of shared handle when exiting
+
+// Change tracking (see struct GenTable)
+void gen_load();                                // Load change table named by super, or drop the one loaded
+void gen_setup(int, int, int);                  // Fresh all-dirty table at sector, len, for numSectors
+void gen_resize(int, int, int);                 // Move change table to sector, len, for numSectors
+void gen_mark(int, int);                        // Given sectors from sector on are written in super .generation
+int gen_own(int);                               // 1 if sector is part of the change table
+void gen_flush(int);                            // Write dirty table sectors through given fd
+void gen_atexit(void);                          // gen_flush() of shared handle when exiting
+void delta_export();                            // export-delta command: sectors changed after -g generation to stdout
+void delta_apply();                             // apply-delta command: delta from -i file (or stdin) into container
+long delta_check(FILE*, unsigned int*, FILE*);  // Sectors in runs after header of delta, copied to file if given; -1 if damaged
+
+// Import (see struct Import)
+void import_add(struct Import*, char*, char*, char, long); // Append entry of host path, container path, type, size
+void import_list(struct Import*, char*, char*); // Add entries of host dir, found at container path
+void* import_worker(void*);                     // Reader: list dirs and read files off the list, ahead of the writer
+void import_tree();                             // import command: host dir -i into container dir -p
+
+// Export (see TAR_BLOCK)
+int export_header(char*, char*, char, long, long); // ustar header of name, type, size, mtime; 0 if name does not fit
+void export_chain(int, int, long);              // Given bytes of plain chain at sector to stdout
+long export_size(int, struct DirEntryPlus*, short*, char*); // Bytes of file entry, its .size and type
+void export_data(int, struct DirEntryPlus*, short, char, long); // File entry's data to stdout
+long export_entry(int, struct DirEntryPlus*, char*, long); // Entry as given name into archive or below -o
+void export_tree();                             // export command: -p as ustar archive on stdout, or below -o
 
 // CLI processing and UI
 void usage(void);                               // prints help info
+void runCmd();                                  // run command given in global opt
+void runBatch();                                // runCmd() for each line of -i file or stdin
 void handleArgs(int, char**);                   // GetOpt() processing
 int parseCmd(char*);                            // String -> int mapping
+int cmdReadOnly();                              // 1 if command in global opt writes nothing
 void parsePath(struct PathElements*, char*);    // serialize a path string into an array with count
 
 // Container file handling functions
@@ -84,15 +316,46 @@ void containerInit();                           // Initialize container file
 
 // Low-level data-handling functions
 void sectorRead(char*, int, int);               // read into buffer, from filedescriptor, at sector offset
+void chainRead(char*, int, int);                // sectorRead() of a sector found through a frwd link, with readahead
 void sectorWrite(char*, int, int);              // write from buffer, to filedescriptor, at sector offset
+void sectorPrefetch(int, int);                  // hint the kernel that given sector will be read soon
+void sectorPrefetchMany(int, int*, int);        // sectorPrefetch() of each, as one batch of reads with -q
+void sectorReadMany(int, int*, int, char*);     // read given sectors into consecutive buffers, with -q all in flight
+int ioRun(int, struct UringOp*, int);           // run reads and writes through ring or pread/pwrite, returns failed count
+int ioRun_raw(int, struct UringOp*, int);       // ioRun() without -D or the write-back
+char* dio_sector(int, int);                     // -D: sector in the cache, read in with its page if needed; NULL on error
+int dio_write(int, int, char*);                 // -D: sector into the cache and its page to the container, 0 on error
+int dio_run(int, struct UringOp*, int);         // ioRun() of -D, unaligned operations go through the cache
+void dio_stats();                               // stats: how the -D cache did
+int wb_flush(int);                              // write held sectors out in sector order, returns failed count
+void wb_atexit(void);                           // wb_flush() of shared handle when exiting
+void wb_stats();                                // stats: sector writes held and sectors written out
+long devRead(int, char*, long, off_t);          // pread(), or from memory with -M
+long devWrite(int, char*, long, off_t);         // pwrite(), or to memory with -M
+void mem_load();                                // -M: read container file into memory, none yet is an empty one
+int mem_save(char*);                            // write in-memory container to file as one snapshot, 0 on error
+void mem_atexit(void);                          // mem_save() to -S when jvol finished without error
+void stripe_parse(char*);                       // -f of comma separated files is a striped container
+int stripe_open(int, int);                      // containerOpen() of every backing file, returns handle of first
+long stripe_map(off_t, long, int*, off_t*);     // file and offset of container offset, returns bytes there in a row
+long stripe_io(char*, long, off_t, int);        // devRead()/devWrite() over the backing files
+struct UringOp* stripe_split(struct UringOp*, int, int**, int*); // operations cut where stripe units end
+void stripe_run(struct UringOp*, int);          // pieces from stripe_split(), each backing file's in a thread of its own
+void* stripe_worker(void*);                     // pread/pwrite of the pieces on one backing file, in order
+char* containerImage(int);                      // read given number of sectors in large chunks into one buffer
 void dir2buf(char*, struct Dir);                // Marshall Dir struct to buffer
 void file2buf(char*, struct File);              // Marshall File struct to buffer
 void buf2dir(char*, struct Dir*);               // Marshall buffer to Dir struct 
 void buf2file(char*, struct File*);             // Marshall buffer to File struct
+void super2buf(char*, struct Super);            // Marshall Super struct to buffer
+void buf2super(char*, struct Super*);           // Marshall buffer to Super struct
+void node2buf(char*, struct NameNode);          // Marshall NameNode struct to buffer
+void buf2node(char*, struct NameNode*);         // Marshall buffer to NameNode struct
 
 // Debugging & error handling functions
 void die(int*, int);                            // close file handles and exit with given error code
 void print_hex_memory(void*, int);
+void printJsonString(char*);                    // print string quoted and escaped for JSON
 
 
  /***********************************************************\
@@ -121,7 +384,7 @@ int fileIdx_findUsed(struct Dir* d) {
         //DEBUG
         //printf("Checking dir extention at sector %d\n", d->frwd);
         fd = containerOpen(opt.filename, CONTAINER_READ);
-        sectorRead( buf, fd, d->frwd );
+        chainRead( buf, fd, d->frwd );
         containerClose(fd);
         buf2dir(buf, d);
 
@@ -149,7 +412,7 @@ int fileIdx_search(char* pe, struct Dir* d) {
         //DEBUG
         //printf("pe: %s\tIdx[%d].name: %s\t.type: %c\n", pe, i, (char *)d->Idx[i].name, (char)d->Idx[i].type);
 
-        if ( strncmp( (char*)&d->Idx[i].name, pe, 9 ) == 0 ) {
+        if ( d->Idx[i].type != 'C' && strncmp( (char*)&d->Idx[i].name, pe, 9 ) == 0 ) {    // 'C' name is file data
             //DEBUG
             //printf("Returning link: %d\n", d->Idx[i].link);
             currState.file_sector_type = d->Idx[i].type;
@@ -166,7 +429,7 @@ int fileIdx_search(char* pe, struct Dir* d) {
         //DEBUG
         //printf("Checking dir extention at sector %d\n", d->frwd);
         fd = containerOpen(opt.filename, CONTAINER_READ);
-        sectorRead( buf, fd, d->frwd );
+        chainRead( buf, fd, d->frwd );
         containerClose(fd);
         buf2dir(buf, d);
 
@@ -182,11 +445,52 @@ int fileIdx_search(char* pe, struct Dir* d) {
     }
 }
 
+int dirLookup(int dirSector, char* pe) {
+    // Finds path-element name pe in dir at dirSector, populating the same state
+    //  as fileIdx_search(). Names found before are answered from the dentry
+    //  cache without reading the dir (or its extentions) again.
+    struct Dentry* de = dcache_lookup(&dcache, dirSector, pe);
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d;
+    int link = 0;
+
+    if (de != NULL) {
+        currState.file_sector_type = de->type;
+        currState.file_entry_idx = de->entry_idx;
+        currState.file_entry_idx_sector = de->entry_sector;
+
+        return de->link;
+    }
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    sectorRead(buf, fd, dirSector);
+    containerClose(fd);
+    buf2dir(buf, &d);
+    link = fileIdx_search(pe, &d);
+
+    if (link > 0) {
+        struct Dentry found = { .dir=dirSector, .type=currState.file_sector_type, .link=link,
+                                .entry_sector=currState.file_entry_idx_sector,
+                                .entry_idx=currState.file_entry_idx };
+
+        strncpy(found.name, pe, 9);
+        found.name[9] = '\0';
+        dcache_insert(&dcache, &found);
+    }
+    return link;
+}
+
 int fileIdx_getArrIdx(struct Dir* d) {
-    /* Searchs loaded directory entry for a free file index. If full, will create
-     *  a directory extention and return the zeroth entry. Uses "first free" method
-     *  because files may be removed, leaving free entries in the middle of an extention
-     *  chain
+    return fileIdx_getArrRun(d, 1, 0);
+}
+
+int fileIdx_getArrRun(struct Dir* d, int len, int notRoot) {
+    /* Searchs loaded directory entry for len free file indexes in a row (inline
+     *  files need more than one). If full, will create a directory extention and
+     *  return the zeroth entry. Uses "first free" method because files may be
+     *  removed, leaving free entries in the middle of an extention chain.
+     *  notRoot passes over root's first sector: an inline file links to the
+     *  sector holding it, and a link of 0 means root.
      *
      * Returns the free arr idx and updates these global state elements:
      *  int arr_idx_sector;     // Sector number having free directory entry index
@@ -194,14 +498,16 @@ int fileIdx_getArrIdx(struct Dir* d) {
     */
     int fd = 0;         // File descriptor of container
     char buf[512] = {0};
+    int run = 0;
 
-    for (int i=0; i<31; i++) {
+    for (int i=0; i<31 && !(notRoot && currState.curr_sector == 0); i++) {
+        run = (d->Idx[i].type == 'F') ? run + 1 : 0;
 
-        if (d->Idx[i].type == 'F') {
+        if (run == len) {
             currState.arr_idx_sector = currState.curr_sector;
-            currState.arr_idx = i;
+            currState.arr_idx = i - len + 1;
 
-            return i;
+            return currState.arr_idx;
         }
     }
     // Not found, check for directory extension and recurse to continue search
@@ -214,21 +520,31 @@ int fileIdx_getArrIdx(struct Dir* d) {
         containerClose(fd);
         buf2dir(buf, d);
 
-        return fileIdx_getArrIdx(d);
+        return fileIdx_getArrRun(d, len, notRoot);
     }
     else { // need to create dir extention
         int priorDir = currState.curr_sector;
         //DEBUG
         //printf("Creating dir extention at sector %d\n", currState.free);
 
+        // extention goes right after the dir if policy allows
+        currState.alloc_goal = currState.curr_sector + 1;
+        get2FreeSectors();
+
+        if (currState.free == 0) {
+            printf("No free sectors!\n");
+            exit(255);
+        }
+
         // chg frwd to currState.free
+        currState.dir_extended = 1;
         d->frwd = currState.free;
         dir2buf(buf, *d);
         fd = containerOpen(opt.filename, CONTAINER_READWRITE);
         sectorWrite(buf, fd, currState.curr_sector);
 
         // Update currState.free sector
-        sectorRead(buf, fd, currState.free);
+        freeRead(buf, fd, currState.free);
         buf2dir(buf, d);
         currState.arr_idx_sector = currState.curr_sector;
         currState.arr_idx = 0;
@@ -262,12 +578,29 @@ int get2FreeSectors() {
     char buf[512] = {0};
     struct Dir d;
 
+    if (super.features & FEAT_GROW) {   // new sectors first, so policy can place in them
+        fd = containerOpen(opt.filename, CONTAINER_READ);
+        sectorRead(buf, fd, 0);
+        buf2dir(buf, &d);
+        currState.free = d.free;
+
+        if (currState.free != 0) {
+            freeRead(buf, fd, currState.free);
+            buf2dir(buf, &d);
+        }
+        if (growWanted(currState.free, (currState.free != 0) ? d.frwd : 0)) {
+            containerGrow();
+        }
+        containerClose(fd);
+    }
+    alloc_place();  // policy may put a better sector at the head first
+
     fd = containerOpen(opt.filename, CONTAINER_READ);
     sectorRead(buf, fd, 0);
     buf2dir(buf, &d);
     currState.free = d.free;
 
-    sectorRead(buf, fd, currState.free);
+    freeRead(buf, fd, currState.free);
     buf2dir(buf, &d);
 
     if (currState.free == 0 ) {
@@ -287,33 +620,246 @@ int get2FreeSectors() {
     return currState.free;
 }
 
-void ls_dir(int sector) {
-    int fd = 0;
-    struct Dir d;
+void dirWalk_open(struct DirWalk* w, int sector, int recursive) {
+    /* Prepares a walk of the dir at given sector. Frames form a stack of the
+     *  dirs being walked so one pass over the tree visits each dir sector once.
+     */
+    w->recursive = recursive;
+    w->maxDepth = 8;
+    w->frames = (struct DirWalkFrame *)malloc( w->maxDepth * sizeof(struct DirWalkFrame) );
+    w->path[0] = '\0';
+    w->depth = -1;
+    w->pending = 0;
+    w->dirSectors = 1;
+
+    struct DirWalkFrame* fr = &w->frames[0];
     char buf[512] = {0};
+    int fd = containerOpen(opt.filename, CONTAINER_READ);
 
-    fd = containerOpen(opt.filename, CONTAINER_READ);
     sectorRead(buf, fd, sector);
-    buf2dir(buf, &d);
+    buf2dir(buf, &fr->d);
+    containerClose(fd);
+    fr->sector = sector;
+    fr->dirSector = sector;
+    fr->idx = 0;
+    fr->pathLen = 0;
+    w->depth = 0;
+}
+
+void dirWalk_prefetch(int fd, struct Dir* d) {
+    // Ask for the dir extention, every linked sector and their aggregate records before they are needed
+    int sectors[ 1 + 31 * 2 ];
+    int n = 0;
 
+    if (d->frwd != 0) {
+        sectors[ n++ ] = d->frwd;
+    }
     for (int i=0; i<31; i++) {
+        if (d->Idx[i].type == 'D' || d->Idx[i].type == 'U') {
+            sectors[ n++ ] = d->Idx[i].link;
 
-        switch (d.Idx[i].type) {
-            case 'D':
-                printf("\tDirectory\t%s\n", d.Idx[i].name);
-                break;
-            case 'U':
-                printf("\tUserFile\t%s\n", d.Idx[i].name);
-                break;
-            case 'F': // no print
-                break;
+            if (super.features & FEAT_AGGREGATES) {
+                sectors[ n++ ] = super.aggTable + d->Idx[i].link / AGG_PER_SECTOR;
+            }
+        }
+    }
+    sectorPrefetchMany(fd, sectors, n);
+}
+
+int dirWalk_next(struct DirWalk* w, struct DirEntryPlus* e) {
+    /* Returns the next used entry of the walk in pre-order (a dir is returned
+     *  before its contents). Returns 0 when the walk is done.
+     */
+    int fd = 0;
+    char buf[512] = {0};
+
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+
+    if (w->pending != 0) {  // sub-dir returned by last call
+        struct DirWalkFrame* fr;
+
+        if (w->depth + 1 == w->maxDepth) {
+            w->maxDepth *= 2;
+            w->frames = (struct DirWalkFrame *)realloc( w->frames, w->maxDepth * sizeof(struct DirWalkFrame) );
         }
+        fr = &w->frames[ w->depth + 1 ];
+        fr->sector = w->pending;
+        fr->dirSector = w->pending;
+        fr->idx = 0;
+        fr->pathLen = strlen(w->path) + 1;
+
+        if (fr->pathLen >= (int)sizeof(w->path) - 10) {
+            dprintf(2, "Path too deep to walk below %s\n", w->path);
+            die(&fd, 1);
+        }
+        w->path[ fr->pathLen - 1 ] = '/';
+        sectorRead(buf, fd, fr->sector);
+        buf2dir(buf, &fr->d);
+        w->pending = 0;
+        w->depth++;
+        w->dirSectors++;
     }
 
-    if (d.frwd != 0) {
-        ls_dir(d.frwd);
+    while (w->depth >= 0) {
+        struct DirWalkFrame* fr = &w->frames[ w->depth ];
+
+        if (fr->idx == 0) {
+            dirWalk_prefetch(fd, &fr->d);
+        }
+
+        if (fr->idx == 31) {
+            if (fr->d.frwd != 0) { // continue in dir extention
+                fr->sector = fr->d.frwd;
+                chainRead(buf, fd, fr->sector);
+                buf2dir(buf, &fr->d);
+                fr->idx = 0;
+                w->dirSectors++;
+            }
+            else {
+                w->depth--;
+            }
+            continue;
+        }
+        int i = fr->idx++;
+        struct FileIDX* idx = &fr->d.Idx[i];
+
+        if (idx->type != 'D' && idx->type != 'U' && idx->type != 'I') {
+            continue;
+        }
+        memcpy(e->name, idx->name, 9);
+        e->name[9] = '\0';
+        e->type = (idx->type == 'I') ? 'U' : idx->type;    // inline is only where the data is
+        e->sector = idx->link;
+        e->entry_sector = fr->sector;
+        e->entry_idx = i;
+        e->parent = fr->dirSector;
+        e->depth = w->depth;
+        e->sectors = 0;
+        e->size = 0;
+
+        if (idx->type == 'I') {     // data is in this dir sector
+            e->size = idx->size;
+        }
+        else if (super.features & FEAT_AGGREGATES) { // totals of file or whole sub-dir without a chain walk
+            struct Aggregate a;
+
+            agg_get(idx->link, &a);
+            e->sectors = a.sectors;
+            e->size = a.bytes;
+        }
+        else if (idx->type == 'U') {
+            struct Aggregate a;
+
+            fileTotals(fd, idx->link, idx->size, &a);
+            e->sectors = a.sectors;
+            e->size = a.bytes;
+        }
+        snprintf(w->path + fr->pathLen, sizeof(w->path) - fr->pathLen, "%s", e->name);
+        e->path = w->path;
+
+        if (idx->type == 'D' && w->recursive) {
+            // descend on the next call so e->path stays intact for the caller
+            w->pending = idx->link;
+        }
+        containerClose(fd);
+
+        return 1;
     }
     containerClose(fd);
+
+    return 0;
+}
+
+void dirWalk_close(struct DirWalk* w) {
+    free(w->frames);
+    w->frames = NULL;
+    w->depth = -1;
+}
+
+int chainLength(int fd, int sector) {
+    // Follows frwd links of a user file, only the 8 byte header of each sector is needed
+    char buf[512] = {0};
+    struct File f;
+    int n = 1;
+
+    sectorRead(buf, fd, sector);
+    buf2file(buf, &f);
+
+    while (f.frwd != 0) {
+        chainRead(buf, fd, f.frwd);
+        buf2file(buf, &f);
+        n++;
+    }
+
+    return n;
+}
+
+void fileTotals(int fd, int sector, short size, struct Aggregate* a) {
+    // For containers without aggregates; what the file's record would hold
+    a->sectors = chainLength(fd, sector);
+    a->files = 1;
+
+    if (size & CZ_FLAG) {
+        a->bytes = cz_rawSize(fd, sector, size);
+    }
+    else if (size & SP_FLAG) {  // extent headers tell, holes count
+        struct CzStream s;
+        int hdr[2];
+
+        a->bytes = 0;
+        cz_open(&s, fd, sector, CZ_SIZE(size));
+
+        while (cz_get(&s, (unsigned char *)hdr, 8) == 8) {
+            a->bytes += (long long)hdr[0] + hdr[1];
+            cz_get(&s, NULL, hdr[0]);
+        }
+    }
+    else if (size & DD_FLAG) {  // map sectors and the blocks, shared or not
+        int* blocks = NULL;
+        int count = dd_mapRead(fd, sector, &blocks);
+
+        for (int i=0; i<count; i++) {
+            a->sectors += (blocks[i] != DD_HOLE);
+        }
+        a->bytes = (count > 0) ? (long long)(count - 1) * 504 + CZ_SIZE(size) : 0;
+        free(blocks);
+    }
+    else {
+        a->bytes = (long long)(a->sectors - 1) * 504 + size;
+    }
+}
+
+void ls_print(struct DirEntryPlus* e) {
+    if (opt.machine) {
+        // type, sector, size, sectors, depth, path; one entry per line
+        printf("%c\t%d\t%ld\t%d\t%d\t%s\n", e->type, e->sector, e->size, e->sectors, e->depth, e->path);
+    }
+    else if (opt.longList) {
+        printf("\t%s\t%d\t%ld\t%s\n", (e->type == 'D') ? "Directory" : "UserFile",
+               e->sector, e->size, e->path);
+    }
+    else {
+        printf("\t%s\t%s\n", (e->type == 'D') ? "Directory" : "UserFile", e->path);
+    }
+}
+
+void ls_dir(int sector) {
+    struct DirWalk w;
+    struct DirEntryPlus e;
+
+    dirWalk_open(&w, sector, opt.recursive);
+
+    while ( dirWalk_next(&w, &e) ) {
+        ls_print(&e);
+    }
+    dirWalk_close(&w);
+
+    if (opt.longList && !opt.machine && (super.features & FEAT_AGGREGATES)) {
+        struct Aggregate a;
+
+        agg_get(sector, &a);
+        printf("\tTotal\t%d sectors\t%lld\t%d files\n", a.sectors, a.bytes, a.files);
+    }
 }
 
 void ls_file() {
@@ -323,39 +869,212 @@ void ls_file() {
     int containingDir, fileDir = 0;
 
     containingDir = getDirOfLastPathElementSector();
-    fd = containerOpen(opt.filename, CONTAINER_READ);
-    sectorRead(buf, fd, containingDir);
-    containerClose(fd);
-    buf2dir(buf, &d);
 
     if (userPath.elementCount == 0) {
         fileDir = 0; //no path given so assume root dir
+        currState.file_sector_type = ' ';
     }
     else {
-        fileDir = fileIdx_search(userPath.elementArr[ userPath.elementCount - 1 ], &d);
+        fileDir = dirLookup(containingDir, userPath.elementArr[ userPath.elementCount - 1 ]);
     }
 
     //  file_sector_type        // Found file is this sector type: D/U
     //  file_entry_idx;         // Found file is at this array index
     //  file_entry_idx_sector;  // Found file has dir entry in this sector
-    printf("\tFileType\tFileName\n");  // Column header
-    printf("\t^^^^^^^^\t^^^^^^^^\n");  // Column header
+    if (opt.machine) {
+        // no header
+    }
+    else if (opt.longList) {
+        printf("\tFileType\tSector\tSize\tFileName\n");  // Column header
+        printf("\t^^^^^^^^\t^^^^^^\t^^^^\t^^^^^^^^\n");  // Column header
+    }
+    else {
+        printf("\tFileType\tFileName\n");  // Column header
+        printf("\t^^^^^^^^\t^^^^^^^^\n");  // Column header
+    }
 
     //DEBUG
     //printf("ContainingDir: %d, Sector#: %d, sector type: %c\n", containingDir, fileDir, currState.file_sector_type);
 
     switch (currState.file_sector_type) {
-        case 'U':
-            printf("\tUserFile\t%s\n", userPath.elementArr[ userPath.elementCount - 1 ]);
+        case 'I':
+        case 'U': {
+            struct DirEntryPlus e = { .type='U', .sector=fileDir, .depth=0,
+                                      .entry_sector=currState.file_entry_idx_sector,
+                                      .entry_idx=currState.file_entry_idx };
+
+            fd = containerOpen(opt.filename, CONTAINER_READ);
+            sectorRead(buf, fd, currState.file_entry_idx_sector);
+            buf2dir(buf, &d);
+
+            if (currState.file_sector_type == 'I') {
+                e.sectors = 0;
+                e.size = d.Idx[ e.entry_idx ].size;
+            }
+            else if (super.features & FEAT_AGGREGATES) {
+                struct Aggregate a;
+
+                agg_get(fileDir, &a);
+                e.sectors = a.sectors;
+                e.size = a.bytes;
+            }
+            else {
+                struct Aggregate a;
+
+                fileTotals(fd, fileDir, d.Idx[ e.entry_idx ].size, &a);
+                e.sectors = a.sectors;
+                e.size = a.bytes;
+            }
+            containerClose(fd);
+            e.path = userPath.elementArr[ userPath.elementCount - 1 ];
+            ls_print(&e);
             break;
+        }
         case 'D':
         default:    // for root dir type is undefined
-            // ls_dir will recursively ls files and dirs
+            // ls_dir will list files and dirs (recursively with -R)
             ls_dir(fileDir);
             break;
     }
 }
 
+void du_file() {
+    // Subtree totals of user-given path. O(depth) with the aggregate table,
+    //  containers made before it existed get a full walk instead
+    struct Aggregate a = { .bytes=0, .sectors=0, .files=0 };
+    int sector = 0;
+
+    sector = getFileSector();
+
+    if (sector < 0) {
+        printf("File or directory %s not found\n", opt.path);
+        exit(1);
+    }
+
+    if (userPath.elementCount > 0 && currState.file_sector_type == 'I') {
+        int fd = containerOpen(opt.filename, CONTAINER_READ);
+        char buf[512] = {0};
+        struct Dir d;
+
+        sectorRead(buf, fd, currState.file_entry_idx_sector);
+        buf2dir(buf, &d);
+        a.bytes = d.Idx[ currState.file_entry_idx ].size;
+        a.files = 1;
+        containerClose(fd);
+    }
+    else if (super.features & FEAT_AGGREGATES) {
+        agg_get(sector, &a);
+    }
+    else if (userPath.elementCount > 0 && currState.file_sector_type == 'U') {
+        int fd = containerOpen(opt.filename, CONTAINER_READ);
+        char buf[512] = {0};
+        struct Dir d;
+
+        sectorRead(buf, fd, currState.file_entry_idx_sector);
+        buf2dir(buf, &d);
+        fileTotals(fd, sector, d.Idx[ currState.file_entry_idx ].size, &a);
+        containerClose(fd);
+    }
+    else {
+        struct DirWalk w;
+        struct DirEntryPlus e;
+
+        dirWalk_open(&w, sector, 1);
+
+        while ( dirWalk_next(&w, &e) ) {
+            if (e.type == 'U') {
+                a.bytes += e.size;
+                a.sectors += e.sectors;
+                a.files++;
+            }
+        }
+        a.sectors += w.dirSectors;
+        dirWalk_close(&w);
+    }
+
+    if (opt.machine) {
+        printf("%lld\t%d\t%d\t%s\n", a.bytes, a.sectors, a.files, opt.path);
+    }
+    else {
+        printf("\tBytes\tSectors\tFiles\tPath\n");   // Column header
+        printf("\t^^^^^\t^^^^^^^\t^^^^^\t^^^^\n");   // Column header
+        printf("\t%lld\t%d\t%d\t%s\n", a.bytes, a.sectors, a.files, opt.path);
+    }
+}
+
+void find_file() {
+    /* Looks up last element of user-given path in the name index; a trailing *
+     *  lists every name starting with what comes before it.
+     */
+    char* name = opt.path;
+    struct NameRec key = { .type=' ', .idx=-1, .sector=-1, .child=0 };
+    struct NameNode n;
+    char dirPath[1024] = {0};
+    int prefixLen = 0;
+    int pos = 0;
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d;
+
+    if ( !(super.features & FEAT_NAMEIDX) ) {
+        printf("Container %s has no name index; create it with: -c reindex\n", opt.filename);
+        exit(1);
+    }
+    if (userPath.elementCount > 0) {
+        name = userPath.elementArr[ userPath.elementCount - 1 ];
+    }
+    prefixLen = strlen(name);
+
+    if (prefixLen > 0 && name[ prefixLen - 1 ] == '*') {
+        prefixLen--;
+    }
+    else {
+        prefixLen = 9;  // whole name must match
+    }
+    memset(key.name, 0, sizeof(key.name));
+    strncpy(key.name, name, (prefixLen < 9) ? prefixLen : 9);
+
+    nameIdx_seek(&key, &n, &pos);
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+
+    if (!opt.machine) {
+        printf("\tFileType\tSector\tPath\n");  // Column header
+        printf("\t^^^^^^^^\t^^^^^^\t^^^^\n");  // Column header
+    }
+
+    while (1) {
+        if (pos == n.count) {
+            if (n.frwd == 0) {
+                break;
+            }
+            sectorRead(buf, fd, n.frwd);
+            buf2node(buf, &n);
+            pos = 0;
+            continue;
+        }
+        struct NameRec* r = &n.rec[ pos++ ];
+
+        if (strncmp(r->name, key.name, prefixLen) != 0) {
+            break;  // past last match
+        }
+        sectorRead(buf, fd, r->sector);
+        buf2dir(buf, &d);
+
+        if ( !dirPathOf(r->sector, dirPath, sizeof(dirPath)) ) {
+            strncpy(dirPath, "?", sizeof(dirPath));
+        }
+        if (opt.machine) {
+            printf("%c\t%d\t%d\t%d\t%s%s%s\n", r->type, d.Idx[ (int)r->idx ].link, r->sector, r->idx,
+                   dirPath, (strcmp(dirPath, "/") == 0) ? "" : "/", r->name);
+        }
+        else {
+            printf("\t%s\t%d\t%s%s%s\n", (r->type == 'D') ? "Directory" : "UserFile", d.Idx[ (int)r->idx ].link,
+                   dirPath, (strcmp(dirPath, "/") == 0) ? "" : "/", r->name);
+        }
+    }
+    containerClose(fd);
+}
+
 int extendDir(int sector) {
     int fd = 0;         // File descriptor of container
     char buf[512] = {0};
@@ -365,6 +1084,11 @@ int extendDir(int sector) {
 
     newSector = get2FreeSectors();
 
+    if (newSector == 0) {
+        printf("No free sectors!\n");
+        exit(255);
+    }
+
     fd = containerOpen(opt.filename, CONTAINER_READWRITE);
     sectorRead(buf, fd, sector);
     buf2dir(buf, &d);
@@ -401,8 +1125,14 @@ int extendFile(int sector) {
     struct Dir d;
     int newSector = 0;
 
+    currState.alloc_goal = sector + 1;  // keep the chain in a run if policy allows
     newSector = get2FreeSectors();
 
+    if (newSector == 0) {
+        printf("No free sectors!\n");
+        exit(255);
+    }
+
     fd = containerOpen(opt.filename, CONTAINER_READWRITE);
     sectorRead(buf, fd, sector);
     buf2file(buf, &f);
@@ -438,10 +1168,12 @@ void create_file(char type) {      // CREATE type, (name taken from global userP
     struct Dir d;
     int origSector = currState.curr_sector;
     int dirSector = 0;  // holds link returned by search
+    int dirPath[ userPath.elementCount + 1 ];  // sectors of dirs walked so far, for aggregates
+    int dirCount = 1;
+    int expected = currState.alloc_len;     // sectors expected in user file, set by open_file()
 
+    dirPath[0] = 0;
     fd = containerOpen(opt.filename, CONTAINER_READWRITE);
-    sectorRead(buf, fd, 0);
-    buf2dir(buf, &d);
     get2FreeSectors();
 
     if (currState.free == 0) {
@@ -451,16 +1183,61 @@ void create_file(char type) {      // CREATE type, (name taken from global userP
             
     for (int i=0; i<userPath.elementCount; i++) {
         //DEBUG
-        //printf("Searching for %s in sector %d\n", userPath.elementArr[i], currState.curr_sector);
+        //printf("Searching for %s in sector %d\n", userPath.elementArr[i], dirPath[ dirCount - 1 ]);
 
-        dirSector = fileIdx_search( userPath.elementArr[i], &d ); 
+        dirSector = dirLookup( dirPath[ dirCount - 1 ], userPath.elementArr[i] );
 
         //printf("DirSector: %d\n", dirSector);
 
-        if ( dirSector < 0 ) {
-            // Not found; mkdir() or touch()
+        if ( dirSector < 0 && i == userPath.elementCount - 1 && type == 'U'
+             && (super.features & FEAT_INLINE) && currState.inline_size >= 0
+             && currState.inline_size <= super.inlineMax ) {
+            // Small user file; entry and the 'C' entries for its data in a row
+            int slots = INLINE_SLOTS(currState.inline_size);
+
+            sectorRead(buf, fd, dirPath[ dirCount - 1 ]);
+            buf2dir(buf, &d);
+            currState.dir_extended = 0;
+            int arr_idx = fileIdx_getArrRun(&d, 1 + slots, 1);
+
+            printf("Creating inline file %s in sector %d at arr_idx %d\n", userPath.elementArr[i],
+                   currState.arr_idx_sector, arr_idx);
+            d.Idx[arr_idx].link = currState.arr_idx_sector;
+            d.Idx[arr_idx].type = 'I';
+            memset(d.Idx[arr_idx].name, 0, sizeof(d.Idx[arr_idx].name));
+            strncpy(d.Idx[arr_idx].name, userPath.elementArr[i], 9);
+            d.Idx[arr_idx].size = 0x0000;
+
+            for (int k=1; k<=slots; k++) {
+                memset(&d.Idx[ arr_idx + k ], 0, sizeof(struct FileIDX));
+                d.Idx[ arr_idx + k ].type = 'C';
+            }
+            dir2buf(buf, d);
+            sectorWrite(buf, fd, currState.arr_idx_sector);
+
+            // No sectors of its own; parents gain the file (and any dir extention)
+            agg_addPath(dirPath, dirCount, 0, currState.dir_extended, 1);
+
+            struct Dentry created = { .dir=dirPath[ dirCount - 1 ], .type='I', .link=currState.arr_idx_sector,
+                                      .entry_sector=currState.arr_idx_sector, .entry_idx=arr_idx };
+            strncpy(created.name, userPath.elementArr[i], 9);
+            created.name[9] = '\0';
+            dcache_insert(&dcache, &created);
+            nameIdx_insert(userPath.elementArr[i], 'U', currState.arr_idx_sector, arr_idx);
+        }
+        else if ( dirSector < 0 ) {
+            // Not found; mkdir() or touch() in first free entry of dir
+            sectorRead(buf, fd, dirPath[ dirCount - 1 ]);
+            buf2dir(buf, &d);
+            currState.dir_extended = 0;
             int arr_idx = fileIdx_getArrIdx(&d);
 
+            // Place new file or dir by policy: near its parent, in a run or group
+            currState.alloc_goal = dirPath[ dirCount - 1 ];
+            currState.alloc_len = (i == userPath.elementCount - 1 && type == 'U') ? expected : 1;
+            currState.alloc_dir = (type == 'D');
+            get2FreeSectors();
+
             printf("Creating file %s in sector %d at arr_idx %d\n", userPath.elementArr[i], currState.free, arr_idx);
             file_idx[arr_idx].link = currState.free;
 
@@ -478,11 +1255,12 @@ void create_file(char type) {      // CREATE type, (name taken from global userP
             sectorWrite(buf, fd, currState.arr_idx_sector); //currState.curr_sector);
 
             // Load new dir for remaining
-            sectorRead(buf, fd, currState.free);
+            freeRead(buf, fd, currState.free);
 
             if (type == 'D') {
                 buf2dir(buf, &d);
                 d.frwd = 0;
+                d.back = dirPath[ dirCount - 1 ];  // parent, lets find rebuild paths
 
                 for (int i=0; i<31; i++) {
                     //snprintf(tmpStr, 10, "%d", i);
@@ -510,14 +1288,27 @@ void create_file(char type) {      // CREATE type, (name taken from global userP
             dir2buf(buf, d);
             sectorWrite(buf, fd, 0);
 
+            // New file or dir starts out empty, parents gain its sector (and dir extention)
+            struct Aggregate a = { .bytes=0, .sectors=1, .files=(type == 'U') };
+            agg_put(currState.free, &a);
+            agg_addPath(dirPath, dirCount, 0, 1 + currState.dir_extended, a.files);
+
+            struct Dentry created = { .dir=dirPath[ dirCount - 1 ], .type=type, .link=currState.free,
+                                      .entry_sector=currState.arr_idx_sector, .entry_idx=arr_idx };
+            strncpy(created.name, userPath.elementArr[i], 9);
+            created.name[9] = '\0';
+            dcache_insert(&dcache, &created);
+
             // load created file before ending
             sectorRead(buf, fd, currState.free);
             if (type == 'D') {
                 buf2dir(buf, &d);
+                dirPath[ dirCount++ ] = currState.curr_sector;
             }
             else if (type == 'U') {
                 buf2file(buf, &f);
             }
+            nameIdx_insert(userPath.elementArr[i], type, currState.arr_idx_sector, arr_idx);
         }
         else if ( dirSector == 0 ) {
             //issue as nothing should point to root sector
@@ -529,6 +1320,7 @@ void create_file(char type) {      // CREATE type, (name taken from global userP
             if (i == userPath.elementCount -1) {
                 printf("Element already exists, recreating...\n");
                 rm_file();
+                currState.alloc_len = expected;
                 
                 if (type == 'D') {
                     create_file('D');
@@ -537,9 +1329,8 @@ void create_file(char type) {      // CREATE type, (name taken from global userP
                     create_file('U');
                 }
             }
-            else { // just load dir and go to next
-                sectorRead(buf, fd, dirSector);
-                buf2dir(buf, &d);
+            else { // just go to next dir
+                dirPath[ dirCount++ ] = dirSector;
             }
         }
         get2FreeSectors();
@@ -553,58 +1344,154 @@ void open_file(char mode, char* name) {     // OPEN mode, name (mode={I}nput (ov
     struct Dir d;
     struct File f;
     char buf[BUF_SIZE] = {0};
-    int sector, dirSector = 0;
+    int sector = 0;
     short size = 0;
 
-    dirSector = getDirOfLastPathElementSector();
-
+    (void)name;     // the entry is found from userPath, see getFileSector()
     fd = containerOpen(opt.filename, CONTAINER_READWRITE);
-    sectorRead(buf, fd, dirSector);
 
-    buf2dir(buf, &d);
-
-    for (int i=0; i<31; i++) {
+    if ( (sector = getFileSector()) == -1 ) {
+        struct stat src_stat;
 
-        if ( strncmp( d.Idx[i].name, name, 9 ) == 0 ) {
-            size = d.Idx[i].size;
+        if (mode == 'I' && src_info(&src_stat) == 0) {   // lets allocator find a run
+            currState.alloc_len = (src_stat.st_size + 503) / 504;
         }
-    }
-    
-    if ( (sector = getFileSector()) == -1 ) {
+        currState.inline_size = (mode == 'O') ? 0 : inline_size(0);
         create_file('U');
         sector = getFileSector();
     }
-    //sectorRead(sectBuf, fd_out, sector);
-    //buf2file(sectBuf, &f);
+    sectorRead(buf, fd, currState.file_entry_idx_sector);
+    buf2dir(buf, &d);
+    size = d.Idx[ currState.file_entry_idx ].size;
 
-    switch (mode) {
-        case 'I':
-            write_2_file(sector, 0);
-            break;
-        case 'O':
-            read_file(sector, size);
-            break;
-        case 'A':
-            sectorRead(buf, fd, sector);
-            buf2file(buf, &f);
-            
-            if (f.frwd == 0) {
-                //DEBUG
-                printf("single sector file append!\n");
-                printf("Sec: %d, oset: %d\n", sector, 0);
-                write_2_file(sector, size + 1);
-            }
-            else {
+    if (currState.file_sector_type == 'I') {
+        char data[INLINE_MAX] = {0};
+        int keep = 0;                           // bytes kept in front of -i data
 
-                while (f.frwd != 0) {
-                    sector = f.frwd;
-                    sectorRead(buf, fd, sector);
+        size = (size < 0 || size > INLINE_MAX) ? 0 : size;
+        keep = (mode == 'A') ? size : 0;
+        inline_get(buf, currState.file_entry_idx, data, size);
+
+        if (mode == 'O') {
+            fwrite(data, 1, size, stdout);
+            return;
+        }
+        int newSize = inline_size(keep);
+
+        if (newSize < 0 || INLINE_SLOTS(newSize) > inline_slots(&d, currState.file_entry_idx)) {
+            // No room after it; inline again elsewhere in the dir, or promoted to sectors
+            struct stat src_stat;
+
+            rm_file();
+
+            if (newSize < 0 && src_info(&src_stat) == 0) {
+                currState.alloc_len = (keep + src_stat.st_size + 503) / 504;
+            }
+            currState.inline_size = newSize;
+            create_file('U');
+            sector = getFileSector();
+        }
+        if (currState.file_sector_type == 'I') {
+            inline_write(data, keep);
+            return;
+        }
+        currState.stream = 1;
+
+        if (keep == 0 && opt.compress) {
+            cz_write(sector, 0);
+            return;
+        }
+        if (keep == 0 && ddTable.refs != NULL) {
+            dd_write(sector, 0);
+            return;
+        }
+        if (keep == 0 && (super.features & FEAT_SPARSE)) {
+            sp_write(sector, 0);
+            return;
+        }
+        if (keep == 0) {
+            write_2_file(sector, 0);
+            return;
+        }
+        // Kept bytes go in the first sector, -i data is appended after them
+        sectorRead(buf, fd, sector);
+        buf2file(buf, &f);
+        memcpy(f.data, data, keep);
+        file2buf(buf, f);
+        sectorWrite(buf, fd, sector);
+        write_2_file(sector, keep);
+
+        return;
+    }
+    //sectorRead(sectBuf, fd_out, sector);
+    //buf2file(sectBuf, &f);
+    currState.stream = 1;       // -D: what is read and written from here is file data
+
+    switch (mode) {
+        case 'I':
+            if ((size & DD_FLAG) && opt.compress) {
+                dd_drop(fd, sector);    // blocks released, chain is overwritten as is
+            }
+            if (opt.compress) {
+                cz_write(sector, 0);
+            }
+            else if (ddTable.refs != NULL) {
+                dd_write(sector, 0);
+            }
+            else if (super.features & FEAT_SPARSE) {
+                sp_write(sector, 0);
+            }
+            else {
+                write_2_file(sector, 0);
+            }
+            break;
+        case 'O':
+            if (size & CZ_FLAG) {
+                cz_read(sector, size);
+            }
+            else if (size & DD_FLAG) {
+                dd_read(sector, size);
+            }
+            else if (size & SP_FLAG) {
+                sp_read(sector, size);
+            }
+            else {
+                read_file(sector, size);
+            }
+            break;
+        case 'A':
+            if (size & CZ_FLAG) {   // stays compressed
+                cz_write(sector, 1);
+                break;
+            }
+            if (size & DD_FLAG) {   // stays in blocks
+                dd_write(sector, 1);
+                break;
+            }
+            if (size & SP_FLAG) {   // extents after the last
+                sp_write(sector, 1);
+                break;
+            }
+            sectorRead(buf, fd, sector);
+            buf2file(buf, &f);
+            
+            if (f.frwd == 0) {
+                //DEBUG
+                printf("single sector file append!\n");
+                printf("Sec: %d, oset: %d\n", sector, size);
+                write_2_file(sector, size);
+            }
+            else {
+
+                while (f.frwd != 0) {
+                    sector = f.frwd;
+                    sectorRead(buf, fd, sector);
                     buf2file(buf, &f);
                 }
                 //DEBUG
                 printf("multi-sector file append!\n");
-                printf("Sec: %d, oset: %d\n", sector, size+1);
-                write_2_file(sector, size + 1);
+                printf("Sec: %d, oset: %d\n", sector, size);
+                write_2_file(sector, size);
             }
             break;
     }
@@ -621,8 +1508,15 @@ void append2FreeList() {
     struct Dir d;
     fd = containerOpen(opt.filename, CONTAINER_READWRITE);
 
+    if (freeMap.valid) {
+        // block may have come off the head since the map last looked
+        sectorRead(buf, fd, 0);
+        buf2dir(buf, &d);
+        alloc_sync(d.free);
+    }
+
     // update original last-free sector
-    sectorRead(buf, fd, currState.last_free);
+    freeRead(buf, fd, currState.last_free);
     buf2dir(buf, &d);
 
     if (currState.last_free == 0) {
@@ -657,7 +1551,18 @@ void append2FreeList() {
     dir2buf(buf, d);
     sectorWrite(buf, fd, block2append);
 
-    currState.last_free = getLastFree();;
+    currState.last_free = block2append; // appended block is the new end of list
+
+    if (freeMap.valid) {
+        freeMap_append(&freeMap, block2append);
+    }
+    if (super.features & FEAT_TRIM) {     // punched when the command ends
+        if (trimList.count == trimList.cap) {
+            trimList.cap = (trimList.cap > 0) ? trimList.cap * 2 : 256;
+            trimList.sector = (int *)realloc( trimList.sector, trimList.cap * sizeof(int) );
+        }
+        trimList.sector[ trimList.count++ ] = block2append;
+    }
 
     containerClose(fd);
 }
@@ -682,7 +1587,8 @@ int getLastFree() {
         //DEBUG
         //printf("1. lastFree: %d, d.free: %d, d.frwd: %d\n", lastFree, d.free, d.frwd);
 
-        sectorRead(buf, fd, lastFree);
+        chainRead(buf, fd, lastFree);
+        freeFix(buf, lastFree);
         buf2dir(buf, &d);
         //DEBUG
         //printf("2. lastFree: %d, d.free: %d, d.frwd: %d\n", lastFree, d.free, d.frwd);
@@ -692,7 +1598,8 @@ int getLastFree() {
             //printf("lastFree: %d, d.frwd: %d", lastFree, d.frwd);
 
             lastFree = d.frwd;
-            sectorRead(buf, fd, d.frwd);
+            chainRead(buf, fd, d.frwd);
+            freeFix(buf, lastFree);
             buf2dir(buf, &d);
 
             //DEBUG
@@ -718,119 +1625,178 @@ int getFileSector() {
     //DEBUG
     //printf("got parent dir sector: %d\n", parentDir);
 
-    int fd = 0;     // File descriptor of container
-    char buf[512] = {0};
-    struct Dir d;
-
-    fd = containerOpen(opt.filename, CONTAINER_READ);
-    sectorRead(buf, fd, parentDir);
-    buf2dir(buf, &d);
-
-    return fileIdx_search(userPath.elementArr[ userPath.elementCount - 1 ], &d);
+    return dirLookup(parentDir, userPath.elementArr[ userPath.elementCount - 1 ]);
 }
 
 int getDirOfLastPathElementSector() {
     // returns sector num of next to last path element in userPath.elementArr
-    int fd = 0;         // File descriptor of container
-    char buf[512] = {0};
-    struct Dir d;
-    int dirSector = 0;  // holds link returned by search; -1 == not found
+    int dirs[ userPath.elementCount + 1 ];
 
-    if (userPath.elementCount == 0) {
-        return 0; //no path given so assume root dir
-    }
+    return dirs[ getPathDirs(dirs) - 1 ];
+}
 
-    fd = containerOpen(opt.filename, CONTAINER_READ);
-    sectorRead(buf, fd, 0);
-    buf2dir(buf, &d);
+int getPathDirs(int* dirs) {
+    // fills dirs with root sector and sector of every dir leading to last path element
+    //  dirs must hold userPath.elementCount + 1 entries; returns number filled in
+    int count = 1;
+
+    dirs[0] = 0;    // no path given so assume root dir
 
     for (int i=0; i<userPath.elementCount-1; i++) {
-        dirSector = fileIdx_search( userPath.elementArr[i], &d ); 
+        int dirSector = dirLookup( dirs[ count - 1 ], userPath.elementArr[i] );
 
         if ( dirSector < 0 ) {
             // Not found; user typo
             printf("File or directory %s not found in %s\n", userPath.elementArr[i], opt.path);
-            containerClose(fd);
             exit(1);
         }
-        else {
-            sectorRead(buf, fd, dirSector);
-            buf2dir(buf, &d);
-            //dirSector = fileIdx_search( userPath.elementArr[i], &d ); 
+        dirs[ count++ ] = dirSector;
+    }
+    //DEBUG
+    //printf("Container for element %s would be sector %d\n", userPath.elementArr[ userPath.elementCount-1 ], dirs[ count-1 ]);
+
+    return count;
+}
+
+int dirPathOf(int sector, char* path, int len) {
+    /* Walks .back links from a dir sector (or dir extention) up to root and
+     *  builds the dir's path into path. An extention's .back is the sector
+     *  before it in the chain, the first sector's .back is the parent dir.
+     *  Returns 0 when a link does not lead back to root.
+     */
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    char tmp[1024] = {0};
+    struct Dir d, p;
+
+    path[0] = '\0';
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+
+    while (sector != 0) {
+        int parent = 0;
+        int found = 0;
+
+        sectorRead(buf, fd, sector);
+        buf2dir(buf, &d);
+        parent = d.back;
+        sectorRead(buf, fd, parent);
+        buf2dir(buf, &p);
+
+        if (p.frwd == sector) { // sector is a dir extention
+            sector = parent;
+            continue;
+        }
+        while (!found) {   // find name of sector in parent and its extentions
+            for (int i=0; i<31; i++) {
+                if (p.Idx[i].type == 'D' && p.Idx[i].link == sector) {
+                    snprintf(tmp, sizeof(tmp), "/%.9s%s", p.Idx[i].name, path);
+                    strncpy(path, tmp, len - 1);
+                    path[ len - 1 ] = '\0';
+                    found = 1;
+                    break;
+                }
+            }
+            if (!found && p.frwd == 0) {
+                containerClose(fd);
+                return 0;
+            }
+            if (!found) {
+                sectorRead(buf, fd, p.frwd);
+                buf2dir(buf, &p);
+            }
         }
+        sector = parent;
     }
     containerClose(fd);
-    //DEBUG
-    //printf("Container for element %s would be sector %d\n", userPath.elementArr[ userPath.elementCount-1 ], dirSector);
 
-    return dirSector;
+    if (path[0] == '\0') {
+        strncpy(path, "/", len);
+    }
+    return 1;
 }
 
 void reapDir(struct Dir* d) {
+    // d holds dir sector currState.curr_sector; frees everything below it,
+    //  its dir extentions and the dir itself
     int fd = 0;         // File descriptor of container
-    int sector2free = 0;
-    int origSector2free = currState.curr_sector;
+    int sector = currState.curr_sector;
+    int next = 0;
     char buf[512] = {0};
     fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+    dcache_invalidateDir(&dcache, sector);     // sector may get reused as another dir
 
-    for (int i=0; i<31; i++) {
-        sector2free = d->Idx[i].link; 
-        switch (d->Idx[i].type) {
-            case 'D':
-                //Free dir entry
-                d->Idx[i].type = 'F';
-                d->Idx[i].link = 0;
-                d->Idx[i].size = 0x0000;
-                strncpy(d->Idx[i].name, "         \0", 10);
-                dir2buf(buf, *d);
-                sectorWrite(buf, fd, currState.curr_sector);
-
-                //now deal with sub-dir
-                sectorRead(buf, fd, sector2free);
-                buf2dir(buf, d);
-                reapDir(d);
-                break;
-            case 'U':
-                //Free dir entry
-                d->Idx[i].type = 'F';
-                d->Idx[i].link = 0;
-                d->Idx[i].size = 0x0000;
-                strncpy(d->Idx[i].name, "         \0", 10);
-                dir2buf(buf, *d);
-                sectorWrite(buf, fd, currState.curr_sector);
-
-                //now deal with file
-                struct File f;
-                sectorRead(buf, fd, sector2free);
-                buf2file(buf, &f);
-                reapFile(&f);
-                break;
+    while (1) {
+        for (int i=0; i<31; i++) {
+            if (d->Idx[i].type == 'D' || d->Idx[i].type == 'U' || d->Idx[i].type == 'I') {
+                nameIdx_delete(d->Idx[i].name, sector, i);
+            }
+            switch (d->Idx[i].type) {
+                case 'D': {
+                    //now deal with sub-dir
+                    struct Dir sub;
+                    sectorRead(buf, fd, d->Idx[i].link);
+                    buf2dir(buf, &sub);
+                    reapDir(&sub);
+                    break;
+                }
+                case 'U': {
+                    //now deal with file
+                    struct File f;
+                    sectorRead(buf, fd, d->Idx[i].link);
+                    buf2file(buf, &f);
+                    reapFile(&f);
+                    break;
+                }
+            }
         }
-    }
+        next = d->frwd;
+        currState.curr_sector = sector;
+        append2FreeList();
 
-    if (d->frwd != 0) {
-        sectorRead(buf, fd, d->frwd);
+        if (next == 0) {
+            break;
+        }
+        sectorRead(buf, fd, next);
         buf2dir(buf, d);
-        reapDir(d);
+        sector = next;
     }
-    append2FreeList();
-    sectorRead(buf, fd, origSector2free);
-    buf2dir(buf, d);
-    append2FreeList();
     containerClose(fd);
 }
 
 void reapFile(struct File* f) {
+    // f holds file sector currState.curr_sector; frees it and the rest of its chain
     int fd = 0;         // File descriptor of container
+    int sector = currState.curr_sector;
+    int next = 0;
     char buf[512] = {0};
     fd = containerOpen(opt.filename, CONTAINER_READWRITE);
 
-    if (f->frwd != 0) {
-        sectorRead(buf, fd, f->frwd);
+    while (1) {
+        next = f->frwd;
+
+        if (ddTable.refs != NULL && ddTable.refs[sector] == DD_MAP) {
+            // block map sector: its blocks lose a reference, shared ones stay
+            for (int i=0; i<DD_PER_MAP; i++) {
+                int block = 0;
+
+                memcpy(&block, f->data + i * 4, 4);
+                if (block == 0) {
+                    break;
+                }
+                dd_unref(block);
+            }
+            dd_set(sector, 0, 0);
+        }
+        currState.curr_sector = sector;
+        append2FreeList();
+
+        if (next == 0) {
+            break;
+        }
+        sectorRead(buf, fd, next);
         buf2file(buf, f);
-        reapFile(f);
+        sector = next;
     }
-    append2FreeList();
     containerClose(fd);
 }
 
@@ -842,28 +1808,38 @@ void rm_file() {   // DELETE name (deletes last element of opt->path and subordi
     int sector2free = 0;
     char* file2rm = userPath.elementArr[ userPath.elementCount - 1 ];
     int fileEntrySector = 0;    // sector num where directory entry of file2rm exists
+    int dirPath[ userPath.elementCount + 1 ];  // root and parent dirs, for aggregates
+    int dirCount = 0;
 
     fd = containerOpen(opt.filename, CONTAINER_READWRITE);
     currState.last_free = getLastFree(); //Freed sectors appended to the end
     //DEBUG
     //printf("Found Last Free: %d\n", currState.last_free);
 
-    dirSector = getDirOfLastPathElementSector();
+    dirCount = getPathDirs(dirPath);
+    dirSector = dirPath[ dirCount - 1 ];
     //DEBUG
     //printf("Found container Dir @ sector: %d\n", dirSector);
 
-    sectorRead(buf, fd, dirSector);
-    buf2dir(buf, &d);
-    //DEBUG
-    //printf("currSector: %d\n", currState.curr_sector);
-
     //  file_sector_type        // Found file is this sector type: D/U
     //  file_entry_idx;         // Found file is at this array index
     //  file_entry_idx_sector;  // Found file has dir entry in this sector
-    sector2free = fileIdx_search(file2rm, &d);
+    sector2free = dirLookup(dirSector, file2rm);
     //DEBUG
     //printf("FileEntrySector: %d, at index %d\n", currState.file_entry_idx_sector, currState.file_entry_idx);
 
+    if (sector2free > 0) {
+        nameIdx_delete(file2rm, currState.file_entry_idx_sector, currState.file_entry_idx);
+        dcache_remove(&dcache, dirSector, file2rm);
+    }
+    if (sector2free > 0 && currState.file_sector_type != 'I' && (super.features & FEAT_AGGREGATES)) {
+        // Parents lose everything under the removed file or dir
+        struct Aggregate a;
+
+        agg_get(sector2free, &a);
+        agg_addPath(dirPath, dirCount, -a.bytes, -a.sectors, -a.files);
+    }
+
     sectorRead(buf, fd, currState.file_entry_idx_sector);
     buf2dir(buf, &d);
 
@@ -898,6 +1874,24 @@ void rm_file() {   // DELETE name (deletes last element of opt->path and subordi
             buf2file(buf, &f);
             reapFile(&f);
             break;
+        case 'I': {
+            //Free dir entry and the entries holding its data, it has no sectors
+            int slots = inline_slots(&d, currState.file_entry_idx);
+
+            agg_addPath(dirPath, dirCount, -d.Idx[ currState.file_entry_idx ].size, 0, -1);
+
+            for (int k=0; k<=slots; k++) {
+                struct FileIDX* e = &d.Idx[ currState.file_entry_idx + k ];
+
+                e->type = 'F';
+                e->link = 0;
+                e->size = 0;
+                strncpy(e->name, "         \0", 10);
+            }
+            dir2buf(buf, d);
+            sectorWrite(buf, fd, currState.file_entry_idx_sector);
+            break;
+        }
     }
     containerClose(fd);
 }
@@ -918,7 +1912,7 @@ void read_file(int sector, short size) {
             printf("%c", f.data[i]);
         }
         memset(buf, 0, BUF_SIZE);
-        sectorRead(buf, fd, f.frwd);
+        chainRead(buf, fd, f.frwd);
         buf2file(buf, &f);
     }
 
@@ -928,373 +1922,6072 @@ void read_file(int sector, short size) {
     containerClose(fd);
 }
 
-void write_2_file(int sector, int offset) { // WRITE n data (write n bytes of data)
-    int fd_in, fd_out, bytes_wrote, bc_read = 0; // file descriptors, byte counter
-    char wrote504 = '0';        // '1' indicates full sector was written so need to extendFile()
-    char sectBuf[512] = {0};
-    char dataBuf[504] = {0};
-    struct File f;
+int src_open() {
+    if (srcData.data != NULL) {
+        srcData.pos = 0;
+        return SRC_MEM;
+    }
+    return open(opt.src, CONTAINER_READ);
+}
 
-    fd_in = open(opt.src, CONTAINER_READ);
-    if (fd_in < 0) {
-        dprintf(2, "Could not open file %s for reading; %s\n", opt.src, strerror(errno));
-        die(&fd_in, 255);
+int src_read(int fd, void* buf, int len) {
+    if (fd != SRC_MEM) {
+        return read(fd, buf, len);
+    }
+    if (len > srcData.len - srcData.pos) {
+        len = srcData.len - srcData.pos;
     }
+    memcpy(buf, srcData.data + srcData.pos, len);
+    srcData.pos += len;
 
-    fd_out = containerOpen(opt.filename, CONTAINER_READWRITE);
-    sectorRead(sectBuf, fd_out, sector);
-    buf2file(sectBuf, &f);
+    return len;
+}
 
-    if (offset > 0) {   //we are appending, need to fill out last sector
-        memcpy( &dataBuf, &f.data, 504); // need to prime w/ existing data
-        print_hex_memory(dataBuf, 504);
+off_t src_seek(int fd, off_t off, int whence) {
+    if (fd != SRC_MEM) {
+        return lseek(fd, off, whence);
+    }
+    if (whence == SEEK_END) {
+        off += srcData.len;
+    }
+    else if (whence == SEEK_DATA && off >= srcData.len) {
+        errno = ENXIO;
+        return -1;
+    }
+    srcData.pos = off;
 
-        bc_read = read(fd_in, dataBuf+(offset-2), (504-offset+2) );
+    return off;
+}
 
-        print_hex_memory(dataBuf, 504);
-        //memcpy( &f.data, &dataBuf, bc_read);
-        memcpy(&f.data, &dataBuf, 504);
-        file2buf(sectBuf, f);
-        //DEBUG
-        printf("write_2_file, sector: %d offset: %d\n", sector, offset);
+int src_info(struct stat* st) {
+    if (srcData.data == NULL) {
+        return stat(opt.src, st);
+    }
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFREG;
+    st->st_size = srcData.len;
 
-        sectorWrite(sectBuf, fd_out, sector);
-        memset(dataBuf, 0, 504);
+    return 0;
+}
 
-        wrote504 = ( bc_read == (504-offset+2) ) ? '1' : '0'; // if less, no more cp
-        //DEBUG
-        printf("1.bytes_read: %d, wrote504: %c\n", bc_read, wrote504);
-        bytes_wrote = bc_read;
+void src_close(int fd) {
+    if (fd != SRC_MEM) {
+        close(fd);
     }
-    else { //overwrite
-        bc_read = read(fd_in, &dataBuf, 504);
-        memcpy( &f.data, &dataBuf, bc_read);
-        file2buf(sectBuf, f);
-        sectorWrite(sectBuf, fd_out, sector);
-        memset(dataBuf, 0, 504);
+}
 
-        if (bc_read == 504) { // indicate we wrote a full sector
-            wrote504 = '1';
-        }
-        else { // last read, need to update .size of dir entry after save
-            wrote504 = '0';
-        }
-        bytes_wrote = bc_read;
+int inline_size(int keep) {
+    // Bytes of user file once -i data is added after keep bytes; -1 when the
+    //  container keeps no inline files or the result (or -i) is too big for one
+    struct stat src_stat;
+
+    if ( !(super.features & FEAT_INLINE) || opt.src == NULL ) {
+        return -1;
     }
-    //DEBUG
-    printf("2.bytes_read: %d, wrote504: %c\n", bc_read, wrote504);
+    if (src_info(&src_stat) != 0 || !S_ISREG(src_stat.st_mode)
+        || keep + src_stat.st_size > super.inlineMax) {
+        return -1;
+    }
+    return keep + (int)src_stat.st_size;
+}
 
-    if (wrote504 == '1') {  // if copying more is needed...
+int inline_slots(struct Dir* d, int idx) {
+    int n = 0;
 
-        while ( (bc_read = read(fd_in, dataBuf, 504)) > 0 ) {
+    while (idx + 1 + n < 31 && d->Idx[ idx + 1 + n ].type == 'C') {
+        n++;
+    }
+    return n;
+}
 
-            if (wrote504 == '1') {
-                // need to extend sector and load it
-                //DEBUG
-                printf("Orig sector: %d\n", sector);
-                sector = extendFile(sector);
-                //DEBUG
-                printf("New sector: %d\n", sector);
-                sectorRead( sectBuf, fd_out, sector);
-                buf2file(sectBuf, &f);
-            }
-            // Save the data
-            memcpy( &f.data, &dataBuf, bc_read);
-            file2buf(sectBuf, f);
-            //DEBUG
-            printf("Sector written: %d\n", sector);
-            sectorWrite(sectBuf, fd_out, sector);
-            memset(dataBuf, 0, 504);
+void inline_get(char* buf, int idx, char* data, int size) {
+    // Byte k is in entry idx + 1 + k/15; each entry holds 13 bytes before .type, 2 after
+    for (int k=0; k<size; k++) {
+        int off = k % INLINE_PER_SLOT;
 
-            if (bc_read == 504) { // indicate we wrote a full sector
-                wrote504 = '1';
-            }
-            else { // last read, need to update .size of dir entry after save
-                wrote504 = '0';
-            }
-            // loop 2 cp moar
-            bytes_wrote = bc_read;
-        }
-    }
-    /*
-    else {  // Save the data
-        memcpy( &f.data, &dataBuf, bytes_wrote);
-        file2buf(sectBuf, f);
-        //DEBUG
-        printf("Sector written: %d\n", sector);
-        sectorWrite(sectBuf, fd_out, sector);
+        data[k] = buf[ 16 + (idx + 1 + k / INLINE_PER_SLOT) * 16 + off + (off >= 13) ];
     }
-    */
-    //update dir entry
-    printf("bytes_wrote: %d, wrote504: %c\n", bytes_wrote, wrote504);
-    struct Dir d;
-    sector = getDirOfLastPathElementSector();
-    sectorRead(sectBuf, fd_out, sector);
-    buf2dir(sectBuf, &d);
-
-    for (int i=0; i<31; i++) {
+}
 
-        if ( strncmp( d.Idx[i].name, userPath.elementArr[ userPath.elementCount - 1 ], 9) == 0 ) {
+void inline_put(char* buf, int idx, char* data, int size) {
+    for (int k=0; k<size; k++) {
+        int off = k % INLINE_PER_SLOT;
 
-            //DEBUG
-            printf("DirUpdate bytes_wrote: %d, wrote504: %c\n", bc_read, wrote504);
+        buf[ 16 + (idx + 1 + k / INLINE_PER_SLOT) * 16 + off + (off >= 13) ] = data[k];
+    }
+}
 
-            switch (bytes_wrote) {
-                case 0: // edge case of input file exactly 504 bytes
-                    d.Idx[i].size = 504;
-                    break;
-                default:
-                    d.Idx[i].size = bytes_wrote;
+void inline_write(char* data, int keep) {
+    /* data holds keep bytes; -i data is added after them and all of it stored
+     *  in the inline file found last. 'C' entries it no longer needs are freed.
+     */
+    int fd_in, fd_out = 0;      // file descriptors
+    char buf[BUF_SIZE] = {0};
+    struct Dir d;
+    int idx = currState.file_entry_idx;
+    int sector = currState.file_entry_idx_sector;
+    int slots = 0;
+    int size = keep;
+    int old = 0;
+    int n = 0;
+
+    fd_in = src_open();
+    if (fd_in < 0) {
+        dprintf(2, "Could not open file %s for reading; %s\n", opt.src, strerror(errno));
+        die(&fd_in, 255);
+    }
+    fd_out = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorRead(buf, fd_out, sector);
+    buf2dir(buf, &d);
+    slots = inline_slots(&d, idx);
+    old = d.Idx[idx].size;
+
+    while ( size < slots * INLINE_PER_SLOT
+            && (n = src_read(fd_in, data + size, slots * INLINE_PER_SLOT - size)) > 0 ) {
+        size += n;
+    }
+    if (src_read(fd_in, buf, 1) > 0) {  // buf is read again below
+        printf("%s grew while being read, kept first %d bytes\n", opt.src, size);
+    }
+    src_close(fd_in);
+
+    for (int k = 1 + INLINE_SLOTS(size); k <= slots; k++) {
+        struct FileIDX* e = &d.Idx[ idx + k ];
+
+        e->type = 'F';
+        e->link = 0;
+        e->size = 0;
+        strncpy(e->name, "         \0", 10);
+    }
+    d.Idx[idx].size = size;
+    dir2buf(buf, d);
+    inline_put(buf, idx, data, size);
+    sectorWrite(buf, fd_out, sector);
+    printf("Wrote %d bytes inline in sector %d at arr_idx %d\n", size, sector, idx);
+
+    if (super.features & FEAT_AGGREGATES) {
+        int dirPath[ userPath.elementCount + 1 ];  // root and parent dirs, for aggregates
+        int dirCount = getPathDirs(dirPath);
+
+        agg_addPath(dirPath, dirCount, size - old, 0, 0);
+    }
+    containerClose(fd_out);
+}
+
+void cz_open(struct CzStream* s, int fd, int sector, int last) {
+    char buf[512] = {0};
+
+    s->fd = fd;
+    s->sector = sector;
+    s->pos = 0;
+    s->last = last;
+    s->sectors = 1;
+    sectorRead(buf, fd, sector);
+    buf2file(buf, &s->f);
+}
+
+int cz_get(struct CzStream* s, unsigned char* out, int n) {
+    char buf[512] = {0};
+    int got = 0;
+
+    while (got < n) {
+        int avail = ( (s->f.frwd == 0) ? s->last : 504 ) - s->pos;
+
+        if (avail <= 0) {
+            if (s->f.frwd == 0) {
+                break;
+            }
+            s->sector = s->f.frwd;
+            chainRead(buf, s->fd, s->sector);
+            buf2file(buf, &s->f);
+            s->pos = 0;
+            s->sectors++;
+            continue;
+        }
+        if (avail > n - got) {
+            avail = n - got;
+        }
+        if (out != NULL) {
+            memcpy(out + got, s->f.data + s->pos, avail);
+        }
+        s->pos += avail;
+        got += avail;
+    }
+    return got;
+}
+
+void cz_put(struct CzStream* s, unsigned char* in, int n) {
+    char buf[512] = {0};
+
+    while (n > 0) {
+        if (s->pos == 504) {
+            file2buf(buf, s->f);
+            sectorWrite(buf, s->fd, s->sector);
+
+            if (s->f.frwd != 0) {   // writing over a chain that goes on
+                s->sector = s->f.frwd;
+            }
+            else {
+                s->sector = extendFile(s->sector);
+            }
+            sectorRead(buf, s->fd, s->sector);
+            buf2file(buf, &s->f);
+            s->pos = 0;
+            s->sectors++;
+        }
+        int k = (504 - s->pos < n) ? 504 - s->pos : n;
+
+        memcpy(s->f.data + s->pos, in, k);
+        s->pos += k;
+        in += k;
+        n -= k;
+    }
+}
+
+int cz_close(struct CzStream* s) {
+    char buf[512] = {0};
+    int rest = s->f.frwd;
+
+    s->f.frwd = 0;
+    file2buf(buf, s->f);
+    sectorWrite(buf, s->fd, s->sector);
+
+    if (rest != 0) {    // old chain was longer
+        struct File tail;
+
+        currState.last_free = getLastFree();
+        sectorRead(buf, s->fd, rest);
+        buf2file(buf, &tail);
+        reapFile(&tail);
+    }
+    return s->pos;
+}
+
+void cz_read(int sector, short size) {
+    // cat of compressed file, one group at a time
+    int fd = 0;         // File descriptor of container
+    struct CzStream s;
+    unsigned char hdr[4];
+    unsigned char* comp = (unsigned char *)malloc(CZ_GROUP);
+    unsigned char* raw = (unsigned char *)malloc(CZ_GROUP);
+
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    cz_open(&s, fd, sector, CZ_SIZE(size));
+
+    while (cz_get(&s, hdr, 4) == 4) {
+        int stored = hdr[0] | (hdr[1] << 8);
+        int rawLen = hdr[2] | (hdr[3] << 8);
+        int len = stored & ~CZ_RAW;
+
+        if (len > CZ_GROUP || rawLen > CZ_GROUP || cz_get(&s, comp, len) != len
+            || ( !(stored & CZ_RAW) && lz_decompress(comp, len, raw, CZ_GROUP) != rawLen )) {
+            dprintf(2, "Compressed data of %s is damaged in sector %d\n", opt.path, s.sector);
+            die(&fd, 3);
+        }
+        fwrite((stored & CZ_RAW) ? comp : raw, 1, (stored & CZ_RAW) ? len : rawLen, stdout);
+    }
+    containerClose(fd);
+    free(comp);
+    free(raw);
+}
+
+void cz_write(int sector, int append) {
+    /* -i data goes in groups of CZ_GROUP bytes, each compressed when that makes
+     *  it smaller. Appending decompresses the last group when it is not full and
+     *  writes it again with the new data; groups before it stay as they are.
+     */
+    int fd_in, fd_out = 0;      // file descriptors
+    char buf[512] = {0};
+    struct CzStream s;
+    struct Dir d;
+    unsigned char hdr[4];
+    unsigned char* comp = (unsigned char *)malloc(CZ_GROUP);
+    unsigned char* raw = (unsigned char *)malloc(CZ_GROUP);
+    int fill = 0;               // bytes in raw
+    long long total = 0;        // bytes before compression of groups written before raw
+    int dirPath[ userPath.elementCount + 1 ];  // root and parent dirs, for aggregates
+    int dirCount = getPathDirs(dirPath);
+    int first = dirLookup(dirPath[ dirCount - 1 ], userPath.elementArr[ userPath.elementCount - 1 ]);
+    short size = 0;
+
+    fd_in = src_open();
+    if (fd_in < 0) {
+        dprintf(2, "Could not open file %s for reading; %s\n", opt.src, strerror(errno));
+        die(&fd_in, 255);
+    }
+    fd_out = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorRead(buf, fd_out, currState.file_entry_idx_sector);
+    buf2dir(buf, &d);
+    size = d.Idx[ currState.file_entry_idx ].size;
+    cz_open(&s, fd_out, sector, (append && (size & CZ_FLAG)) ? CZ_SIZE(size) : 0);
+
+    if (append) {   // find last group
+        struct CzStream at = s;     // where group being looked at starts
+        int stored = 0;
+        int rawLen = CZ_GROUP;
+
+        while (cz_get(&s, hdr, 4) == 4) {
+            stored = hdr[0] | (hdr[1] << 8);
+            rawLen = hdr[2] | (hdr[3] << 8);
+
+            if ((stored & ~CZ_RAW) > CZ_GROUP || cz_get(&s, comp, stored & ~CZ_RAW) != (stored & ~CZ_RAW)) {
+                dprintf(2, "Compressed data of %s is damaged in sector %d\n", opt.path, s.sector);
+                die(&fd_out, 3);
+            }
+            total += rawLen;
+
+            if (rawLen < CZ_GROUP) {
+                break;      // only the last group is not full
+            }
+            at = s;
+        }
+        if (rawLen < CZ_GROUP) {    // written again with the new data
+            if (stored & CZ_RAW) {
+                memcpy(raw, comp, rawLen);
+            }
+            else if (lz_decompress(comp, stored, raw, CZ_GROUP) != rawLen) {
+                dprintf(2, "Compressed data of %s is damaged in sector %d\n", opt.path, s.sector);
+                die(&fd_out, 3);
+            }
+            fill = rawLen;
+            total -= rawLen;
+            s = at;
+        }
+    }
+
+    while (1) {
+        int n = src_read(fd_in, raw + fill, CZ_GROUP - fill);
+
+        if (n > 0) {
+            fill += n;
+        }
+        if (fill == CZ_GROUP || (n <= 0 && fill > 0)) {
+            int len = lz_compress(raw, fill, comp, fill - 1);
+            int stored = (len > 0) ? len : (fill | CZ_RAW);
+
+            hdr[0] = stored & 0xff;
+            hdr[1] = stored >> 8;
+            hdr[2] = fill & 0xff;
+            hdr[3] = fill >> 8;
+            cz_put(&s, hdr, 4);
+            cz_put(&s, (len > 0) ? comp : raw, (len > 0) ? len : fill);
+            total += fill;
+            fill = 0;
+        }
+        if (n <= 0) {
+            break;
+        }
+    }
+    src_close(fd_in);
+    size = cz_close(&s) | CZ_FLAG;
+    printf("Wrote %lld bytes compressed in %d sectors\n", total, s.sectors);
+
+    // dir entry read again, extending the chain may have changed root
+    sectorRead(buf, fd_out, currState.file_entry_idx_sector);
+    buf2dir(buf, &d);
+    d.Idx[ currState.file_entry_idx ].size = size;
+    dir2buf(buf, d);
+    sectorWrite(buf, fd_out, currState.file_entry_idx_sector);
+
+    if (super.features & FEAT_AGGREGATES) {
+        struct Aggregate old, a = { .bytes=total, .sectors=s.sectors, .files=1 };
+
+        agg_get(first, &old);
+        agg_put(first, &a);
+        agg_addPath(dirPath, dirCount, a.bytes - old.bytes, a.sectors - old.sectors, 0);
+    }
+    containerClose(fd_out);
+    free(comp);
+    free(raw);
+}
+
+long cz_rawSize(int fd, int sector, short size) {
+    // Sum of group lengths; headers are followed without decompressing anything
+    struct CzStream s;
+    unsigned char hdr[4];
+    long total = 0;
+
+    cz_open(&s, fd, sector, CZ_SIZE(size));
+
+    while (cz_get(&s, hdr, 4) == 4) {
+        total += hdr[2] | (hdr[3] << 8);
+        cz_get(&s, NULL, (hdr[0] | (hdr[1] << 8)) & ~CZ_RAW);
+    }
+    return total;
+}
+
+void sp_read(int sector, short size) {
+    // cat of sparse file, one extent at a time
+    int fd = 0;         // File descriptor of container
+    struct CzStream s;
+    int hdr[2];         // data bytes, then zeros
+    char* data = (char *)malloc(SP_GROUP);
+    char zero[SP_CHUNK];
+
+    memset(zero, 0, SP_CHUNK);
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    cz_open(&s, fd, sector, CZ_SIZE(size));
+
+    while (cz_get(&s, (unsigned char *)hdr, 8) == 8) {
+        if (hdr[0] < 0 || hdr[0] > SP_GROUP || hdr[1] < 0 || cz_get(&s, (unsigned char *)data, hdr[0]) != hdr[0]) {
+            dprintf(2, "Extents of %s are damaged in sector %d\n", opt.path, s.sector);
+            die(&fd, 3);
+        }
+        fwrite(data, 1, hdr[0], stdout);
+
+        for (long left = hdr[1]; left > 0; left -= SP_CHUNK) {
+            fwrite(zero, 1, (left < SP_CHUNK) ? left : SP_CHUNK, stdout);
+        }
+    }
+    containerClose(fd);
+    free(data);
+}
+
+void sp_put(struct CzStream* s, char* data, int len, long zeros) {
+    // Runs of zeros longer than an int are more than one extent
+    while (zeros > 0x7fffffff) {
+        int hdr[2] = { len, 0x7fffffff };
+
+        cz_put(s, (unsigned char *)hdr, 8);
+        cz_put(s, (unsigned char *)data, len);
+        len = 0;
+        zeros -= 0x7fffffff;
+    }
+    int hdr[2] = { len, (int)zeros };
+
+    cz_put(s, (unsigned char *)hdr, 8);
+    cz_put(s, (unsigned char *)data, len);
+}
+
+void sp_write(int sector, int append) {
+    /* -i data is read SP_CHUNK bytes at a time; a chunk of zeros adds to the
+     *  hole after the extent being filled. Holes of the -i file itself are
+     *  skipped over with SEEK_DATA instead of being read. Appending adds
+     *  extents after the last one.
+     */
+    int fd_in, fd_out = 0;      // file descriptors
+    char buf[512] = {0};
+    struct CzStream s;
+    struct Dir d;
+    int hdr[2];
+    char* data = (char *)malloc(SP_GROUP);
+    char chunk[SP_CHUNK];
+    int fill = 0;               // data bytes of extent being filled
+    long zeros = 0;             // zeros after them
+    long long total = 0;        // bytes of the file, holes too
+    long long holes = 0;
+    off_t pos = 0;              // of fd_in
+    int seekable = 1;
+    int dirPath[ userPath.elementCount + 1 ];  // root and parent dirs, for aggregates
+    int dirCount = getPathDirs(dirPath);
+    int first = dirLookup(dirPath[ dirCount - 1 ], userPath.elementArr[ userPath.elementCount - 1 ]);
+    short size = 0;
+
+    fd_in = src_open();
+    if (fd_in < 0) {
+        dprintf(2, "Could not open file %s for reading; %s\n", opt.src, strerror(errno));
+        die(&fd_in, 255);
+    }
+    fd_out = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorRead(buf, fd_out, currState.file_entry_idx_sector);
+    buf2dir(buf, &d);
+    size = d.Idx[ currState.file_entry_idx ].size;
+    cz_open(&s, fd_out, sector, (append && (size & SP_FLAG)) ? CZ_SIZE(size) : 0);
+
+    while (append && cz_get(&s, (unsigned char *)hdr, 8) == 8) {  // to the end of the last extent
+        if (hdr[0] < 0 || hdr[0] > SP_GROUP || hdr[1] < 0 || cz_get(&s, NULL, hdr[0]) != hdr[0]) {
+            dprintf(2, "Extents of %s are damaged in sector %d\n", opt.path, s.sector);
+            die(&fd_out, 3);
+        }
+        total += (long long)hdr[0] + hdr[1];
+        holes += hdr[1];
+    }
+
+    while (1) {
+        int n = 0;
+
+        if (zeros > 0 && seekable) {    // in a run of zeros; the -i file may have a hole here
+            off_t next = src_seek(fd_in, pos, SEEK_DATA);
+
+            if (next < 0 && errno == ENXIO) {   // hole up to its end
+                next = src_seek(fd_in, 0, SEEK_END);
+            }
+            if (next < 0) {
+                seekable = 0;
+                src_seek(fd_in, pos, SEEK_SET);
+            }
+            else if (next - pos >= SP_CHUNK) {
+                long skip = (next - pos) / SP_CHUNK * SP_CHUNK;
+
+                zeros += skip;
+                pos += skip;
+                src_seek(fd_in, pos, SEEK_SET);
+            }
+            else {
+                src_seek(fd_in, pos, SEEK_SET);
+            }
+        }
+        while (n < SP_CHUNK) {
+            int got = src_read(fd_in, chunk + n, SP_CHUNK - n);
+
+            if (got <= 0) {
+                break;
+            }
+            n += got;
+        }
+        if (n <= 0) {
+            break;
+        }
+        pos += n;
+        int isZero = 1;
+
+        for (int i=0; i<n && isZero; i++) {
+            isZero = (chunk[i] == 0);
+        }
+        if (isZero) {
+            zeros += n;
+            continue;
+        }
+        if (zeros > 0 || fill + n > SP_GROUP) {     // extent is done
+            sp_put(&s, data, fill, zeros);
+            total += fill + zeros;
+            holes += zeros;
+            fill = 0;
+            zeros = 0;
+        }
+        memcpy(data + fill, chunk, n);
+        fill += n;
+    }
+    if (fill > 0 || zeros > 0) {
+        sp_put(&s, data, fill, zeros);
+        total += fill + zeros;
+        holes += zeros;
+    }
+    src_close(fd_in);
+    size = cz_close(&s) | SP_FLAG;
+    printf("Wrote %lld bytes in %d sectors, %lld of them in holes\n", total, s.sectors, holes);
+
+    // dir entry read again, extending the chain may have changed root
+    sectorRead(buf, fd_out, currState.file_entry_idx_sector);
+    buf2dir(buf, &d);
+    d.Idx[ currState.file_entry_idx ].size = size;
+    dir2buf(buf, d);
+    sectorWrite(buf, fd_out, currState.file_entry_idx_sector);
+
+    if (super.features & FEAT_AGGREGATES) {
+        struct Aggregate old, a = { .bytes=total, .sectors=s.sectors, .files=1 };
+
+        agg_get(first, &old);
+        agg_put(first, &a);
+        agg_addPath(dirPath, dirCount, a.bytes - old.bytes, a.sectors - old.sectors, 0);
+    }
+    containerClose(fd_out);
+    free(data);
+}
+
+long sp_seek(int fd, int sector, short size, long offset, int whence) {
+    /* As lseek() SEEK_DATA and SEEK_HOLE: a file without SP_FLAG is all data
+     *  but for DD_HOLE blocks of a block map, and every file has a hole at its
+     *  end. Extent headers are followed without reading their data. Returns -1
+     *  when offset is past the end.
+     */
+    struct CzStream s;
+    int hdr[2];
+    long at = 0;        // file offset of extent being looked at
+
+    if (size & DD_FLAG) {
+        int* blocks = NULL;
+        int count = dd_mapRead(fd, sector, &blocks);
+        long end = (count > 0) ? (long)(count - 1) * 504 + CZ_SIZE(size) : 0;
+
+        for (int i = (offset < end) ? offset / 504 : count; i<count; i++) {
+            if ((blocks[i] == DD_HOLE) == (whence == SEEK_HOLE)) {
+                at = (long)i * 504;
+                free(blocks);
+                return (offset > at) ? offset : at;
+            }
+        }
+        free(blocks);
+
+        if (offset >= end) {
+            return -1;
+        }
+        return (whence == SEEK_DATA) ? -1 : end;
+    }
+    if (!(size & SP_FLAG)) {
+        struct Aggregate a;
+
+        fileTotals(fd, sector, size, &a);
+
+        if (offset >= a.bytes) {
+            return -1;
+        }
+        return (whence == SEEK_DATA) ? offset : a.bytes;
+    }
+    cz_open(&s, fd, sector, CZ_SIZE(size));
+
+    while (cz_get(&s, (unsigned char *)hdr, 8) == 8) {
+        long data = at + hdr[0];        // data is [at, data), zeros [data, end)
+        long end = data + hdr[1];
+
+        cz_get(&s, NULL, hdr[0]);
+
+        if (whence == SEEK_DATA && offset < data) {
+            return (offset > at) ? offset : at;
+        }
+        if (whence == SEEK_HOLE && offset < end && hdr[1] > 0) {
+            return (offset > data) ? offset : data;
+        }
+        at = end;
+    }
+    if (offset >= at) {
+        return -1;
+    }
+    return (whence == SEEK_DATA) ? -1 : at;     // SEEK_DATA in the hole at the end
+}
+
+void sp_map() {
+    // Alternating data and hole extents, from sp_seek() as a reader would find them
+    int fd = containerOpen(opt.filename, CONTAINER_READ);
+    char buf[512] = {0};
+    struct Dir d;
+    int sector = getFileSector();
+    long at = 0;
+
+    if (sector < 0 || currState.file_sector_type == 'D') {
+        printf("%s is not a user file\n", opt.path);
+        exit(1);
+    }
+    sectorRead(buf, fd, currState.file_entry_idx_sector);
+    buf2dir(buf, &d);
+    short size = d.Idx[ currState.file_entry_idx ].size;
+
+    if (currState.file_sector_type == 'I') {    // inline data has no holes
+        printf(opt.machine ? "data\t0\t%d\n" : "Data at 0, %d bytes\n", size);
+        containerClose(fd);
+        return;
+    }
+    while (at >= 0) {
+        long hole = sp_seek(fd, sector, size, at, SEEK_HOLE);
+        long data = 0;
+
+        if (hole < 0) {
+            break;
+        }
+        if (hole > at) {
+            printf(opt.machine ? "data\t%ld\t%ld\n" : "Data at %ld, %ld bytes\n", at, hole - at);
+        }
+        data = sp_seek(fd, sector, size, hole, SEEK_DATA);
+
+        if (data < 0) {     // hole runs to the end
+            struct Aggregate a;
+
+            fileTotals(fd, sector, size, &a);
+            data = -1;
+
+            if (a.bytes > hole) {
+                printf(opt.machine ? "hole\t%ld\t%lld\n" : "Hole at %ld, %lld bytes\n", hole, a.bytes - hole);
+            }
+        }
+        else if (data > hole) {
+            printf(opt.machine ? "hole\t%ld\t%ld\n" : "Hole at %ld, %ld bytes\n", hole, data - hole);
+        }
+        at = data;
+    }
+    containerClose(fd);
+}
+
+int dd_mapRead(int fd, int sector, int** list) {
+    // Block numbers end at the first 0, or with the chain when its last sector is full; holes are DD_HOLE
+    struct CzStream s;
+    int* blocks = NULL;
+    int count = 0;
+    int max = 0;
+    int block = 0;
+
+    cz_open(&s, fd, sector, 504);
+
+    while (cz_get(&s, (unsigned char *)&block, 4) == 4 && block != 0) {
+        if ((block < 0 && block != DD_HOLE) || block >= super.numSectors) {
+            dprintf(2, "Block map of %s links to sector %d, outside container\n", opt.path, block);
+            die(&fd, 3);
+        }
+        if (count == max) {
+            max = (max == 0) ? 64 : max * 2;
+            blocks = (int *)realloc( blocks, max * sizeof(int) );
+        }
+        blocks[ count++ ] = block;
+    }
+    *list = blocks;
+
+    return count;
+}
+
+void dd_mapMark(int fd, int sector, int refs) {
+    char buf[512] = {0};
+    struct File f;
+
+    while (sector != 0) {
+        dd_set(sector, refs, 0);
+        sectorRead(buf, fd, sector);
+        buf2file(buf, &f);
+        sector = f.frwd;
+    }
+}
+
+void dd_drop(int fd, int sector) {
+    int* blocks = NULL;
+    int count = dd_mapRead(fd, sector, &blocks);
+
+    dd_mapMark(fd, sector, 0);
+    currState.last_free = getLastFree();
+
+    for (int i=0; i<count; i++) {
+        dd_unref(blocks[i]);
+    }
+    free(blocks);
+}
+
+void dd_read(int sector, short size) {
+    // cat of block-mapped file, last block holds .size bytes
+    int fd = 0;         // File descriptor of container
+    int* blocks = NULL;
+    int count = 0;
+
+    char* bufs = (char *)malloc( (long)DD_PER_MAP * BUF_SIZE );
+    int held[DD_PER_MAP];       // blocks of a map sector's worth, holes left out
+    char zeros[504] = {0};
+
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    count = dd_mapRead(fd, sector, &blocks);
+
+    for (int i=0; i<count; i+=DD_PER_MAP) {     // block list is known, so read a map sector's worth at once
+        int n = (count - i < DD_PER_MAP) ? count - i : DD_PER_MAP;
+        int h = 0;
+
+        for (int k=0; k<n; k++) {
+            if (blocks[i + k] != DD_HOLE) {
+                held[h++] = blocks[i + k];
+            }
+        }
+        sectorReadMany(fd, held, h, bufs);
+        h = 0;
+
+        for (int k=0; k<n; k++) {
+            char* data = (blocks[i + k] == DD_HOLE) ? zeros : bufs + (long)(h++) * BUF_SIZE + 8;
+
+            fwrite(data, 1, (i + k == count - 1) ? CZ_SIZE(size) : 504, stdout);
+        }
+    }
+    containerClose(fd);
+    free(blocks);
+    free(bufs);
+}
+
+void dd_write(int sector, int append) {
+    /* -i data is cut in 504 byte blocks, each shared with whatever file already
+     *  holds the same bytes, and the file's chain is written again as the map
+     *  of its blocks. Appending keeps the blocks the file had, but a last one
+     *  that is not full is replaced by a block holding the new data as well.
+     *  Old blocks are released only after the new map is written, so bytes
+     *  written again find their old block still there. With -O sparse a
+     *  whole block of zeros is a hole, DD_HOLE in the map.
+     */
+    int fd_in, fd_out = 0;      // file descriptors
+    char buf[512] = {0};
+    char data[504] = {0};
+    char zeros[504] = {0};
+    struct CzStream s;
+    struct Dir d;
+    int* blocks = NULL;         // blocks of the new map
+    int* old = NULL;            // blocks of the old map
+    int count = 0;
+    int oldCount = 0;
+    int kept = 0;               // blocks of old map still in new one
+    int max = 0;
+    int fill = 0;               // bytes in data
+    int last = 0;               // bytes in last block
+    int fresh = ddTable.blocks; // blocks stored before, new ones are counted below
+    int holes = 0;              // of blocks in the new map
+    long long total = 0;
+    int dirPath[ userPath.elementCount + 1 ];  // root and parent dirs, for aggregates
+    int dirCount = getPathDirs(dirPath);
+    int first = dirLookup(dirPath[ dirCount - 1 ], userPath.elementArr[ userPath.elementCount - 1 ]);
+    short size = 0;
+
+    fd_in = src_open();
+    if (fd_in < 0) {
+        dprintf(2, "Could not open file %s for reading; %s\n", opt.src, strerror(errno));
+        die(&fd_in, 255);
+    }
+    fd_out = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorRead(buf, fd_out, currState.file_entry_idx_sector);
+    buf2dir(buf, &d);
+    size = d.Idx[ currState.file_entry_idx ].size;
+
+    if (size & DD_FLAG) {
+        oldCount = dd_mapRead(fd_out, sector, &old);
+        dd_mapMark(fd_out, sector, 0);  // chain is written over below; a tail it no longer needs is freed as is
+    }
+    if (append && oldCount > 0) {
+        max = oldCount + 64;
+        blocks = (int *)malloc( max * sizeof(int) );
+        memcpy(blocks, old, oldCount * sizeof(int));
+        count = oldCount;
+        last = CZ_SIZE(size);
+
+        if (last < 504) {   // copy on write of the last block
+            sectorRead(buf, fd_out, blocks[ count - 1 ]);
+            memcpy(data, buf+8, last);
+            fill = last;
+            count--;
+        }
+        kept = count;
+    }
+
+    while (1) {
+        int n = src_read(fd_in, data + fill, 504 - fill);
+
+        if (n > 0) {
+            fill += n;
+        }
+        if (fill == 504 || (n <= 0 && fill > 0)) {
+            memset(data + fill, 0, 504 - fill);
+
+            if (count == max) {
+                max = (max == 0) ? 64 : max * 2;
+                blocks = (int *)realloc( blocks, max * sizeof(int) );
+            }
+            if (fill == 504 && (super.features & FEAT_SPARSE) && memcmp(data, zeros, 504) == 0) {
+                blocks[count] = DD_HOLE;
+            }
+            else {  // new blocks go after the last one, as extendFile() would put them
+                int goal = sector + 1;
+
+                for (int i = count - 1; i >= 0; i--) {
+                    if (blocks[i] != DD_HOLE) {
+                        goal = blocks[i] + 1;
+                        break;
+                    }
+                }
+                blocks[count] = dd_ref(data, goal);
+            }
+            count++;
+            last = fill;
+            fill = 0;
+        }
+        if (n <= 0) {
+            break;
+        }
+    }
+    src_close(fd_in);
+    fresh = ddTable.blocks - fresh;
+
+    for (int i=0; i<count; i++) {
+        holes += (blocks[i] == DD_HOLE);
+    }
+
+    // the map, 0 after the last block unless it fills its last sector
+    cz_open(&s, fd_out, sector, 0);
+
+    for (int i=0; i<count; i++) {
+        cz_put(&s, (unsigned char *)&blocks[i], 4);
+    }
+    memset(data, 0, 504);
+
+    if (s.pos < 504) {
+        cz_put(&s, (unsigned char *)data, 504 - s.pos);
+    }
+    cz_close(&s);
+    dd_mapMark(fd_out, sector, DD_MAP);
+
+    currState.last_free = getLastFree();
+
+    for (int i=kept; i<oldCount; i++) {
+        dd_unref(old[i]);
+    }
+    total = (count > 0) ? (long long)(count - 1) * 504 + last : 0;
+    printf("Wrote %lld bytes in %d blocks, %d of them new, %d holes\n", total, count - holes, fresh, holes);
+
+    sectorRead(buf, fd_out, currState.file_entry_idx_sector);
+    buf2dir(buf, &d);
+    d.Idx[ currState.file_entry_idx ].size = ( (count > 0) ? last : 0 ) | DD_FLAG;
+    dir2buf(buf, d);
+    sectorWrite(buf, fd_out, currState.file_entry_idx_sector);
+
+    if (super.features & FEAT_AGGREGATES) {
+        // blocks count for every file having them, as du should add up
+        struct Aggregate was, a = { .bytes=total, .sectors=s.sectors + count - holes, .files=1 };
+
+        agg_get(first, &was);
+        agg_put(first, &a);
+        agg_addPath(dirPath, dirCount, a.bytes - was.bytes, a.sectors - was.sectors, 0);
+    }
+    containerClose(fd_out);
+    free(blocks);
+    free(old);
+}
+
+void write_2_file(int sector, int offset) { // WRITE n data (write n bytes of data)
+    int fd_in, fd_out, bytes_wrote, bc_read = 0; // file descriptors, byte counter
+    char wrote504 = '0';        // '1' indicates full sector was written so need to extendFile()
+    char sectBuf[512] = {0};
+    char dataBuf[504] = {0};
+    struct File f;
+    int extended = 0;           // sectors added by extendFile(), for aggregates
+
+    fd_in = src_open();
+    if (fd_in < 0) {
+        dprintf(2, "Could not open file %s for reading; %s\n", opt.src, strerror(errno));
+        die(&fd_in, 255);
+    }
+
+    fd_out = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorRead(sectBuf, fd_out, sector);
+    buf2file(sectBuf, &f);
+
+    if (offset > 0) {   //we are appending, need to fill out last sector
+        memcpy( &dataBuf, &f.data, 504); // need to prime w/ existing data
+        print_hex_memory(dataBuf, 504);
+
+        bc_read = src_read(fd_in, dataBuf + offset, 504 - offset);
+
+        print_hex_memory(dataBuf, 504);
+        //memcpy( &f.data, &dataBuf, bc_read);
+        memcpy(&f.data, &dataBuf, 504);
+        file2buf(sectBuf, f);
+        //DEBUG
+        printf("write_2_file, sector: %d offset: %d\n", sector, offset);
+
+        sectorWrite(sectBuf, fd_out, sector);
+        memset(dataBuf, 0, 504);
+
+        wrote504 = ( bc_read == (504-offset) ) ? '1' : '0'; // if less, no more cp
+        //DEBUG
+        printf("1.bytes_read: %d, wrote504: %c\n", bc_read, wrote504);
+        bytes_wrote = offset + bc_read;     // data bytes in sector, not just the ones read
+    }
+    else { //overwrite
+        if (f.frwd != 0) {  // old chain past first sector is replaced by a fresh one
+            struct File tail;
+
+            currState.last_free = getLastFree();
+            sectorRead(sectBuf, fd_out, f.frwd);
+            buf2file(sectBuf, &tail);
+            reapFile(&tail);
+            f.frwd = 0;
+        }
+        bc_read = src_read(fd_in, &dataBuf, 504);
+        memcpy( &f.data, &dataBuf, bc_read);
+        file2buf(sectBuf, f);
+        sectorWrite(sectBuf, fd_out, sector);
+        memset(dataBuf, 0, 504);
+
+        if (bc_read == 504) { // indicate we wrote a full sector
+            wrote504 = '1';
+        }
+        else { // last read, need to update .size of dir entry after save
+            wrote504 = '0';
+        }
+        bytes_wrote = bc_read;
+    }
+    //DEBUG
+    printf("2.bytes_read: %d, wrote504: %c\n", bc_read, wrote504);
+
+    if (wrote504 == '1') {  // if copying more is needed...
+
+        while ( (bc_read = src_read(fd_in, dataBuf, 504)) > 0 ) {
+
+            if (wrote504 == '1') {
+                // need to extend sector and load it
+                //DEBUG
+                printf("Orig sector: %d\n", sector);
+                sector = extendFile(sector);
+                extended++;
+                //DEBUG
+                printf("New sector: %d\n", sector);
+                sectorRead( sectBuf, fd_out, sector);
+                buf2file(sectBuf, &f);
+            }
+            // Save the data
+            memcpy( &f.data, &dataBuf, bc_read);
+            file2buf(sectBuf, f);
+            //DEBUG
+            printf("Sector written: %d\n", sector);
+            sectorWrite(sectBuf, fd_out, sector);
+            memset(dataBuf, 0, 504);
+
+            if (bc_read == 504) { // indicate we wrote a full sector
+                wrote504 = '1';
+            }
+            else { // last read, need to update .size of dir entry after save
+                wrote504 = '0';
+            }
+            // loop 2 cp moar
+            bytes_wrote = bc_read;
+        }
+    }
+    /*
+    else {  // Save the data
+        memcpy( &f.data, &dataBuf, bytes_wrote);
+        file2buf(sectBuf, f);
+        //DEBUG
+        printf("Sector written: %d\n", sector);
+        sectorWrite(sectBuf, fd_out, sector);
+    }
+    */
+    //update dir entry
+    printf("bytes_wrote: %d, wrote504: %c\n", bytes_wrote, wrote504);
+    struct Dir d;
+    int dirPath[ userPath.elementCount + 1 ];  // root and parent dirs, for aggregates
+    int dirCount = getPathDirs(dirPath);
+    int first = 0;      // entry-sector of file
+
+    first = dirLookup(dirPath[ dirCount - 1 ], userPath.elementArr[ userPath.elementCount - 1 ]);
+    sectorRead(sectBuf, fd_out, currState.file_entry_idx_sector);
+    buf2dir(sectBuf, &d);
+
+    //DEBUG
+    printf("DirUpdate bytes_wrote: %d, wrote504: %c\n", bc_read, wrote504);
+
+    d.Idx[ currState.file_entry_idx ].size = bytes_wrote;     // 0 only for an empty -i file
+    //DEBUG
+    printf("writing file size: %d\n", d.Idx[ currState.file_entry_idx ].size);
+
+    dir2buf(sectBuf, d);
+    sectorWrite(sectBuf, fd_out, currState.file_entry_idx_sector);
+
+    if (super.features & FEAT_AGGREGATES) {
+        // New totals of file from the sectors written, parents get the difference
+        struct Aggregate old, a;
+
+        agg_get(first, &old);
+        a.sectors = ( (offset > 0) ? old.sectors : 1 ) + extended;
+        a.bytes = (long long)(a.sectors - 1) * 504 + d.Idx[ currState.file_entry_idx ].size;
+        a.files = 1;
+        agg_put(first, &a);
+        agg_addPath(dirPath, dirCount, a.bytes - old.bytes, a.sectors - old.sectors, 0);
+    }
+    containerClose(fd_out);
+}
+
+void defrag() {
+    /* Lays out, from the front of the container, each dir's extentions, then
+     *  the chains of its files, then its sub-dirs. Sectors that may not move
+     *  (root, super, tables, name index, first sector of dirs) are stepped
+     *  over, and a sector in the way is first moved out to the last free one.
+     *  With -t it stops once the budget is used; chains already laid out are
+     *  found in place, so the next run carries on where this one stopped.
+     */
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d;
+    struct Defrag df = { .cursor=1, .moved=0, .chains=0, .extMoved=0, .deadline=0, .stopped=0 };
+    int sector = 0;
+
+    df.numSectors = (super.magic != 0) ? super.numSectors : CONTAINER_SIZE/BUF_SIZE;
+    df.ref = (struct SectorRef *)calloc( df.numSectors, sizeof(struct SectorRef) );
+
+    if (opt.budget > 0) {
+        df.deadline = msecNow() + opt.budget;
+    }
+    if (super.nameIdx != 0) {
+        // index is rebuilt after the tree below, from the front of free space
+        currState.last_free = getLastFree();
+        nameIdx_freeNode(super.nameIdx);
+        super.nameIdx = 0;
+    }
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorRead(buf, fd, 0);
+    buf2dir(buf, &d);
+    sector = d.free;
+
+    while (sector > 0 && sector < df.numSectors && df.ref[sector].kind != 'F') {
+        df.ref[sector].kind = 'F';
+        freeRead(buf, fd, sector);
+        buf2dir(buf, &d);
+        sector = d.frwd;
+    }
+    defrag_mapDir(&df, 0);
+
+    defrag_placeDir(&df, 0);
+    defrag_rewriteFreeList(&df);
+    containerClose(fd);
+
+    // Cached entry sectors and free list are stale now
+    dcache_clear(&dcache);
+    freeMap.valid = 0;
+
+    if (super.features & FEAT_NAMEIDX) {
+        nameIdx_build();
+    }
+    printf("Moved %d sectors in %d chains", df.moved, df.chains);
+
+    if (df.stopped) {
+        printf(", stopped at sector %d; run defrag again to continue\n", df.cursor);
+    }
+    else {
+        printf(", free space starts at sector %d\n", df.cursor);
+    }
+    free(df.ref);
+}
+
+void defrag_mapDir(struct Defrag* df, int dir) {
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d;
+    struct File f;
+    int sector = dir;
+
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+
+    while (1) {
+        sectorRead(buf, fd, sector);
+        buf2dir(buf, &d);
+
+        for (int i=0; i<31; i++) {
+            if (d.Idx[i].type == 'D') {
+                defrag_mapDir(df, d.Idx[i].link);
+            }
+            else if (d.Idx[i].type == 'U') {
+                int prev = 0;
+                int s = d.Idx[i].link;
+
+                df->ref[s].entry_sector = sector;
+                df->ref[s].entry_idx = i;
+
+                while (s != 0) {
+                    df->ref[s].kind = 'U';
+                    df->ref[s].prev = prev;
+                    sectorRead(buf, fd, s);
+                    buf2file(buf, &f);
+                    prev = s;
+                    s = f.frwd;
+                }
+            }
+        }
+        if (d.frwd == 0) {
+            break;
+        }
+        df->ref[ d.frwd ].kind = 'E';
+        df->ref[ d.frwd ].prev = sector;
+        sector = d.frwd;
+    }
+    containerClose(fd);
+}
+
+int defrag_placeDir(struct Defrag* df, int dir) {
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d;
+    int sector = 0;
+
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    sectorRead(buf, fd, dir);
+    buf2dir(buf, &d);
+
+    if (d.frwd != 0 && !defrag_placeChain(df, d.frwd)) {
+        return 0;
+    }
+
+    // Files, then sub-dirs, in entry order; each pass re-reads the now placed chain
+    for (int pass=0; pass<2; pass++) {
+        sector = dir;
+
+        do {    // root is sector 0, so test at the end
+            sectorRead(buf, fd, sector);
+            buf2dir(buf, &d);
+
+            for (int i=0; i<31; i++) {
+                if (pass == 0 && d.Idx[i].type == 'U' && !defrag_placeChain(df, d.Idx[i].link)) {
+                    return 0;
+                }
+                if (pass == 1 && d.Idx[i].type == 'D' && !defrag_placeDir(df, d.Idx[i].link)) {
+                    return 0;
+                }
+                // files moved out of the way have new links in this sector
+                sectorRead(buf, fd, sector);
+                buf2dir(buf, &d);
+            }
+            sector = d.frwd;
+        } while (sector != 0);
+    }
+    containerClose(fd);
+
+    return 1;
+}
+
+int defrag_placeChain(struct Defrag* df, int sector) {
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct File f;
+    int moved = 0;
+
+    if (df->deadline != 0 && df->chains > 0 && msecNow() >= df->deadline) {   // always get one done
+        df->stopped = 1;
+        return 0;
+    }
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+
+    while (sector != 0) {
+        int target = df->cursor;
+
+        while (target < df->numSectors && df->ref[target].kind != 'U'
+               && df->ref[target].kind != 'E' && df->ref[target].kind != 'F') {
+            target++;   // may not move, step over
+        }
+        if (target >= df->numSectors) {
+            break;
+        }
+        if (target != sector) {
+            if (df->ref[target].kind != 'F') {
+                // move whatever is there out of the way, to the last free sector
+                int spare = df->numSectors - 1;
+
+                while (spare > target && df->ref[spare].kind != 'F') {
+                    spare--;
+                }
+                if (spare <= target) {
+                    printf("No free sector to move sector %d through\n", target);
+                    df->stopped = 1;
+                    return 0;
+                }
+                defrag_move(df, target, spare);
+            }
+            defrag_move(df, sector, target);
+            moved = 1;
+        }
+        df->cursor = target + 1;
+
+        sectorRead(buf, fd, target);  // frwd is at the same offset in file and dir sectors
+        buf2file(buf, &f);
+        sector = f.frwd;
+    }
+    containerClose(fd);
+    df->chains += moved;
+
+    return 1;
+}
+
+void defrag_move(struct Defrag* df, int from, int to) {
+    // to is free; from's content goes there and its neighbours, dir entry
+    //  and aggregate record follow it
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct SectorRef r = df->ref[from];
+    struct File f;
+    struct Dir d;
+
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorRead(buf, fd, from);
+
+    if (r.kind == 'E') {
+        // entries in the extention now live at to, inline files link to where they are
+        buf2dir(buf, &d);
+        f.frwd = d.frwd;
+
+        for (int i=0; i<31; i++) {
+            if (d.Idx[i].type == 'U') {
+                df->ref[ d.Idx[i].link ].entry_sector = to;
+            }
+            else if (d.Idx[i].type == 'I') {
+                memcpy(buf+( 16+(i*16) ), &to, 4);
+            }
+        }
+        df->extMoved++;
+    }
+    else {
+        buf2file(buf, &f);
+    }
+    sectorWrite(buf, fd, to);
+
+    if (r.kind == 'E' || r.prev != 0) {    // root's first extention has prev 0
+        sectorRead(buf, fd, r.prev);    // frwd of dir and file sectors is at the same offset
+        memcpy(buf+4, &to, 4);
+        sectorWrite(buf, fd, r.prev);
+    }
+    else {
+        struct Aggregate a, none = { .bytes=0, .sectors=0, .files=0 };
+
+        sectorRead(buf, fd, r.entry_sector);
+        buf2dir(buf, &d);
+        d.Idx[ r.entry_idx ].link = to;
+        dir2buf(buf, d);
+        sectorWrite(buf, fd, r.entry_sector);
+
+        if (super.features & FEAT_AGGREGATES) {
+            agg_get(from, &a);
+            agg_put(to, &a);
+            agg_put(from, &none);
+        }
+    }
+
+    if (f.frwd != 0) {
+        sectorRead(buf, fd, f.frwd);    // back is at the same offset too
+        memcpy(buf+0, &to, 4);
+        sectorWrite(buf, fd, f.frwd);
+        df->ref[ f.frwd ].prev = to;
+    }
+    containerClose(fd);
+
+    if (ddTable.refs != NULL && ddTable.refs[from] == DD_MAP) {
+        dd_set(to, DD_MAP, 0);
+        dd_set(from, 0, 0);
+    }
+    df->ref[to] = r;
+    memset(&df->ref[from], 0, sizeof(struct SectorRef));
+    df->ref[from].kind = 'F';
+    df->moved++;
+}
+
+void defrag_rewriteFreeList(struct Defrag* df) {
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d = { .back=0x00000000, .frwd=0x00000000, .free=0xADDEADDE, .filler=0xEFBEEFBE };
+    int prev = 0;
+
+    for (int i=0; i<31; i++) {
+        d.Idx[i].link = 0x00000000;
+        d.Idx[i].type = 'F';
+        strncpy(d.Idx[i].name, "         \0", 10);
+        d.Idx[i].size = 0x0000;
+    }
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+
+    // each free sector is written when the one after it is known
+    for (int i=1; i<=df->numSectors; i++) {
+        if (i < df->numSectors && df->ref[i].kind != 'F') {
+            continue;
+        }
+        d.frwd = (i < df->numSectors) ? i : 0;
+
+        if (prev != 0) {
+            dir2buf(buf, d);
+            sectorWrite(buf, fd, prev);
+        }
+        else {
+            struct Dir root;
+
+            sectorRead(buf, fd, 0);
+            buf2dir(buf, &root);
+            root.free = d.frwd;
+            dir2buf(buf, root);
+            sectorWrite(buf, fd, 0);
+        }
+        prev = i;
+    }
+    containerClose(fd);
+}
+
+long long msecNow() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void analyze() {
+    /* One pass of large reads into memory, then the tree, name index and free
+     *  list are followed in the image. Sectors not reached from any of them
+     *  are counted as leaked.
+     */
+    struct Analysis a;
+    char* image = NULL;
+    struct Dir d;
+
+    memset(&a, 0, sizeof(a));
+    a.numSectors = (super.magic != 0) ? super.numSectors : CONTAINER_SIZE/BUF_SIZE;
+    a.seen = (char *)calloc( a.numSectors, 1 );
+    image = containerImage(a.numSectors);
+
+    // Meta sectors: super, aggregate and checksum tables, name index nodes (root counts as dir)
+    if (super.magic != 0) {
+        a.seen[ super.self ] = 'M';
+
+        for (int i=0; i<super.aggTableLen; i++) {
+            a.seen[ super.aggTable + i ] = 'M';
+        }
+        for (int i=0; i<super.crcTableLen; i++) {
+            a.seen[ super.crcTable + i ] = 'M';
+        }
+        for (int i=0; i<super.dedupTableLen; i++) {
+            a.seen[ super.dedupTable + i ] = 'M';
+        }
+        for (int i=0; i<super.genTableLen; i++) {
+            a.seen[ super.genTable + i ] = 'M';
+        }
+    }
+    nameIdx_walk(-1, image, analyze_idxNode, &a);
+    analyze_dir(&a, image, 0, "");
+
+    for (int i=0; ddTable.refs != NULL && i<a.numSectors; i++) {  // blocks of block maps
+        if (ddTable.refs[i] > 0 && a.seen[i] == 0) {
+            a.seen[i] = 'B';
+            a.dedupBlocks++;
+        }
+    }
+
+    // Free list, in list order and by sector number
+    buf2dir(image, &d);
+
+    for (int sector = d.free, prev = 0; sector > 0 && sector < a.numSectors; ) {
+        if (a.seen[sector] != 0) {
+            a.crossLinked++;
+            break;
+        }
+        a.seen[sector] = 'F';
+        a.freeList++;
+
+        if (prev != 0 && sector != prev + 1) {
+            a.freeListBreaks++;
+        }
+        freeFix(image + (long)sector * BUF_SIZE, sector);
+        buf2dir(image + (long)sector * BUF_SIZE, &d);
+        prev = sector;
+        sector = d.frwd;
+    }
+    for (int i=0, run=0; i<=a.numSectors; i++) {
+        if (i < a.numSectors && a.seen[i] == 'F') {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            a.freeExtents++;
+            a.largestFree = (run > a.largestFree) ? run : a.largestFree;
+        }
+        run = 0;
+    }
+    for (int i=0; i<a.numSectors; i++) {
+        a.metaSectors += (a.seen[i] == 'M');
+    }
+    free(image);
+
+    if (opt.machine) {
+        analyze_json(&a);
+    }
+    else {
+        analyze_print(&a);
+    }
+    free(a.seen);
+    free(a.file);
+    free(a.dirChain);
+}
+
+void analyze_dir(struct Analysis* a, char* image, int dir, char* path) {
+    struct Dir d;
+    struct File f;
+    char sub[256];
+    int sector = dir;
+    int chain = 0;
+    int fragments = 0;
+
+    a->dirs++;
+
+    while (1) {
+        if (a->seen[sector] != 0) {
+            a->crossLinked++;
+            break;
+        }
+        a->seen[sector] = 'D';
+        a->dirSectors++;
+        chain++;
+        buf2dir(image + (long)sector * BUF_SIZE, &d);
+
+        for (int i=0; i<31; i++) {
+            int link = d.Idx[i].link;
+
+            if (d.Idx[i].type == 'I') {
+                a->files++;
+                a->inlineFiles++;
+                continue;
+            }
+            if ( (d.Idx[i].type != 'D' && d.Idx[i].type != 'U') || link <= 0 || link >= a->numSectors ) {
+                continue;
+            }
+            snprintf(sub, sizeof(sub), "%s/%.9s", path, d.Idx[i].name);
+
+            if (d.Idx[i].type == 'D') {
+                analyze_dir(a, image, link, sub);
+                continue;
+            }
+            // user file: length and runs of its chain
+            int sectors = 0;
+            int runs = 0;
+
+            for (int s = link, prev = -1; s > 0 && s < a->numSectors; prev = s, s = f.frwd) {
+                if (a->seen[s] != 0) {
+                    a->crossLinked++;
+                    break;
+                }
+                a->seen[s] = 'U';
+                sectors++;
+                runs += (s != prev + 1);
+                buf2file(image + (long)s * BUF_SIZE, &f);
+            }
+            a->files++;
+            a->compressedFiles += ( (d.Idx[i].size & CZ_FLAG) != 0 );
+            a->dedupFiles += ( (d.Idx[i].size & DD_FLAG) != 0 );
+            a->fileSectors += sectors;
+            a->fileFragments += runs;
+            a->fragmentedFiles += (runs > 1);
+            analyze_add(&a->file, &a->fileCount, &a->fileMax, sub, link, sectors, runs);
+        }
+        if (d.frwd <= 0 || d.frwd >= a->numSectors) {
+            break;
+        }
+        fragments += (d.frwd != sector + 1);
+        sector = d.frwd;
+    }
+    if (chain > 1) {
+        a->extDirs++;
+        a->maxDirChain = (chain > a->maxDirChain) ? chain : a->maxDirChain;
+        analyze_add(&a->dirChain, &a->dirChainCount, &a->dirChainMax, (path[0] == '\0') ? "/" : path,
+                    dir, chain, fragments + 1);
+    }
+}
+
+void analyze_add(struct ChainStat** list, int* count, int* max, char* path, int sector, int sectors, int fragments) {
+    if (*count == *max) {
+        *max = (*max == 0) ? 64 : *max * 2;
+        *list = (struct ChainStat *)realloc( *list, *max * sizeof(struct ChainStat) );
+    }
+    strncpy( (*list)[*count].path, path, sizeof((*list)[*count].path) - 1 );
+    (*list)[*count].path[ sizeof((*list)[*count].path) - 1 ] = '\0';
+    (*list)[*count].sector = sector;
+    (*list)[*count].sectors = sectors;
+    (*list)[*count].fragments = fragments;
+    (*count)++;
+}
+
+int analyze_idxNode(void* arg, int sector) {
+    struct Analysis* a = arg;
+
+    if (sector <= 0 || sector >= a->numSectors || a->seen[sector] != 0) {
+        return 0;
+    }
+    a->seen[sector] = 'M';
+
+    return 1;
+}
+
+int analyze_cmp(const void* x, const void* y) {
+    const struct ChainStat* a = x;
+    const struct ChainStat* b = y;
+
+    if (a->fragments != b->fragments) {
+        return b->fragments - a->fragments;
+    }
+    return b->sectors - a->sectors;
+}
+
+void analyze_print(struct Analysis* a) {
+    int leaked = 0;
+    int worst = 0;
+
+    for (int i=0; i<a->numSectors; i++) {
+        leaked += (a->seen[i] == 0);
+    }
+    printf("Container %s: %d sectors\n", opt.filename, a->numSectors);
+    printf("  Meta:        %d sectors (super, aggregate, checksum, dedup and change tables, name index)\n", a->metaSectors);
+    printf("  Dirs:        %d in %d sectors, %d with extentions, longest chain %d\n",
+           a->dirs, a->dirSectors, a->extDirs, a->maxDirChain);
+    printf("  Files:       %d in %d sectors, %d fragments, %d fragmented (%.1f%%)\n",
+           a->files, a->fileSectors, a->fileFragments, a->fragmentedFiles,
+           (a->files > 0) ? 100.0 * a->fragmentedFiles / a->files : 0.0);
+
+    if (a->inlineFiles > 0) {
+        printf("  Inline:      %d files kept in their dir sector\n", a->inlineFiles);
+    }
+    if (a->compressedFiles > 0) {
+        printf("  Compressed:  %d files\n", a->compressedFiles);
+    }
+    if (a->dedupFiles > 0) {
+        printf("  Dedup:       %d files as block maps, %d blocks\n", a->dedupFiles, a->dedupBlocks);
+    }
+    printf("  Avg run:     %.2f sectors\n", (a->fileFragments > 0) ? (double)a->fileSectors / a->fileFragments : 0.0);
+    printf("  Free list:   %d sectors in %d extents, largest %d, %d links out of sector order\n",
+           a->freeList, a->freeExtents, a->largestFree, a->freeListBreaks);
+    printf("  Free (scan): %d sectors, %d not on free list\n", a->freeList + leaked, leaked);
+
+    if (a->crossLinked > 0) {
+        printf("  Cross-linked: %d sectors reached more than once\n", a->crossLinked);
+    }
+
+    qsort(a->file, a->fileCount, sizeof(struct ChainStat), analyze_cmp);
+    printf("\n\t%s\t%s\t%s\t%s\t%s\n", "Fragments", "Sectors", "AvgRun", "Sector", "Path");
+    printf("\t%s\t%s\t%s\t%s\t%s\n", "^^^^^^^^^", "^^^^^^^", "^^^^^^", "^^^^^^", "^^^^");
+
+    for (int i=0; i<a->fileCount; i++) {
+        if (!opt.longList && (worst == ANALYZE_WORST || a->file[i].fragments < 2)) {
+            break;
+        }
+        printf("\t%d\t%d\t%.2f\t%d\t%s\n", a->file[i].fragments, a->file[i].sectors,
+               (double)a->file[i].sectors / a->file[i].fragments, a->file[i].sector, a->file[i].path);
+        worst++;
+    }
+    if (a->dirChainCount > 0) {
+        printf("\n\tDir chain\tFragments\tSector\tPath\n");
+        printf("\t^^^^^^^^^\t^^^^^^^^^\t^^^^^^\t^^^^\n");
+
+        for (int i=0; i<a->dirChainCount; i++) {
+            printf("\t%d\t\t%d\t\t%d\t%s\n", a->dirChain[i].sectors, a->dirChain[i].fragments,
+                   a->dirChain[i].sector, a->dirChain[i].path);
+        }
+    }
+    printf("\n");
+
+    if (leaked > 0) {
+        printf("%d sectors are not reachable from the tree or the free list\n", leaked);
+    }
+    if (a->fragmentedFiles * 10 > a->files || a->freeListBreaks * 4 > a->freeList) {
+        printf("Layout is fragmented; defrag suggested\n");
+    }
+    else {
+        printf("Layout is good\n");
+    }
+}
+
+void analyze_json(struct Analysis* a) {
+    int leaked = 0;
+
+    for (int i=0; i<a->numSectors; i++) {
+        leaked += (a->seen[i] == 0);
+    }
+    qsort(a->file, a->fileCount, sizeof(struct ChainStat), analyze_cmp);
+
+    printf("{\"container\":");
+    printJsonString(opt.filename);
+    printf(",\"sectors\":%d,\"metaSectors\":%d,\"crossLinked\":%d,\n", a->numSectors, a->metaSectors, a->crossLinked);
+    printf(" \"dirs\":{\"count\":%d,\"sectors\":%d,\"withExtentions\":%d,\"longestChain\":%d},\n",
+           a->dirs, a->dirSectors, a->extDirs, a->maxDirChain);
+    printf(" \"files\":{\"count\":%d,\"inline\":%d,\"compressed\":%d,\"dedup\":%d,\"blocks\":%d,\"sectors\":%d,\"fragments\":%d,\"fragmented\":%d,\"avgRun\":%.2f},\n",
+           a->files, a->inlineFiles, a->compressedFiles, a->dedupFiles, a->dedupBlocks, a->fileSectors, a->fileFragments, a->fragmentedFiles,
+           (a->fileFragments > 0) ? (double)a->fileSectors / a->fileFragments : 0.0);
+    printf(" \"free\":{\"listLength\":%d,\"scanCount\":%d,\"notOnList\":%d,\"extents\":%d,\"largestExtent\":%d,\"listBreaks\":%d},\n",
+           a->freeList, a->freeList + leaked, leaked, a->freeExtents, a->largestFree, a->freeListBreaks);
+    printf(" \"dirChains\":[");
+
+    for (int i=0; i<a->dirChainCount; i++) {
+        printf("%s\n  {\"path\":", (i > 0) ? "," : "");
+        printJsonString(a->dirChain[i].path);
+        printf(",\"sector\":%d,\"sectors\":%d,\"fragments\":%d}",
+               a->dirChain[i].sector, a->dirChain[i].sectors, a->dirChain[i].fragments);
+    }
+    printf("],\n \"fileList\":[");     // most fragmented first, so the worst offenders lead
+
+    for (int i=0; i<a->fileCount; i++) {
+        printf("%s\n  {\"path\":", (i > 0) ? "," : "");
+        printJsonString(a->file[i].path);
+        printf(",\"sector\":%d,\"sectors\":%d,\"fragments\":%d}",
+               a->file[i].sector, a->file[i].sectors, a->file[i].fragments);
+    }
+    printf("]}\n");
+}
+
+int fsck() {
+    /* Headers of all sectors are read by worker threads in FSCK_CHUNK sector
+     *  reads. Tree, free list and meta sectors are then followed with the
+     *  headers in memory (only dir, map and index sectors are read again):
+     *  workers follow the tree while this thread does the rest. Last,
+     *  workers check each sector's reach count and .back.
+     */
+    struct Fsck fs;
+    struct FsckWorker workers[FSCK_MAX_THREADS];
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d;
+    long long start = msecNow();
+    int errors = 0;
+    int leaked = 0;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.numSectors = (super.magic != 0) ? super.numSectors : CONTAINER_SIZE/BUF_SIZE;
+    fs.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    fs.threads = (fs.threads < 1) ? 1 : (fs.threads > FSCK_MAX_THREADS) ? FSCK_MAX_THREADS : fs.threads;
+
+    if (fs.threads > (fs.numSectors + FSCK_CHUNK - 1) / FSCK_CHUNK) {
+        fs.threads = (fs.numSectors + FSCK_CHUNK - 1) / FSCK_CHUNK;
+    }
+    fs.back = (int *)malloc( fs.numSectors * sizeof(int) );
+    fs.frwd = (int *)malloc( fs.numSectors * sizeof(int) );
+    fs.prev = (int *)malloc( fs.numSectors * sizeof(int) );
+    fs.kind = (char *)calloc( fs.numSectors, 1 );
+    fs.refs = (char *)calloc( fs.numSectors, 1 );
+    fs.err = (char *)calloc( fs.numSectors, 1 );
+    fs.ddRefs = (ddTable.refs != NULL) ? (int *)calloc( fs.numSectors, sizeof(int) ) : NULL;
+    pthread_mutex_init(&fs.lock, NULL);
+    pthread_cond_init(&fs.changed, NULL);
+
+    fd = containerOpen(opt.filename, CONTAINER_READ);  // workers share this handle
+    fsck_runWorkers(&fs, fsck_readWorker, workers);
+
+    // Tree, by the workers; meta sectors, name index and free list meanwhile
+    fsck_queue(&fs, 0, 0, "");
+    fsck_startWorkers(&fs, fsck_walkWorker, workers);
+
+    if (super.magic != 0) {
+        fsck_reach(&fs, super.self, 'M', -1);
+
+        for (int i=0; i<super.aggTableLen; i++) {
+            fsck_reach(&fs, super.aggTable + i, 'M', -1);
+        }
+        for (int i=0; i<super.crcTableLen; i++) {
+            fsck_reach(&fs, super.crcTable + i, 'M', -1);
+        }
+        for (int i=0; i<super.dedupTableLen; i++) {
+            fsck_reach(&fs, super.dedupTable + i, 'M', -1);
+        }
+        for (int i=0; i<super.genTableLen; i++) {
+            fsck_reach(&fs, super.genTable + i, 'M', -1);
+        }
+    }
+    nameIdx_walk(fd, NULL, fsck_idxNode, &fs);
+
+    sectorRead(buf, fd, 0);
+    buf2dir(buf, &d);
+
+    for (int sector = d.free; sector != 0; sector = fs.frwd[sector]) {
+        if (sector < 0 || sector >= fs.numSectors) {
+            printf("Free list links to sector %d, outside container\n", sector);
+            __atomic_fetch_add(&fs.badLinks, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (!fsck_reach(&fs, sector, 'F', -1)) {
+            break;  // loop or cross-link, reported below
+        }
+        fs.freeList++;
+
+        if (fs.frwd[sector] == 0 && fs.back[sector] == 0) {   // end of list, or punched by trim
+            freeRead(buf, fd, sector);
+            memcpy(&fs.frwd[sector], buf + 4, 4);
+        }
+    }
+    fsck_joinWorkers(&fs);
+
+    // Blocks the block maps in the tree point to
+    for (int i=0; fs.ddRefs != NULL && i<fs.numSectors; i++) {
+        if (fs.ddRefs[i] > 0) {
+            fsck_reach(&fs, i, 'B', -1);
+        }
+        if (fs.ddRefs[i] != ddTable.refs[i] && i < ddTable.numSectors) {
+            printf("Sector %d has %d references in dedup table, block maps give %d (%d == map sector)\n",
+                   i, ddTable.refs[i], fs.ddRefs[i], DD_MAP);
+            fs.badRefs++;
+        }
+    }
+    containerClose(fd);
+
+    fsck_runWorkers(&fs, fsck_checkWorker, workers);
+
+    for (int i=0; i<fs.threads; i++) {
+        errors += workers[i].errors;
+    }
+    for (int i=0; i<fs.numSectors; i++) {
+        switch (fs.err[i]) {
+            case 'X':
+                printf("Sector %d reached more than once (as %c)\n", i, fs.kind[i]);
+                break;
+            case 'B':
+                printf("Sector %d has .back %d, chain has %d before it\n", i, fs.back[i], fs.prev[i]);
+                break;
+            case 'L':
+                leaked++;
+                break;
+        }
+    }
+    if (leaked > 0) {
+        printf("%d sectors not reached from tree or free list\n", leaked);
+    }
+    errors += fs.badEntries + fs.badLinks + fs.badRefs;
+
+    printf("Checked %d sectors with %d threads in %lld msec: %d dirs, %d files, %d free, %d errors\n",
+           fs.numSectors, fs.threads, msecNow() - start, fs.dirs, fs.files, fs.freeList, errors);
+
+    if (leaked > 0 && opt.repair) {
+        if (errors > leaked) {
+            printf("Not repairing leaks, fix the other errors first\n");
+        }
+        else {
+            currState.last_free = getLastFree();
+
+            for (int i=0; i<fs.numSectors; i++) {
+                if (fs.err[i] == 'L') {
+                    currState.curr_sector = i;
+                    append2FreeList();
+                }
+            }
+            freeMap.valid = 0;
+            printf("Returned %d sectors to free list\n", leaked);
+            errors -= leaked;
+        }
+    }
+    free(fs.back);
+    free(fs.frwd);
+    free(fs.prev);
+    free(fs.kind);
+    free(fs.refs);
+    free(fs.err);
+    free(fs.ddRefs);
+    free(fs.queue);
+
+    return errors;
+}
+
+void fsck_startWorkers(struct Fsck* fs, void* (*work)(void*), struct FsckWorker* workers) {
+    for (int i=0; i<fs->threads; i++) {
+        workers[i].fs = fs;
+        workers[i].id = i;
+        workers[i].errors = 0;
+
+        if (pthread_create(&fs->tid[i], NULL, work, &workers[i]) != 0) {
+            dprintf(2, "Could not start fsck worker; %s\n", strerror(errno));
+            exit(255);
+        }
+    }
+}
+
+void fsck_joinWorkers(struct Fsck* fs) {
+    for (int i=0; i<fs->threads; i++) {
+        pthread_join(fs->tid[i], NULL);
+    }
+}
+
+void fsck_runWorkers(struct Fsck* fs, void* (*work)(void*), struct FsckWorker* workers) {
+    fsck_startWorkers(fs, work, workers);
+    fsck_joinWorkers(fs);
+}
+
+void* fsck_walkWorker(void* arg) {
+    struct FsckWorker* w = arg;
+    struct Fsck* fs = w->fs;
+
+    if (posix_memalign((void **)&w->page, SC_PAGE, SC_PAGE) != 0) {     // -D reads into it directly
+        exit(3);
+    }
+    pthread_mutex_lock(&fs->lock);
+
+    while (1) {
+        if (fs->taken == fs->queued) {
+            if (fs->busy == 0) {
+                break;      // nothing left, and no dir being followed can queue more
+            }
+            pthread_cond_wait(&fs->changed, &fs->lock);
+            continue;
+        }
+        struct FsckDir q = fs->queue[ fs->taken++ ];   // fs->queue moves when it grows
+
+        fs->busy++;
+        pthread_mutex_unlock(&fs->lock);
+
+        fsck_dir(w, q.dir, q.parent, q.path);
+
+        pthread_mutex_lock(&fs->lock);
+        fs->busy--;
+        pthread_cond_broadcast(&fs->changed);
+    }
+    pthread_cond_broadcast(&fs->changed);
+    pthread_mutex_unlock(&fs->lock);
+    free(w->page);
+
+    return NULL;
+}
+
+void* fsck_readWorker(void* arg) {
+    struct FsckWorker* w = arg;
+    struct Fsck* fs = w->fs;
+    char* buf = NULL;
+    int fd = containerFd;   // opened before workers start, pread keeps no shared offset
+
+    if (posix_memalign((void **)&buf, SC_PAGE, FSCK_CHUNK * BUF_SIZE) != 0) {   // -D reads into it directly
+        exit(3);
+    }
+    for (int chunk = w->id * FSCK_CHUNK; chunk < fs->numSectors; chunk += fs->threads * FSCK_CHUNK) {
+        int count = (fs->numSectors - chunk < FSCK_CHUNK) ? fs->numSectors - chunk : FSCK_CHUNK;
+        long len = ((long)count * BUF_SIZE + SC_PAGE - 1) / SC_PAGE * SC_PAGE;   // whole pages for -D
+
+        if (devRead(fd, buf, len, (off_t)chunk * BUF_SIZE) < (long)count * BUF_SIZE) {
+            dprintf(2, "Error occured reading sectors at %d; %s\n", chunk, strerror(errno));
+            exit(3);
+        }
+        for (int i=0; i<count; i++) {  // .back and .frwd are at the same place in every sector type
+            memcpy(&fs->back[ chunk + i ], buf + i * BUF_SIZE, 4);
+            memcpy(&fs->frwd[ chunk + i ], buf + i * BUF_SIZE + 4, 4);
+        }
+    }
+    free(buf);
+
+    return NULL;
+}
+
+void* fsck_checkWorker(void* arg) {
+    struct FsckWorker* w = arg;
+    struct Fsck* fs = w->fs;
+
+    for (int chunk = w->id * FSCK_CHUNK; chunk < fs->numSectors; chunk += fs->threads * FSCK_CHUNK) {
+        for (int i=chunk; i<chunk + FSCK_CHUNK && i<fs->numSectors; i++) {
+            if (fs->err[i] == 'X') {
+                w->errors++;
+            }
+            else if (fs->refs[i] == 0) {
+                fs->err[i] = 'L';
+                w->errors++;
+            }
+            else if (fs->prev[i] >= 0 && fs->back[i] != fs->prev[i]) {
+                fs->err[i] = 'B';
+                w->errors++;
+            }
+        }
+    }
+    return NULL;
+}
+
+int fsck_reach(struct Fsck* fs, int sector, char kind, int prev) {
+    // Walkers may reach a sector at once; the one that sets refs first has it
+    if (__atomic_exchange_n(&fs->refs[sector], 1, __ATOMIC_ACQ_REL) > 0) {
+        __atomic_store_n(&fs->refs[sector], 2, __ATOMIC_RELAXED);
+        __atomic_store_n(&fs->err[sector], 'X', __ATOMIC_RELAXED);
+        return 0;
+    }
+    __atomic_store_n(&fs->kind[sector], kind, __ATOMIC_RELAXED);
+    fs->prev[sector] = prev;
+
+    return 1;
+}
+
+int fsck_idxNode(void* arg, int sector) {
+    struct Fsck* fs = arg;
+
+    if (sector <= 0 || sector >= fs->numSectors) {
+        printf("Name index links to sector %d, outside container\n", sector);
+        __atomic_fetch_add(&fs->badLinks, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return fsck_reach(fs, sector, 'M', -1);
+}
+
+void fsck_read(struct FsckWorker* w, char* buf, int sector) {
+    // The page holding sector, as the read workers read theirs; no cache or sector state is shared
+    off_t page = (off_t)sector * BUF_SIZE / SC_PAGE * SC_PAGE;
+    long at = (off_t)sector * BUF_SIZE - page;
+
+    if (devRead(containerFd, w->page, SC_PAGE, page) < at + BUF_SIZE) {
+        dprintf(2, "Error occured reading sector at offset %d; %s\n", sector*BUF_SIZE, strerror(errno));
+        exit(3);
+    }
+    memcpy(buf, w->page + at, BUF_SIZE);
+
+    if (crcTable.crc != NULL && !crc_verify(sector, buf)) {
+        dprintf(2, "Checksum mismatch in sector %d of %s\n", sector, opt.filename);
+        exit(4);
+    }
+}
+
+void fsck_queue(struct Fsck* fs, int dir, int parent, char* path) {
+    pthread_mutex_lock(&fs->lock);
+
+    if (fs->queued == fs->queueMax) {
+        fs->queueMax = (fs->queueMax > 0) ? fs->queueMax * 2 : 256;
+        fs->queue = (struct FsckDir *)realloc( fs->queue, fs->queueMax * sizeof(struct FsckDir) );
+    }
+    struct FsckDir* q = &fs->queue[ fs->queued++ ];
+
+    q->dir = dir;
+    q->parent = parent;
+    snprintf(q->path, sizeof(q->path), "%s", path);
+    pthread_cond_broadcast(&fs->changed);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+void fsck_blockMap(struct FsckWorker* w, int sector, char* path) {
+    // Counts the references of file's block map; its chain was just reached
+    struct Fsck* fs = w->fs;
+    char buf[512] = {0};
+    int block = 0;
+
+    for (int s = sector; s > 0 && s < fs->numSectors && __atomic_load_n(&fs->kind[s], __ATOMIC_RELAXED) == 'U';
+         s = fs->frwd[s]) {
+        __atomic_store_n(&fs->ddRefs[s], DD_MAP, __ATOMIC_RELAXED);
+        fsck_read(w, buf, s);
+
+        for (int i=0; i<DD_PER_MAP; i++) {
+            memcpy(&block, buf+8 + i * 4, 4);
+
+            if (block == 0) {
+                break;
+            }
+            if (block == DD_HOLE) {
+                continue;
+            }
+            if (block < 0 || block >= fs->numSectors) {
+                printf("Block map of %s links to sector %d, outside container\n", path, block);
+                __atomic_fetch_add(&fs->badLinks, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            __atomic_fetch_add(&fs->ddRefs[block], 1, __ATOMIC_RELAXED);
+        }
+        if (block == 0) {
+            break;
+        }
+    }
+}
+
+void fsck_dir(struct FsckWorker* w, int dir, int parent, char* path) {
+    // Counters are shared with the other workers, hence the atomic adds
+    struct Fsck* fs = w->fs;
+    char buf[512] = {0};
+    char sub[256];
+    struct Dir d;
+    int sector = dir;
+    int prev = -1;      // first sector of dir: .back is parent, or 0 in dirs made before it was kept
+
+    __atomic_fetch_add(&fs->dirs, 1, __ATOMIC_RELAXED);
+
+    if (dir != 0 && fs->back[dir] != parent && fs->back[dir] != 0) {
+        printf("Dir %s at sector %d has .back %d, parent is %d\n", path, dir, fs->back[dir], parent);
+        __atomic_fetch_add(&fs->badLinks, 1, __ATOMIC_RELAXED);
+    }
+
+    while (fsck_reach(fs, sector, (sector == dir) ? 'D' : 'E', prev)) {
+        fsck_read(w, buf, sector);
+        buf2dir(buf, &d);
+
+        for (int i=0; i<31; i++) {
+            struct FileIDX* e = &d.Idx[i];
+            int bad = 0;
+
+            if (e->type == 'F') {
+                continue;
+            }
+            if (e->type == 'C') {   // data of inline file before it
+                if (i == 0 || (d.Idx[i-1].type != 'I' && d.Idx[i-1].type != 'C')) {
+                    printf("Dir %s sector %d entry %d holds inline data of no file\n",
+                           (path[0] == '\0') ? "/" : path, sector, i);
+                    __atomic_fetch_add(&fs->badEntries, 1, __ATOMIC_RELAXED);
+                }
+                continue;
+            }
+            snprintf(sub, sizeof(sub), "%s/%.9s", path, e->name);
+
+            if (e->type != 'D' && e->type != 'U' && e->type != 'I') {
+                printf("Dir %s sector %d entry %d has type 0x%02x\n", (path[0] == '\0') ? "/" : path,
+                       sector, i, (unsigned char)e->type);
+                __atomic_fetch_add(&fs->badEntries, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (e->name[0] == '\0' || e->name[0] == ' ') {
+                bad = 1;
+            }
+            for (int c=0; c<9 && e->name[c] != '\0'; c++) {
+                bad |= ( (unsigned char)e->name[c] < 0x20 || (unsigned char)e->name[c] > 0x7e || e->name[c] == '/' );
+            }
+            if (e->type == 'U' && CZ_SIZE(e->size) > 504) {
+                bad = 1;
+            }
+            if (e->type == 'I' && (e->size < 0 || e->size > inline_slots(&d, i) * INLINE_PER_SLOT)) {
+                bad = 1;
+            }
+            for (int j=0; j<i; j++) {   // same name twice in one sector of a dir
+                bad |= ( d.Idx[j].type != 'F' && d.Idx[j].type != 'C' && strncmp(d.Idx[j].name, e->name, 9) == 0 );
+            }
+            if (bad) {
+                printf("Entry %s (sector %d entry %d) is malformed\n", sub, sector, i);
+                __atomic_fetch_add(&fs->badEntries, 1, __ATOMIC_RELAXED);
+            }
+            if (e->link <= 0 || e->link >= fs->numSectors) {
+                printf("Entry %s links to sector %d, outside container\n", sub, e->link);
+                __atomic_fetch_add(&fs->badLinks, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (e->type == 'D') {
+                fsck_queue(fs, e->link, dir, sub);
+                continue;
+            }
+            __atomic_fetch_add(&fs->files, 1, __ATOMIC_RELAXED);
+
+            if (e->type == 'I') {   // no sectors of its own
+                if (e->link != sector) {
+                    printf("Inline file %s links to sector %d, it is in %d\n", sub, e->link, sector);
+                    __atomic_fetch_add(&fs->badLinks, 1, __ATOMIC_RELAXED);
+                }
+                continue;
+            }
+            // user file chain from the headers; first sector's .back is 0
+
+            for (int s = e->link, p = 0; s != 0; p = s, s = fs->frwd[s]) {
+                if (s < 0 || s >= fs->numSectors) {
+                    printf("File %s links to sector %d, outside container\n", sub, s);
+                    __atomic_fetch_add(&fs->badLinks, 1, __ATOMIC_RELAXED);
+                    break;
+                }
+                if (!fsck_reach(fs, s, 'U', p)) {
+                    break;
+                }
+            }
+            if ((e->size & DD_FLAG) && fs->ddRefs != NULL) {
+                fsck_blockMap(w, e->link, sub);
+            }
+        }
+        if (d.frwd == 0) {
+            break;
+        }
+        if (d.frwd < 0 || d.frwd >= fs->numSectors) {
+            printf("Dir %s extention link %d is outside container\n", (path[0] == '\0') ? "/" : path, d.frwd);
+            __atomic_fetch_add(&fs->badLinks, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        prev = sector;
+        sector = d.frwd;
+    }
+}
+
+int scrub() {
+    /* Reads the container SCRUB_CHUNK sectors at a time and checks each sector
+     *  against the checksum table. Runs niced so it can be left going next to
+     *  other work on the machine.
+     */
+    int fd = 0;         // File descriptor of container
+    char* buf = NULL;
+    long long start = msecNow();
+    long long msec = 0;
+    int bad = 0;
+    int checked = 0;
+
+    if (crcTable.crc == NULL) {
+        printf("Container %s has no checksums (init with -O crc)\n", opt.filename);
+        return 0;
+    }
+    errno = 0;
+
+    if (nice(10) == -1 && errno != 0) {
+        dprintf(2, "Could not lower priority; %s\n", strerror(errno));
+    }
+    if (posix_memalign((void **)&buf, SC_PAGE, (size_t)SCRUB_CHUNK * BUF_SIZE) != 0) {     // -D reads into it directly
+        dprintf(2, "Could not get memory to scrub with\n");
+        return 1;
+    }
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+
+    for (int chunk=0; chunk<crcTable.numSectors; chunk+=SCRUB_CHUNK) {
+        int count = (crcTable.numSectors - chunk < SCRUB_CHUNK) ? crcTable.numSectors - chunk : SCRUB_CHUNK;
+        long len = ((long)count * BUF_SIZE + SC_PAGE - 1) / SC_PAGE * SC_PAGE;   // whole pages for -D
+
+        if (devRead(fd, buf, len, (off_t)chunk * BUF_SIZE) < (long)count * BUF_SIZE) {
+            dprintf(2, "Error occured reading sectors %d-%d; %s\n", chunk, chunk + count - 1, strerror(errno));
+            free(buf);
+            die(&fd, 3);
+        }
+        for (int i=0; i<count; i++) {
+            int sector = chunk + i;
+
+            if ((sector >= crcTable.first && sector < crcTable.first + crcTable.len) || gen_own(sector)) {
+                continue;
+            }
+            checked++;
+
+            if (!crc_verify(sector, buf + (long)i * BUF_SIZE)) {
+                printf("Checksum mismatch in sector %d\n", sector);
+                bad++;
+            }
+        }
+    }
+    containerClose(fd);
+    free(buf);
+
+    msec = msecNow() - start;
+    printf("Scrubbed %d sectors (%d KB) in %lld msec", checked, checked / 2, msec);
+
+    if (msec > 0) {
+        printf(", %.1f MB/s", (double)checked * BUF_SIZE / 1048576.0 / (msec / 1000.0));
+    }
+    printf("; %d bad\n", bad);
+
+    return bad;
+}
+
+int superLoad() {
+    // Loads super sector linked from root .filler. Containers made before the
+    //  super sector existed have NO_SUPER there; super is zeroed and 0 returned
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d;
+
+    memset(&super, 0, sizeof(super));
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    sectorRead(buf, fd, 0);
+    buf2dir(buf, &d);
+
+    if (d.filler == (int)NO_SUPER) {
+        containerClose(fd);
+        crc_load();
+        dd_load();
+        gen_load();
+        return 0;
+    }
+    sectorRead(buf, fd, d.filler);
+    buf2super(buf, &super);
+
+    if (super.magic != SUPER_MAGIC || super.version > SUPER_VERSION) {
+        dprintf(2, "Container %s has no valid super sector at %d\n", opt.filename, d.filler);
+        die(&fd, 3);
+    }
+    if (super.stripes != stripes.count) {  // the rest would be read from the wrong places
+        dprintf(2, "Container %s is striped over %d files, -f names %d\n", opt.filename,
+                (super.stripes > 0) ? super.stripes : 1, (stripes.count > 0) ? stripes.count : 1);
+        die(&fd, 3);
+    }
+    stripes.unit = (super.stripeUnit > 0) ? super.stripeUnit : stripes.unit;
+
+    if (snaps.view.fd >= 0) {   // nothing grows or is punched through a snapshot
+        super.features &= ~(FEAT_GROW | FEAT_TRIM);
+    }
+    containerClose(fd);
+    crc_load();
+    dd_load();      // after crc_load(), so table sectors are checked
+    gen_load();
+
+    return 1;
+}
+
+void superWrite() {
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+    super2buf(buf, super);
+    sectorWrite(buf, fd, super.self);
+    containerClose(fd);
+}
+
+void agg_get(int sector, struct Aggregate* a) {
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    int off = (sector % AGG_PER_SECTOR) * 16;
+
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    sectorRead(buf, fd, super.aggTable + sector / AGG_PER_SECTOR);
+    containerClose(fd);
+
+    memcpy(&a->bytes, buf+off, 8);
+    memcpy(&a->sectors, buf+off+8, 4);
+    memcpy(&a->files, buf+off+12, 4);
+}
+
+void agg_put(int sector, struct Aggregate* a) {
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    int tblSector = super.aggTable + sector / AGG_PER_SECTOR;
+    int off = (sector % AGG_PER_SECTOR) * 16;
+
+    if ( !(super.features & FEAT_AGGREGATES) ) {
+        return;
+    }
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorRead(buf, fd, tblSector);
+    memcpy(buf+off, &a->bytes, 8);
+    memcpy(buf+off+8, &a->sectors, 4);
+    memcpy(buf+off+12, &a->files, 4);
+    sectorWrite(buf, fd, tblSector);
+    containerClose(fd);
+}
+
+void agg_add(int sector, long long bytes, int sectors, int files) {
+    struct Aggregate a;
+
+    if ( !(super.features & FEAT_AGGREGATES) ) {
+        return;
+    }
+    agg_get(sector, &a);
+    a.bytes += bytes;
+    a.sectors += sectors;
+    a.files += files;
+    agg_put(sector, &a);
+}
+
+void agg_addPath(int* dirs, int count, long long bytes, int sectors, int files) {
+    // Totals of every dir on the path hold everything below them
+    for (int i=0; i<count; i++) {
+        agg_add(dirs[i], bytes, sectors, files);
+    }
+}
+
+int nameRec_cmp(struct NameRec* a, struct NameRec* b) {
+    int c = strncmp(a->name, b->name, 9);
+
+    if (c != 0) {
+        return c;
+    }
+    if (a->sector != b->sector) {
+        return (a->sector < b->sector) ? -1 : 1;
+    }
+    return a->idx - b->idx;
+}
+
+int allocSector() {
+    // Takes first sector off the free list, root .free moves to the one after
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d;
+    int sector = 0;
+
+    get2FreeSectors();
+
+    if (currState.free == 0) {
+        printf("No free sectors!\n");
+        exit(255);
+    }
+    sector = currState.free;
+
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorRead(buf, fd, 0);
+    buf2dir(buf, &d);
+    d.free = currState.next_free;
+    dir2buf(buf, d);
+    sectorWrite(buf, fd, 0);
+    containerClose(fd);
+    get2FreeSectors();
+
+    return sector;
+}
+
+int nameIdx_insertNode(int sector, struct NameRec* key, struct NameRec* split) {
+    /* Inserts key below node at sector. A full node is split in half, the upper
+     *  half going to a new node; split then holds its first key with .child
+     *  pointing at it so the caller can insert it one level up.
+     */
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct NameNode n;
+    struct NameRec tmp[NAMEREC_PER_NODE + 1];
+    struct NameRec ins = *key;
+    int pos = 0;
+
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorRead(buf, fd, sector);
+    buf2node(buf, &n);
+
+    if (n.level == 0) {
+        while (pos < n.count && nameRec_cmp(&n.rec[pos], key) < 0) {
+            pos++;
+        }
+        ins.child = 0;
+    }
+    else {
+        // rec[0] stands for everything below rec[1]
+        int i = 0;
+
+        while (i+1 < n.count && nameRec_cmp(&n.rec[i+1], key) <= 0) {
+            i++;
+        }
+        if ( !nameIdx_insertNode(n.rec[i].child, key, &ins) ) {
+            containerClose(fd);
+            return 0;
+        }
+        pos = i + 1;
+    }
+    memcpy(tmp, n.rec, pos * sizeof(struct NameRec));
+    tmp[pos] = ins;
+    memcpy(&tmp[pos+1], &n.rec[pos], (n.count - pos) * sizeof(struct NameRec));
+    n.count++;
+
+    if (n.count <= NAMEREC_PER_NODE) {
+        memcpy(n.rec, tmp, n.count * sizeof(struct NameRec));
+        node2buf(buf, n);
+        sectorWrite(buf, fd, sector);
+        containerClose(fd);
+
+        return 0;
+    }
+    // Split: lower half stays, upper half moves to new node
+    struct NameNode right = { .count=0, .level=n.level, .frwd=n.frwd, .filler=0 };
+    int half = n.count / 2;
+    int rightSector = allocSector();
+
+    memset(right.rec, 0, sizeof(right.rec));
+    right.count = n.count - half;
+    memcpy(right.rec, &tmp[half], right.count * sizeof(struct NameRec));
+    node2buf(buf, right);
+    sectorWrite(buf, fd, rightSector);
+
+    memset(n.rec, 0, sizeof(n.rec));
+    n.count = half;
+    memcpy(n.rec, tmp, half * sizeof(struct NameRec));
+    n.frwd = (n.level == 0) ? rightSector : 0;
+    node2buf(buf, n);
+    sectorWrite(buf, fd, sector);
+    containerClose(fd);
+
+    *split = right.rec[0];
+    split->child = rightSector;
+
+    return 1;
+}
+
+void nameIdx_insert(char* name, char type, int sector, int idx) {
+    int origSector = currState.curr_sector;    // callers keep walking the dir in ram
+    struct NameRec key = { .type=type, .idx=(char)idx, .sector=sector, .child=0 };
+    struct NameRec split;
+
+    if ( !(super.features & FEAT_NAMEIDX) ) {
+        return;
+    }
+    memset(key.name, 0, sizeof(key.name));
+    strncpy(key.name, name, 9);
+
+    if ( nameIdx_insertNode(super.nameIdx, &key, &split) ) {
+        // Root was split, grow the tree by one level
+        int fd = 0;         // File descriptor of container
+        char buf[512] = {0};
+        struct NameNode root;
+        int rootSector = allocSector();
+
+        fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+        sectorRead(buf, fd, super.nameIdx);
+        buf2node(buf, &root);
+        root.level++;
+        root.count = 2;
+        root.frwd = 0;
+        memset(root.rec, 0, sizeof(root.rec));
+        root.rec[0].child = super.nameIdx;
+        root.rec[1] = split;
+        node2buf(buf, root);
+        sectorWrite(buf, fd, rootSector);
+        containerClose(fd);
+
+        super.nameIdx = rootSector;
+        superWrite();
+    }
+    currState.curr_sector = origSector;
+}
+
+int nameIdx_seek(struct NameRec* key, struct NameNode* n, int* pos) {
+    // Loads the leaf key belongs in and finds first record >= key. Returns leaf sector
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    int sector = super.nameIdx;
+
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    sectorRead(buf, fd, sector);
+    buf2node(buf, n);
+
+    while (n->level > 0) {
+        int i = 0;
+
+        while (i+1 < n->count && nameRec_cmp(&n->rec[i+1], key) <= 0) {
+            i++;
+        }
+        sector = n->rec[i].child;
+        sectorRead(buf, fd, sector);
+        buf2node(buf, n);
+    }
+    containerClose(fd);
+
+    *pos = 0;
+    while (*pos < n->count && nameRec_cmp(&n->rec[*pos], key) < 0) {
+        (*pos)++;
+    }
+    return sector;
+}
+
+void nameIdx_delete(char* name, int sector, int idx) {
+    // Leaves are allowed to run empty, keys above them still order the tree
+    int origSector = currState.curr_sector;    // callers keep walking the dir in ram
+    struct NameRec key = { .idx=(char)idx, .sector=sector };
+    struct NameNode n;
+    int pos = 0;
+    int leaf = 0;
+
+    if ( !(super.features & FEAT_NAMEIDX) ) {
+        return;
+    }
+    memset(key.name, 0, sizeof(key.name));
+    strncpy(key.name, name, 9);
+    leaf = nameIdx_seek(&key, &n, &pos);
+
+    if (pos < n.count && nameRec_cmp(&n.rec[pos], &key) == 0) {
+        int fd = 0;         // File descriptor of container
+        char buf[512] = {0};
+
+        memmove(&n.rec[pos], &n.rec[pos+1], (n.count - pos - 1) * sizeof(struct NameRec));
+        n.count--;
+        memset(&n.rec[n.count], 0, sizeof(struct NameRec));
+        node2buf(buf, n);
+        fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+        sectorWrite(buf, fd, leaf);
+        containerClose(fd);
+    }
+    currState.curr_sector = origSector;
+}
+
+void nameIdx_freeNode(int sector) {
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct NameNode n;
+
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    sectorRead(buf, fd, sector);
+    containerClose(fd);
+    buf2node(buf, &n);
+
+    if (n.level > 0) {
+        for (int i=0; i<n.count; i++) {
+            nameIdx_freeNode(n.rec[i].child);
+        }
+    }
+    currState.curr_sector = sector;
+    append2FreeList();
+}
+
+int nameIdx_walk(int fd, char* image, int (*visit)(void*, int), void* arg) {
+    /* Hands visit() every node sector of the index, a node before the nodes
+     *  below it; the nodes below are read only when visit() returns 1, which
+     *  it does once it has checked the sector and not seen it before. The
+     *  stack grows with the index, so no node is left out. Returns nodes read.
+     */
+    char buf[512] = {0};
+    int max = 64;
+    int* stack = NULL;
+    int top = 0;
+    int nodes = 0;
+
+    if (super.nameIdx == 0) {
+        return 0;
+    }
+    stack = (int *)malloc( max * sizeof(int) );
+    stack[ top++ ] = super.nameIdx;
+
+    while (top > 0) {
+        struct NameNode n;
+        int sector = stack[ --top ];
+
+        if (!visit(arg, sector)) {
+            continue;
+        }
+        if (image != NULL) {
+            buf2node(image + (long)sector * BUF_SIZE, &n);
+        }
+        else {
+            sectorRead(buf, fd, sector);
+            buf2node(buf, &n);
+        }
+        nodes++;
+
+        if (n.level > 0 && top + NAMEREC_PER_NODE > max) {
+            max = (top + NAMEREC_PER_NODE) * 2;
+            stack = (int *)realloc( stack, max * sizeof(int) );
+        }
+        for (int i=0; n.level > 0 && i<n.count && i<NAMEREC_PER_NODE; i++) {
+            stack[ top++ ] = n.rec[i].child;
+        }
+    }
+    free(stack);
+
+    return nodes;
+}
+
+void nameIdx_build() {
+    /* Drops any existing index and inserts every entry of the tree. Also sets
+     *  .back of each dir to its parent, which find needs to rebuild paths and
+     *  which dirs made before the index existed do not have.
+     */
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct NameNode root = { .count=0, .level=0, .frwd=0, .filler=0 };
+    struct DirWalk w;
+    struct DirEntryPlus e;
+    struct Dir d;
+    int count = 0;
+
+    if (super.magic != SUPER_MAGIC) {
+        printf("Container %s has no super sector, name index needs a newly initialized container\n", opt.filename);
+        exit(1);
+    }
+
+    if (super.nameIdx != 0) {
+        currState.last_free = getLastFree();
+        nameIdx_freeNode(super.nameIdx);
+    }
+    super.nameIdx = allocSector();
+    super.features |= FEAT_NAMEIDX;
+    memset(root.rec, 0, sizeof(root.rec));
+    node2buf(buf, root);
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorWrite(buf, fd, super.nameIdx);
+    superWrite();
+
+    dirWalk_open(&w, 0, 1);
+
+    while ( dirWalk_next(&w, &e) ) {
+        nameIdx_insert(e.name, e.type, e.entry_sector, e.entry_idx);
+        count++;
+
+        if (e.type == 'D') {
+            sectorRead(buf, fd, e.sector);
+            buf2dir(buf, &d);
+
+            if (d.back != e.parent) {
+                d.back = e.parent;
+                dir2buf(buf, d);
+                sectorWrite(buf, fd, e.sector);
+            }
+        }
+    }
+    dirWalk_close(&w);
+    containerClose(fd);
+
+    printf("Indexed %d names\n", count);
+}
+
+void seek_file(int base, double offset) {   // SEEK base offset 
+    // base=-1: start of file; base=0: curr loc in file; base=1: EOF
+}
+
+void dir2buf(char* b, struct Dir d) {
+    char **p = &b;
+
+    memcpy(*p+0, &d.back, 4);
+    memcpy(*p+4, &d.frwd, 4);
+    memcpy(*p+8, &d.free, 4);
+    memcpy(*p+12, &d.filler, 4);
+
+    for (int i=0; i<31; i++) {
+        //    base+( hdrOffset+(arrOffset)+fieldOffset ), StructSrc, len2cp)
+        memcpy(*p+( 16+(i*16) ), &d.Idx[i].link, 4);
+        memcpy(*p+( 16+(i*16)+4 ), &d.Idx[i].name, 9);    // Not copying the NUL term.
+        memcpy(*p+( 16+(i*16)+4+9 ), &d.Idx[i].type, 1);
+        memcpy(*p+( 16+(i*16)+4+9+1 ), &d.Idx[i].size, 2);
+    }
+}
+void file2buf(char* b, struct File f) {
+    char **p = &b;
+
+    /* struct File
+            char data[504];
+            int back;
+            int frwd;
+     */
+    memcpy(*p+0, &f.back, 4);
+    memcpy(*p+4, &f.frwd, 4);
+    memcpy(*p+8, &f.data, 504);
+}
+void buf2dir(char* b, struct Dir* d) {
+    char **p = &b;
+
+    //DEBUG
+    //printf("buf2dir() running\n");
+    //print_hex_memory(*p+0, 16);
+    //print_hex_memory(*p+32, 16);
+
+    memcpy(&d->back, *p+0, 4);
+    memcpy(&d->frwd, *p+4, 4);
+    memcpy(&d->free, *p+8, 4);
+    memcpy(&d->filler, *p+12, 4);
+
+    /* struct FileIDX Idx[31];
+            int link;
+            char name[9];
+            char type;
+            short int size;
+    */
+    for (int i=0; i<31; i++) {
+        memcpy(&d->Idx[i].link, *p+( 16+(i*16) ), 4);
+        memcpy(&d->Idx[i].name, *p+( 16+(i*16)+4 ), 9); //init gave terminating \0
+        memcpy(&d->Idx[i].type, *p+( 16+(i*16)+4+9 ), 1);
+        memcpy(&d->Idx[i].size, *p+( 16+(i*16)+4+9+1 ), 2);
+    }
+
+    //DEBUG
+    /*
+    for (int i=0; i<5; i++) {
+        printf("d->Idx[%d].name: %s\t.type: %c\n", i, (char *)d->Idx[i].name, (char)d->Idx[i].type);
+    }
+    */
+}
+void super2buf(char* b, struct Super s) {
+    memcpy(b+0, &s.magic, 4);
+    memcpy(b+4, &s.version, 4);
+    memcpy(b+8, &s.features, 4);
+    memcpy(b+12, &s.numSectors, 4);
+    memcpy(b+16, &s.self, 4);
+    memcpy(b+20, &s.aggTable, 4);
+    memcpy(b+24, &s.aggTableLen, 4);
+    memcpy(b+28, &s.nameIdx, 4);
+    memcpy(b+32, &s.allocPolicy, 4);
+    memcpy(b+36, &s.crcTable, 4);
+    memcpy(b+40, &s.crcTableLen, 4);
+    memcpy(b+44, &s.inlineMax, 4);
+    memcpy(b+48, &s.dedupTable, 4);
+    memcpy(b+52, &s.dedupTableLen, 4);
+    memcpy(b+56, &s.stripes, 4);
+    memcpy(b+60, &s.stripeUnit, 4);
+    memcpy(b+64, &s.growMax, 4);
+    memcpy(b+68, &s.snapCount, 4);
+
+    for (int i=0; i<SNAP_MAX; i++) {
+        memcpy(b+72+(i*10), &s.snapName[i], 10);
+    }
+    memcpy(b+152, &s.genTable, 4);
+    memcpy(b+156, &s.genTableLen, 4);
+    memcpy(b+160, &s.generation, 4);
+}
+void buf2super(char* b, struct Super* s) {
+    memcpy(&s->magic, b+0, 4);
+    memcpy(&s->version, b+4, 4);
+    memcpy(&s->features, b+8, 4);
+    memcpy(&s->numSectors, b+12, 4);
+    memcpy(&s->self, b+16, 4);
+    memcpy(&s->aggTable, b+20, 4);
+    memcpy(&s->aggTableLen, b+24, 4);
+    memcpy(&s->nameIdx, b+28, 4);
+    memcpy(&s->allocPolicy, b+32, 4);
+    memcpy(&s->crcTable, b+36, 4);
+    memcpy(&s->crcTableLen, b+40, 4);
+    memcpy(&s->inlineMax, b+44, 4);
+    memcpy(&s->dedupTable, b+48, 4);
+    memcpy(&s->dedupTableLen, b+52, 4);
+    memcpy(&s->stripes, b+56, 4);
+    memcpy(&s->stripeUnit, b+60, 4);
+    memcpy(&s->growMax, b+64, 4);
+    memcpy(&s->snapCount, b+68, 4);
+
+    for (int i=0; i<SNAP_MAX; i++) {
+        memcpy(&s->snapName[i], b+72+(i*10), 10);
+        s->snapName[i][9] = '\0';
+    }
+    memcpy(&s->genTable, b+152, 4);
+    memcpy(&s->genTableLen, b+156, 4);
+    memcpy(&s->generation, b+160, 4);
+}
+void node2buf(char* b, struct NameNode n) {
+    memcpy(b+0, &n.count, 4);
+    memcpy(b+4, &n.level, 4);
+    memcpy(b+8, &n.frwd, 4);
+    memcpy(b+12, &n.filler, 4);
+
+    for (int i=0; i<NAMEREC_PER_NODE; i++) {
+        //    base+( hdrOffset+(arrOffset)+fieldOffset ), StructSrc, len2cp)
+        memcpy(b+( 16+(i*20) ), &n.rec[i].name, 9);       // Not copying the NUL term.
+        memcpy(b+( 16+(i*20)+9 ), &n.rec[i].type, 1);
+        memcpy(b+( 16+(i*20)+10 ), &n.rec[i].idx, 1);
+        memcpy(b+( 16+(i*20)+12 ), &n.rec[i].sector, 4);
+        memcpy(b+( 16+(i*20)+16 ), &n.rec[i].child, 4);
+    }
+}
+void buf2node(char* b, struct NameNode* n) {
+    memcpy(&n->count, b+0, 4);
+    memcpy(&n->level, b+4, 4);
+    memcpy(&n->frwd, b+8, 4);
+    memcpy(&n->filler, b+12, 4);
+
+    for (int i=0; i<NAMEREC_PER_NODE; i++) {
+        memcpy(&n->rec[i].name, b+( 16+(i*20) ), 9);
+        n->rec[i].name[9] = '\0';
+        memcpy(&n->rec[i].type, b+( 16+(i*20)+9 ), 1);
+        memcpy(&n->rec[i].idx, b+( 16+(i*20)+10 ), 1);
+        memcpy(&n->rec[i].sector, b+( 16+(i*20)+12 ), 4);
+        memcpy(&n->rec[i].child, b+( 16+(i*20)+16 ), 4);
+    }
+}
+void buf2file(char* b, struct File* f) {
+    char **p = &b;
+
+    memcpy(&f->back, *p+0, 4);
+    memcpy(&f->frwd, *p+4, 4);
+    memcpy(&f->data, *p+8, 504);
+}
+
+int containerOpen(char* p, int m) {
+    int fd = 0;
+    /* m =
+     * CONTAINER_CREAT create file, truncate, write-only, will overwrite existing file with same name
+     * CONTAINER_INIT create file, truncate, write-only, will error if file exists
+     * CONTAINER_READ read-only
+     * CONTAINER_WRITE write-only
+     * CONTAINER_READWRITE read/write
+     */
+    int direct = (scache.slots > 0) ? O_DIRECT : 0;
+
+    if (stripes.count > 0) {
+        return stripe_open(m, direct);
+    }
+    if (memImage.active) {  // file was read once by mem_load(), init starts over
+        if (m == CONTAINER_INIT && memImage.len > 0) {
+            dprintf(2, "Could not open container file %s with mode %d; %s\n", opt.filename, m, strerror(EEXIST));
+            die(NULL, 1);
+        }
+        if (m == CONTAINER_CREAT || m == CONTAINER_INIT) {
+            memImage.len = 0;
+        }
+        return containerFd;
+    }
+    switch (m) {
+        case CONTAINER_CREAT:
+        case CONTAINER_INIT:
+            if (direct) {       // pages are read before a sector in them is written
+                m = (m & ~O_WRONLY) | O_RDWR;
+                sc_clear(&scache);
+            }
+            fd = open(opt.filename, m | direct, CONTAINER_PERMS);
+
+            if (fd < 0 && direct && errno == EINVAL) {
+                fd = open(opt.filename, m, CONTAINER_PERMS);
+            }
+            break;
+        default:
+            /* Every helper opens the container for itself, so keep one read/write
+             *  handle for the whole command instead of an open() per sector walked.
+             *  Read-only containers fall back to a read-only handle.
+             */
+            if (containerFd >= 0) {
+                return containerFd;
+            }
+            fd = open(opt.filename, CONTAINER_READWRITE | direct);
+
+            if (fd < 0 && direct && errno == EINVAL) {  // file system without O_DIRECT, cache still used
+                dprintf(2, "%s does not allow O_DIRECT, reading through the page cache\n", opt.filename);
+                direct = 0;
+                fd = open(opt.filename, CONTAINER_READWRITE);
+            }
+            if (fd < 0 && m == CONTAINER_READ && (errno == EACCES || errno == EROFS)) {
+                fd = open(opt.filename, m | direct);
+            }
+            containerFd = fd;
+            break;
+    }
+
+    if (fd < 0) {
+        dprintf(2, "Could not open container file %s with mode %d; %s\n", opt.filename, m, strerror(errno));
+        die(&fd, 1);
+    }
+    return fd;
+}
+
+void containerClose(int fd) {
+    //TODO: error handling
+    if (fd != containerFd) {
+        wb_flush(fd);   // init's own handle
+        close(fd);
+    }
+    // shared handle is closed on exit
+}
+
+void sectorPrefetch(int fd, int sector) {
+    posix_fadvise(fd, (off_t)sector * BUF_SIZE, BUF_SIZE, POSIX_FADV_WILLNEED);
+}
+
+char* containerImage(int numSectors) {
+    // Whole container in memory, read IMAGE_CHUNK sectors at a time
+    int fd = 0;         // File descriptor of container
+    char* image = NULL;
+
+    if (posix_memalign((void **)&image, SC_PAGE, (long)numSectors * BUF_SIZE) != 0) {  // -D reads into it directly
+        dprintf(2, "Could not get memory for %d sectors\n", numSectors);
+        exit(3);
+    }
+    int chunks = (numSectors + IMAGE_CHUNK - 1) / IMAGE_CHUNK;
+    struct UringOp* ops = (struct UringOp *)calloc( chunks, sizeof(struct UringOp) );
+
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (int c=0; c<chunks; c++) {     // with -q the chunks are read side by side
+        int i = c * IMAGE_CHUNK;
+
+        ops[c].buf = image + (long)i * BUF_SIZE;
+        ops[c].len = (long)( (numSectors - i < IMAGE_CHUNK) ? numSectors - i : IMAGE_CHUNK ) * BUF_SIZE;
+        ops[c].offset = (off_t)i * BUF_SIZE;
+    }
+    if (ioRun(fd, ops, chunks) > 0) {
+        for (int c=0; c<chunks; c++) {
+            if (ops[c].res != ops[c].len) {
+                dprintf(2, "Error occured reading sectors at %d; %s\n", c * IMAGE_CHUNK,
+                        strerror( (ops[c].res < 0) ? -ops[c].res : EIO ));
+                break;
+            }
+        }
+        die(&fd, 3);
+    }
+    containerClose(fd);
+    free(ops);
+
+    return image;
+}
+
+void sectorPrefetchMany(int fd, int* sectors, int n) {
+    // Without -q this is sectorPrefetch() of each; with it the sectors are read
+    //  in one batch, which leaves them in the page cache for sectorRead()
+    if (ring.fd < 0 || n < 2) {
+        for (int i=0; i<n; i++) {
+            sectorPrefetch(fd, sectors[i]);
+        }
+        return;
+    }
+    char* scratch = (char *)malloc( (long)n * BUF_SIZE );
+    struct UringOp* ops = (struct UringOp *)calloc( n, sizeof(struct UringOp) );
+
+    for (int i=0; i<n; i++) {
+        ops[i].buf = scratch + (long)i * BUF_SIZE;
+        ops[i].len = BUF_SIZE;
+        ops[i].offset = (off_t)sectors[i] * BUF_SIZE;
+    }
+    ioRun(fd, ops, n);     // only a hint, errors show up when the sector is read for real
+    free(ops);
+    free(scratch);
+}
+
+void sectorReadMany(int fd, int* sectors, int n, char* bufs) {
+    // Like sectorRead() of each into bufs + i * BUF_SIZE, but currState.curr_sector is left alone
+    struct UringOp* ops = (struct UringOp *)calloc( n, sizeof(struct UringOp) );
+
+    for (int i=0; i<n; i++) {
+        ops[i].buf = bufs + (long)i * BUF_SIZE;
+        ops[i].len = BUF_SIZE;
+        ops[i].offset = (off_t)sectors[i] * BUF_SIZE;
+    }
+    if (ioRun(fd, ops, n) > 0) {
+        for (int i=0; i<n; i++) {
+            if (ops[i].res != BUF_SIZE) {
+                dprintf(2, "Error occured reading sector at offset %ld; %s\n", (long)ops[i].offset,
+                        strerror( (ops[i].res < 0) ? -ops[i].res : EIO ));
+                break;
+            }
+        }
+        free(ops);
+        die(&fd, 3);
+    }
+    free(ops);
+
+    for (int i=0; crcTable.crc != NULL && i<n; i++) {
+        if (!crc_verify(sectors[i], bufs + (long)i * BUF_SIZE)) {
+            dprintf(2, "Checksum mismatch in sector %d of %s\n", sectors[i], opt.filename);
+            die(&fd, 4);
+        }
+    }
+}
+
+int ioRun(int fd, struct UringOp* ops, int n) {
+    /* Through the -D cache or ioRun_raw(). Sectors held by the write-back
+     *  are read from it, and written sectors it holds are updated too. Never
+     *  dies, so die() may use it too.
+     */
+    int failed = 0;
+
+    if (snaps.view.fd >= 0 && n > 0 && ops[0].write) {     // a snapshot is read only
+        for (int i=0; i<n; i++) {
+            ops[i].res = -EROFS;
+        }
+        return n;
+    }
+    for (int i=0; super.snapCount > 0 && i<n; i++) {   // snapshots keep what is overwritten
+        if (ops[i].write) {
+            snap_cow(fd, ops[i].offset, ops[i].len);
+        }
+    }
+    snap_sync();
+
+    for (int i=0; genTable.gen != NULL && i<n; i++) {
+        if (ops[i].write) {
+            gen_mark(ops[i].offset / BUF_SIZE, (ops[i].len + BUF_SIZE - 1) / BUF_SIZE);
+        }
+    }
+    for (int i=0; wback.count > 0 && i<n; i++) {   // held copies of what is written stay current
+        for (long k=0; ops[i].write && k * BUF_SIZE < ops[i].len; k++) {
+            char* held = wb_find(&wback, ops[i].offset / BUF_SIZE + k);
+
+            if (held != NULL) {
+                memcpy(held, ops[i].buf + k * BUF_SIZE, BUF_SIZE);
+            }
+        }
+    }
+    if (scache.slots > 0) {
+        failed = dio_run(fd, ops, n);
+    }
+    else {
+        failed = ioRun_raw(fd, ops, n);
+    }
+    for (int i=0; wback.count > 0 && i<n; i++) {   // reads see what is held
+        for (long k=0; !ops[i].write && k * BUF_SIZE < ops[i].len; k++) {
+            char* held = wb_find(&wback, ops[i].offset / BUF_SIZE + k);
+
+            if (held != NULL) {
+                memcpy(ops[i].buf + k * BUF_SIZE, held, BUF_SIZE);
+            }
+        }
+    }
+    return failed;
+}
+
+int ioRun_raw(int fd, struct UringOp* ops, int n) {
+    // With -q the ring keeps up to that many in flight, on all backing files
+    //  of a striped container at once; without it a striped container's
+    //  files are each read and written by a thread of their own. What that
+    //  did not finish (short reads, or the ring failing) is done again with
+    //  devRead/devWrite, as is everything else
+    int viaRing = (ring.fd >= 0 && n > 1 && !memImage.active && snaps.view.fd < 0);
+    int viaStripes = (!viaRing && stripes.count > 0 && n > 1 && snaps.view.fd < 0);
+    int failed = 0;
+    struct UringOp* run = ops;
+    int* owner = NULL;          // operation each piece of run is part of
+    int m = n;
+
+    for (int i=0; i<n; i++) {
+        ops[i].fd = fd;
+    }
+    if ((viaRing || viaStripes) && stripes.count > 0) {
+        run = stripe_split(ops, n, &owner, &m);
+    }
+    if (viaRing && uring_run(&ring, run, m) < 0) {
+        uring_exit(&ring);      // rest of the run goes without it
+        viaRing = 0;
+    }
+    else if (viaStripes) {
+        stripe_run(run, m);
+    }
+    if (run != ops) {           // done when every piece is
+        for (int i=0; i<n; i++) {
+            ops[i].res = ops[i].len;
+        }
+        for (int k=0; k<m; k++) {
+            if (run[k].res != run[k].len) {
+                ops[ owner[k] ].res = -1;
+            }
+        }
+        free(run);
+        free(owner);
+    }
+    for (int i=0; i<n; i++) {
+        if (!(viaRing || viaStripes) || ops[i].res != ops[i].len) {
+            ops[i].res = ops[i].write ? devWrite(fd, ops[i].buf, ops[i].len, ops[i].offset)
+                                      : devRead(fd, ops[i].buf, ops[i].len, ops[i].offset);
+            ops[i].res = (ops[i].res < 0) ? -errno : ops[i].res;
+        }
+        failed += (ops[i].res != ops[i].len);
+
+        if (ops[i].write) {
+            ra_drop(&readAhead, ops[i].offset / BUF_SIZE, (ops[i].len + BUF_SIZE - 1) / BUF_SIZE);
+        }
+    }
+    return failed;
+}
+
+long devRead(int fd, char* buf, long len, off_t offset) {
+    // Bytes read, fewer past the end of the container, -1 on error
+    long got = 0;
+
+    if (stripes.count > 0) {
+        got = stripe_io(buf, len, offset, 0);
+    }
+    else if (!memImage.active) {
+        got = pread(fd, buf, len, offset);
+    }
+    else if (offset < memImage.len) {
+        got = (len < memImage.len - offset) ? len : memImage.len - offset;
+        memcpy(buf, memImage.data + offset, got);
+    }
+    if (snaps.view.fd >= 0 && got > 0 && !snap_overlay(buf, got, offset)) {
+        return -1;
+    }
+    return got;
+}
+
+long devWrite(int fd, char* buf, long len, off_t offset) {
+    // Writes past the end make the in-memory container bigger, as they would a file
+    if (stripes.count > 0) {
+        return stripe_io(buf, len, offset, 1);
+    }
+    if (!memImage.active) {
+        return pwrite(fd, buf, len, offset);
+    }
+    if (offset + len > memImage.cap) {
+        long cap = (memImage.cap > 0) ? memImage.cap : CONTAINER_SIZE;
+        char* data = NULL;
+
+        while (cap < offset + len) {
+            cap *= 2;
+        }
+        if ((data = (char *)realloc( memImage.data, cap )) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memImage.data = data;
+        memImage.cap = cap;
+    }
+    if (offset > memImage.len) {
+        memset(memImage.data + memImage.len, 0, offset - memImage.len);
+    }
+    memcpy(memImage.data + offset, buf, len);
+
+    if (offset + len > memImage.len) {
+        memImage.len = offset + len;
+    }
+    return len;
+}
+
+long devPunch(int fd, off_t offset, long len) {
+    // Bytes punched; with -M the bytes become zeros, there is no file to shrink
+    if (snaps.view.fd >= 0) {
+        errno = EROFS;
+        return -1;
+    }
+    snap_cow(fd, offset, len);
+    snap_sync();
+
+    if (genTable.gen != NULL) {
+        gen_mark(offset / BUF_SIZE, len / BUF_SIZE);
+    }
+
+    if (stripes.count > 0) {
+        for (long done = 0; done < len; ) {
+            int f = 0;
+            off_t at = 0;
+            long piece = stripe_map(offset + done, len - done, &f, &at);
+
+            if (fallocate(f, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at, piece) < 0) {
+                return -1;
+            }
+            done += piece;
+        }
+        return len;
+    }
+    if (memImage.active) {
+        if (offset < memImage.len) {
+            memset(memImage.data + offset, 0, (len < memImage.len - offset) ? len : memImage.len - offset);
+        }
+        return len;
+    }
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+void snap_path(char* path, int size, char* name) {
+    // Next to the container, or to its first file when striped
+    snprintf(path, size, "%s@%s", (stripes.count > 0) ? stripes.name[0] : opt.filename, name);
+}
+
+int snap_open(struct Snapshot* s, char* name, int m) {
+    // Header of named snapshot into s; 0 (errno set) if it can not be opened
+    char path[4096];
+    char hdr[SNAP_HEADER];
+    struct stat st;
+    int magic = 0;
+
+    memset(s, 0, sizeof(*s));
+    strncpy(s->name, name, 9);
+    snap_path(path, sizeof(path), name);
+
+    if ((s->fd = open(path, m)) < 0) {
+        return 0;
+    }
+    if (pread(s->fd, hdr, SNAP_HEADER, 0) == SNAP_HEADER) {
+        memcpy(&magic, hdr, 4);
+        memcpy(&s->numSectors, hdr+4, 4);
+        memcpy(&s->broken, hdr+8, 4);
+    }
+    if (magic != SNAP_MAGIC || s->numSectors <= 0 || fstat(s->fd, &st) != 0) {
+        close(s->fd);
+        s->fd = -1;
+        errno = EINVAL;
+        return 0;
+    }
+    s->slots = (st.st_size > SNAP_DATA(s->numSectors)) ? (st.st_size - SNAP_DATA(s->numSectors)) / BUF_SIZE : 0;
+    s->slot = (int *)calloc( s->numSectors, sizeof(int) );
+
+    return 1;
+}
+
+void snap_load() {
+    // A snapshot that can not be opened can not be kept whole; commands go on without it
+    snaps.count = 0;
+
+    for (int i=0; i<super.snapCount && i<SNAP_MAX; i++) {
+        struct Snapshot* s = &snaps.s[ snaps.count++ ];
+
+        if ( !snap_open(s, super.snapName[i], CONTAINER_READWRITE) ) {
+            dprintf(2, "Snapshot %s can not be kept; %s\n", super.snapName[i], strerror(errno));
+            s->fd = -1;
+            s->broken = 1;
+        }
+    }
+}
+
+void snap_release() {
+    for (int i=0; i<snaps.count; i++) {
+        if (snaps.s[i].fd >= 0) {
+            close(snaps.s[i].fd);
+        }
+        free(snaps.s[i].slot);
+    }
+    snaps.count = -1;
+}
+
+int snap_lookup(struct Snapshot* s, int sector, int n, int again) {
+    /* One read of the map for the sectors not looked up yet. The copying
+     *  side is the only writer, so a sector once found in the container stays
+     *  there for it; a reader (again) looks those up every time.
+     */
+    int* map = NULL;
+    int missing = 0;
+
+    for (int i=0; i<n; i++) {
+        missing += (s->slot[ sector + i ] == 0 || (again && s->slot[ sector + i ] < 0));
+    }
+    if (missing == 0) {
+        return 1;
+    }
+    map = (int *)calloc( n, sizeof(int) );
+
+    if (pread(s->fd, map, (long)n * 4, SNAP_HEADER + (off_t)sector * 4) < 0) {
+        free(map);
+        return 0;
+    }
+    for (int i=0; i<n; i++) {   // read short past what was ever written: not copied
+        s->slot[ sector + i ] = (map[i] > 0) ? map[i] : -1;
+    }
+    free(map);
+
+    return 1;
+}
+
+int snap_wanted(int sector, int n) {
+    if (snaps.count < 0) {
+        snap_load();
+    }
+    for (int i=0; i<snaps.count; i++) {
+        struct Snapshot* s = &snaps.s[i];
+        int m = (sector + n <= s->numSectors) ? n : s->numSectors - sector;
+
+        if (s->fd < 0 || s->broken || m <= 0) {
+            continue;
+        }
+        if ( !snap_lookup(s, sector, m, 0) ) {
+            return 1;   // snap_keep() finds it out again and says so
+        }
+        for (int k=0; k<m; k++) {
+            if (s->slot[ sector + k ] < 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void snap_keep(int sector, int n, char* old) {
+    /* Each snapshot gets the sectors it has not kept yet in its next slots,
+     *  then the map of the whole run is written with them. Never dies; a
+     *  snapshot that could not keep a sector is marked broken instead.
+     */
+    if (snaps.count < 0) {
+        snap_load();
+    }
+    for (int i=0; i<snaps.count; i++) {
+        struct Snapshot* s = &snaps.s[i];
+        int m = (sector + n <= s->numSectors) ? n : s->numSectors - sector;
+        int copies = 0;
+
+        if (s->fd < 0 || s->broken || m <= 0) {
+            continue;
+        }
+        if ( !snap_lookup(s, sector, m, 0) ) {
+            snap_break(s, sector);
+            continue;
+        }
+        for (int k=0; k<m; k++) {
+            copies += (s->slot[ sector + k ] < 0);
+        }
+        if (copies == 0) {
+            continue;
+        }
+        char* data = (char *)malloc( (long)copies * BUF_SIZE );
+        int* map = (int *)malloc( m * sizeof(int) );
+        int c = 0;
+
+        for (int k=0; k<m; k++) {
+            map[k] = s->slot[ sector + k ];
+
+            if (map[k] < 0) {
+                memcpy(data + (long)c * BUF_SIZE, old + (long)k * BUF_SIZE, BUF_SIZE);
+                map[k] = s->slots + ++c;
+            }
+        }
+        if (pwrite(s->fd, data, (long)copies * BUF_SIZE, SNAP_DATA(s->numSectors) + s->slots * BUF_SIZE) != (long)copies * BUF_SIZE
+            || pwrite(s->fd, map, (long)m * 4, SNAP_HEADER + (off_t)sector * 4) != (long)m * 4) {
+            snap_break(s, sector);
+        }
+        else {
+            memcpy(s->slot + sector, map, m * sizeof(int));
+            s->slots += copies;
+            s->unsynced = 1;
+            snaps.copied += copies;
+        }
+        free(data);
+        free(map);
+    }
+}
+
+void snap_break(struct Snapshot* s, int sector) {
+    // sector < 0: copies already written did not reach the disk
+    int broken = 1;
+
+    if (sector < 0) {
+        dprintf(2, "Snapshot %s could not keep its copies; %s. It is no longer whole\n", s->name, strerror(errno));
+    }
+    else {
+        dprintf(2, "Snapshot %s could not keep sector %d; %s. It is no longer whole\n", s->name, sector, strerror(errno));
+    }
+    s->broken = 1;
+    pwrite(s->fd, &broken, 4, 8);
+}
+
+void snap_cow(int fd, off_t offset, long len) {
+    /* Sectors about to be written (or punched) are read as they are and kept
+     *  by the snapshots lacking them. -M writes to memory only; mem_save()
+     *  does this for the sectors it changes in the file.
+     */
+    int sector = offset / BUF_SIZE;
+    int n = len / BUF_SIZE;
+    char* old = NULL;
+    long got = 0;
+    int failed = 0;
+
+    if (super.snapCount == 0 || memImage.active || n <= 0 || !snap_wanted(sector, n)) {
+        return;
+    }
+    old = (char *)malloc( (long)n * BUF_SIZE );
+
+    if (scache.slots > 0) {     // O_DIRECT reads go through the cache's aligned pages
+        for (got = 0; got < (long)n * BUF_SIZE; got += BUF_SIZE) {
+            char* p = dio_sector(fd, sector + got / BUF_SIZE);
+
+            if (p == NULL) {
+                failed = 1;
+                break;
+            }
+            memcpy(old + got, p, BUF_SIZE);
+        }
+    }
+    else {
+        got = devRead(fd, old, (long)n * BUF_SIZE, offset);
+        failed = (got < 0);
+    }
+    if (failed) {
+        for (int i=0; i<snaps.count; i++) {     // what was there can not be had
+            if (snaps.s[i].fd >= 0 && !snaps.s[i].broken && sector < snaps.s[i].numSectors) {
+                snap_break(&snaps.s[i], sector);
+            }
+        }
+    }
+    else if (got >= BUF_SIZE) {     // past the end of the container is new, nothing to keep
+        snap_keep(sector, got / BUF_SIZE, old);
+    }
+    free(old);
+}
+
+void snap_sync() {
+    // Copies must be on disk before the sectors they keep are overwritten
+    for (int i=0; i<snaps.count; i++) {
+        struct Snapshot* s = &snaps.s[i];
+
+        if (s->unsynced && fdatasync(s->fd) != 0) {
+            snap_break(s, -1);
+        }
+        s->unsynced = 0;
+    }
+}
+
+int snap_overlay(char* buf, long len, off_t offset) {
+    /* Container sectors are read first and the map after, so a sector copied
+     *  and overwritten in between is found in the map. Returns 0 on error.
+     */
+    struct Snapshot* v = &snaps.view;
+    int sector = offset / BUF_SIZE;
+    int n = len / BUF_SIZE;
+
+    if (sector + n > v->numSectors) {   // container grew since, the rest is not in the snapshot
+        n = v->numSectors - sector;
+    }
+    if (n <= 0) {
+        return 1;
+    }
+    if ( !snap_lookup(v, sector, n, 1) ) {
+        return 0;
+    }
+    for (int k=0; k<n; k++) {
+        int run = 1;    // copies in consecutive slots are read at once
+
+        if (v->slot[ sector + k ] <= 0) {
+            continue;
+        }
+        while (k + run < n && v->slot[ sector + k + run ] == v->slot[ sector + k ] + run) {
+            run++;
+        }
+        if (pread(v->fd, buf + (long)k * BUF_SIZE, (long)run * BUF_SIZE,
+                  SNAP_DATA(v->numSectors) + (off_t)(v->slot[ sector + k ] - 1) * BUF_SIZE) != (long)run * BUF_SIZE) {
+            return 0;
+        }
+        k += run - 1;
+    }
+    return 1;
+}
+
+void mem_load() {
+    /* Sector I/O goes to memory from here on. containerFd is a handle to an
+     *  empty memfd, so code passing it around and closing it is unchanged.
+     */
+    struct stat st;
+    int fd = open(opt.filename, CONTAINER_READ);
+
+    if (fd < 0 && errno != ENOENT) {
+        dprintf(2, "Could not open container file %s; %s\n", opt.filename, strerror(errno));
+        exit(1);
+    }
+    if (fd >= 0) {
+        fstat(fd, &st);
+        memImage.cap = (st.st_size > 0) ? st.st_size : CONTAINER_SIZE;
+        memImage.data = (char *)malloc( memImage.cap );
+
+        while (memImage.len < st.st_size) {
+            long got = read(fd, memImage.data + memImage.len, st.st_size - memImage.len);
+
+            if (got <= 0) {
+                dprintf(2, "Error occured reading %s into memory; %s\n", opt.filename, (got < 0) ? strerror(errno) : "short read");
+                exit(3);
+            }
+            memImage.len += got;
+        }
+        close(fd);
+    }
+    if ((containerFd = memfd_create("jvol", 0)) < 0) {
+        dprintf(2, "Could not set up in-memory container; %s\n", strerror(errno));
+        exit(1);
+    }
+    memImage.active = 1;
+}
+
+int mem_save(char* file) {
+    // Written next to file and renamed over it, so file is the old or the new container
+    char tmp[4096];
+    int fd = 0;
+    long done = 0;
+
+    if (!memImage.active) {
+        printf("Only an in-memory container (-M) can be saved\n");
+        return 0;
+    }
+    wb_flush(containerFd);      // what this command wrote so far
+    dd_flush(containerFd);
+    crc_flush(containerFd);
+
+    if (super.snapCount > 0 && strcmp(file, opt.filename) == 0) {  // sectors the save changes go to snapshots first
+        char old[IMAGE_CHUNK * BUF_SIZE];
+        long got = 0;
+
+        if ((fd = open(file, CONTAINER_READ)) >= 0) {
+            for (off_t at = 0; at < memImage.len && (got = pread(fd, old, sizeof(old), at)) > 0; at += got) {
+                for (long k=0; (k + 1) * BUF_SIZE <= got && at + (k + 1) * BUF_SIZE <= memImage.len; k++) {
+                    if (memcmp(old + k * BUF_SIZE, memImage.data + at + k * BUF_SIZE, BUF_SIZE) != 0) {
+                        snap_keep((at / BUF_SIZE) + k, 1, old + k * BUF_SIZE);
+                    }
+                }
+            }
+            snap_sync();
+            close(fd);
+        }
+    }
+    snprintf(tmp, sizeof(tmp), "%s.snap", file);
+
+    if ((fd = open(tmp, CONTAINER_CREAT, CONTAINER_PERMS)) < 0) {
+        dprintf(2, "Could not create %s; %s\n", tmp, strerror(errno));
+        return 0;
+    }
+    while (done < memImage.len) {
+        long len = (memImage.len - done < 1 << 20) ? memImage.len - done : 1 << 20;
+        long wrote = write(fd, memImage.data + done, len);
+
+        if (wrote <= 0) {
+            dprintf(2, "Error occured writing %s; %s\n", tmp, strerror(errno));
+            close(fd);
+            unlink(tmp);
+            return 0;
+        }
+        done += wrote;
+    }
+    if (fsync(fd) != 0 || close(fd) != 0 || rename(tmp, file) != 0) {
+        dprintf(2, "Could not save %s; %s\n", file, strerror(errno));
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+void stripe_parse(char* list) {
+    // A single file is not striped, stripes.count stays 0
+    char* copy = strdup(list);
+    char* token = strtok(copy, ",");
+
+    while (token != NULL) {
+        if (stripes.count == STRIPE_MAX) {
+            printf("A container may be striped over at most %d files\n", STRIPE_MAX);
+            exit(255);
+        }
+        stripes.fd[ stripes.count ] = -1;
+        stripes.name[ stripes.count++ ] = token;
+        token = strtok(NULL, ",");
+    }
+    if (stripes.count < 2) {
+        stripes.count = 0;
+        free(copy);
+    }
+    stripes.unit = STRIPE_UNIT;
+}
+
+int stripe_open(int m, int direct) {
+    /* All backing files are opened together and stay open as the shared
+     *  handle; init opens them read/write too, as batch commands after it
+     *  use the same handles.
+     */
+    int create = (m == CONTAINER_CREAT || m == CONTAINER_INIT);
+
+    if (containerFd >= 0 && !create) {
+        return containerFd;
+    }
+    for (int i=0; i<stripes.count; i++) {
+        int fd = 0;
+
+        if (stripes.fd[i] >= 0) {
+            close(stripes.fd[i]);
+        }
+        if (create) {
+            fd = open(stripes.name[i], (m & ~O_WRONLY) | O_RDWR | direct, CONTAINER_PERMS);
+        }
+        else {
+            fd = open(stripes.name[i], CONTAINER_READWRITE | direct);
+
+            if (fd < 0 && m == CONTAINER_READ && (errno == EACCES || errno == EROFS)) {
+                fd = open(stripes.name[i], m | direct);
+            }
+        }
+        if (fd < 0 && direct && errno == EINVAL) {
+            fd = open(stripes.name[i], create ? (m & ~O_WRONLY) | O_RDWR : CONTAINER_READWRITE, CONTAINER_PERMS);
+        }
+        if (fd < 0) {
+            dprintf(2, "Could not open container file %s with mode %d; %s\n", stripes.name[i], m, strerror(errno));
+            die(NULL, 1);
+        }
+        stripes.fd[i] = fd;
+    }
+    containerFd = stripes.fd[0];
+
+    return containerFd;
+}
+
+long stripe_map(off_t offset, long len, int* fd, off_t* at) {
+    long unitBytes = (long)stripes.unit * BUF_SIZE;
+    long unit = offset / unitBytes;
+    long in = offset % unitBytes;
+
+    *fd = stripes.fd[ unit % stripes.count ];
+    *at = (unit / stripes.count) * unitBytes + in;
+
+    return (len < unitBytes - in) ? len : unitBytes - in;
+}
+
+long stripe_io(char* buf, long len, off_t offset, int write) {
+    // A stripe unit per piece, run by stripe_run(); returns bytes done in a row, -1 if none could be
+    struct UringOp op = { .buf=buf, .len=len, .offset=offset, .write=write };
+    int* owner = NULL;
+    int m = 0;
+    struct UringOp* run = stripe_split(&op, 1, &owner, &m);
+    long done = 0;
+
+    stripe_run(run, m);
+
+    for (int k=0; k<m; k++) {
+        if (run[k].res < 0) {
+            errno = -run[k].res;
+            done = (done > 0) ? done : -1;
+            break;
+        }
+        done += run[k].res;
+
+        if (run[k].res < run[k].len) {  // end of a backing file is end of the container
+            break;
+        }
+    }
+    free(run);
+    free(owner);
+
+    return done;
+}
+
+struct UringOp* stripe_split(struct UringOp* ops, int n, int** owner, int* m) {
+    // Pieces of ops, each within one stripe unit and so one backing file
+    int max = n * 2;
+    struct UringOp* run = (struct UringOp *)malloc( max * sizeof(struct UringOp) );
+
+    *owner = (int *)malloc( max * sizeof(int) );
+    *m = 0;
+
+    for (int i=0; i<n; i++) {
+        for (long done = 0; done < ops[i].len; ) {
+            struct UringOp* piece = NULL;
+
+            if (*m == max) {
+                max *= 2;
+                run = (struct UringOp *)realloc( run, max * sizeof(struct UringOp) );
+                *owner = (int *)realloc( *owner, max * sizeof(int) );
+            }
+            piece = &run[ *m ];
+            (*owner)[ (*m)++ ] = i;
+            *piece = ops[i];
+            piece->buf = ops[i].buf + done;
+            piece->len = stripe_map(ops[i].offset + done, ops[i].len - done, &piece->fd, &piece->offset);
+            done += piece->len;
+        }
+    }
+    return run;
+}
+
+void stripe_run(struct UringOp* run, int m) {
+    // Pieces on one file only are done here, without a thread
+    struct StripeWork work[STRIPE_MAX];
+    pthread_t tid[STRIPE_MAX];
+    int started[STRIPE_MAX] = {0};
+    int files = 0;
+
+    for (int i=0; i<stripes.count; i++) {
+        for (int k=0; k<m; k++) {
+            if (run[k].fd == stripes.fd[i]) {
+                work[ files++ ] = (struct StripeWork){ .run=run, .m=m, .fd=stripes.fd[i] };
+                break;
+            }
+        }
+    }
+    for (int i=0; files > 1 && i<files; i++) {
+        started[i] = (pthread_create(&tid[i], NULL, stripe_worker, &work[i]) == 0);
+    }
+    for (int i=0; i<files; i++) {   // a thread that could not start is done here
+        if (!started[i]) {
+            stripe_worker(&work[i]);
+        }
+    }
+    for (int i=0; i<files; i++) {
+        if (started[i]) {
+            pthread_join(tid[i], NULL);
+        }
+    }
+}
+
+void* stripe_worker(void* arg) {
+    struct StripeWork* w = arg;
+
+    for (int k=0; k<w->m; k++) {
+        struct UringOp* p = &w->run[k];
+
+        if (p->fd != w->fd) {
+            continue;
+        }
+        p->res = p->write ? pwrite(p->fd, p->buf, p->len, p->offset) : pread(p->fd, p->buf, p->len, p->offset);
+        p->res = (p->res < 0) ? -errno : p->res;
+    }
+    return NULL;
+}
+
+void mem_atexit(void) {
+    if (memImage.saveTo != NULL && memImage.done) {
+        mem_save(memImage.saveTo);
+    }
+}
+
+char* dio_sector(int fd, int sector) {
+    /* With -D the container is only read and written in whole SC_PAGE pages
+     *  (O_DIRECT needs it), which stay in the cache. Pages read for user file
+     *  data go on the list evicted first.
+     */
+    int page = sector / (SC_PAGE / BUF_SIZE);
+    int cls = currState.stream ? SC_DATA : SC_META;
+    char* p = sc_find(&scache, page, cls);
+
+    if (p == NULL) {
+        p = sc_claim(&scache, page, cls);
+
+        long got = devRead(fd, p, SC_PAGE, (off_t)page * SC_PAGE);
+
+        if (got < 0) {
+            sc_forget(&scache, page);
+            return NULL;
+        }
+        memset(p + got, 0, SC_PAGE - got);     // past end of container, init is writing it
+    }
+    return p + (long)(sector % (SC_PAGE / BUF_SIZE)) * BUF_SIZE;
+}
+
+int dio_write(int fd, int sector, char* buf) {
+    // Write-through; the page was read first, so its other sectors go back as they were
+    char* p = dio_sector(fd, sector);
+    int page = sector / (SC_PAGE / BUF_SIZE);
+
+    if (p == NULL) {
+        return 0;
+    }
+    memcpy(p, buf, BUF_SIZE);
+
+    if (devWrite(fd, p - (long)(sector % (SC_PAGE / BUF_SIZE)) * BUF_SIZE, SC_PAGE, (off_t)page * SC_PAGE) != SC_PAGE) {
+        sc_forget(&scache, page);
+        return 0;
+    }
+    return 1;
+}
+
+int dio_run(int fd, struct UringOp* ops, int n) {
+    // Page aligned operations (containerImage()) go straight to the container,
+    //  the rest a sector at a time through the cache
+    int failed = 0;
+
+    for (int i=0; i<n; i++) {
+        struct UringOp* op = &ops[i];
+
+        if ((long)op->buf % SC_PAGE == 0 && op->len % SC_PAGE == 0 && op->offset % SC_PAGE == 0) {
+            op->res = op->write ? devWrite(fd, op->buf, op->len, op->offset) : devRead(fd, op->buf, op->len, op->offset);
+            op->res = (op->res < 0) ? -errno : op->res;
+
+            for (long pg = op->offset / SC_PAGE; op->write && pg < (op->offset + op->len) / SC_PAGE; pg++) {
+                sc_forget(&scache, pg);
+            }
+        }
+        else {
+            op->res = op->len;
+
+            for (long k=0; k * BUF_SIZE < op->len; k++) {
+                int sector = op->offset / BUF_SIZE + k;
+                char* p = NULL;
+
+                if (op->write) {
+                    p = dio_write(fd, sector, op->buf + k * BUF_SIZE) ? op->buf : NULL;
+                }
+                else if ((p = dio_sector(fd, sector)) != NULL) {
+                    memcpy(op->buf + k * BUF_SIZE, p, BUF_SIZE);
+                }
+                if (p == NULL) {
+                    op->res = -errno;
                     break;
+                }
+            }
+        }
+        failed += (op->res != op->len);
+    }
+    return failed;
+}
+
+void sectorRead(char* buf, int fd, int sector) {
+    /*
+     * zero's buffer in case of partial read.
+     * takes given sector number (zero-based) and calculates byte offset
+     * reads sector into given buffer
+     * updates global currState.curr_sector
+     */
+    memset(buf, 0, BUF_SIZE);
+
+    //DEBUG
+    //printf("sectorRead sector num: %d\n", sector);
+
+    char* held = wb_find(&wback, sector);
+
+    if (held != NULL) {     // written this command, not in the container yet
+        memcpy(buf, held, BUF_SIZE);
+        currState.curr_sector = sector;
+        return;
+    }
+
+    if (scache.slots > 0) {
+        char* cached = dio_sector(fd, sector);
+
+        if (cached == NULL) {
+            dprintf(2, "Error occured reading sector at offset %d; %s\n", sector*BUF_SIZE, strerror(errno));
+            die(&fd, 3);
+        }
+        memcpy(buf, cached, BUF_SIZE);
+    }
+    else {
+        int bytes_read = devRead(fd, buf, BUF_SIZE, (sector*BUF_SIZE));
+        if (bytes_read != BUF_SIZE) { /* read error happened... */
+            dprintf(2, "Error occured reading sector at offset %d; %s\n", sector*BUF_SIZE, strerror(errno));
+            die(&fd, 3);
+        }
+    }
+    if (crcTable.crc != NULL && !crc_verify(sector, buf)) {
+        dprintf(2, "Checksum mismatch in sector %d of %s\n", sector, opt.filename);
+        die(&fd, 4);
+    }
+    currState.curr_sector = sector;
+}
+
+void chainRead(char* buf, int fd, int sector) {
+    /* Chains laid out in order get read a window of sectors at a time, and
+     *  the kernel is asked for the window after that before it is needed.
+     *  Anything else reads one sector, as sectorRead() does.
+     */
+    char* win = NULL;
+
+    if (scache.slots > 0 || wb_find(&wback, sector) != NULL) {    // cache pages are the readahead
+        sectorRead(buf, fd, sector);
+        return;
+    }
+    win = ra_lookup(&readAhead, sector);
+
+    if (win == NULL) {
+        int numSectors = (super.magic != 0) ? super.numSectors : CONTAINER_SIZE/BUF_SIZE;
+        int n = 0;
+        struct RaStream* st = ra_plan(&readAhead, sector, &n);
+
+        if (sector < 0 || sector >= numSectors) {
+            dprintf(2, "Error occured reading sector %d; outside container\n", sector);
+            die(&fd, 3);
+        }
+        if (n > numSectors - sector) {
+            n = numSectors - sector;
+        }
+        win = ra_fill(&readAhead, st, sector, n);
+
+        long got = devRead(fd, win, (long)n * BUF_SIZE, (off_t)sector * BUF_SIZE);
+
+        if (got < BUF_SIZE) {
+            dprintf(2, "Error occured reading sector at offset %d; %s\n", sector*BUF_SIZE,
+                    (got < 0) ? strerror(errno) : "short read");
+            st->len = 0;
+            die(&fd, 3);
+        }
+        if (got < (long)n * BUF_SIZE) {     // container ends sooner than super says
+            readAhead.ahead -= n - got / BUF_SIZE;
+            st->len = got / BUF_SIZE;
+        }
+        if (st->len > 1) {
+            posix_fadvise(fd, (off_t)(sector + st->len) * BUF_SIZE, (off_t)st->len * BUF_SIZE, POSIX_FADV_WILLNEED);
+        }
+    }
+    memcpy(buf, win, BUF_SIZE);
+
+    if (crcTable.crc != NULL && !crc_verify(sector, buf)) {
+        dprintf(2, "Checksum mismatch in sector %d of %s\n", sector, opt.filename);
+        die(&fd, 4);
+    }
+    currState.curr_sector = sector;
+}
+
+void sectorWrite(char* buf, int fd, int offset) {
+    /* Held until the command ends (or the write-back is full), so root and
+     *  dir sectors updated once per sector allocated are written once.
+     *  Write errors show up in wb_flush().
+     */
+    if ( !wb_put(&wback, offset, buf) ) {
+        if (wb_flush(fd) > 0) {
+            die(&fd, 3);
+        }
+        wb_put(&wback, offset, buf);
+    }
+    if (crcTable.crc != NULL) {
+        crc_update(offset, buf);
+    }
+    ra_store(&readAhead, offset, buf);
+}
+
+int wb_flush(int fd) {
+    // Consecutive held sectors go out as one write
+    struct UringOp* ops = NULL;
+    char* staging = NULL;
+    int* order = NULL;
+    int count = wback.count;
+    int n = 0;
+    int failed = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    order = wb_order(&wback);
+    ops = (struct UringOp *)calloc( count, sizeof(struct UringOp) );
+    staging = (char *)malloc( (long)count * BUF_SIZE );
+
+    for (int i=0; i<count; i++) {
+        int sector = order[ i * 2 ];
+
+        memcpy(staging + (long)i * BUF_SIZE, wback.data + (long)order[ i * 2 + 1 ] * BUF_SIZE, BUF_SIZE);
+
+        if (n > 0 && ops[n-1].offset + ops[n-1].len == (off_t)sector * BUF_SIZE) {
+            ops[n-1].len += BUF_SIZE;
+            continue;
+        }
+        ops[n].buf = staging + (long)i * BUF_SIZE;
+        ops[n].len = BUF_SIZE;
+        ops[n].offset = (off_t)sector * BUF_SIZE;
+        ops[n].write = 1;
+        n++;
+    }
+    wb_clear(&wback);       // before ioRun(), which keeps held copies current
+    wback.flushed += count;
+
+    if (ioRun(fd, ops, n) > 0) {
+        for (int k=0; k<n; k++) {
+            if (ops[k].res != ops[k].len) {
+                dprintf(2, "Error occured writing sectors %ld-%ld; %s\n", (long)(ops[k].offset / BUF_SIZE),
+                        (long)((ops[k].offset + ops[k].len) / BUF_SIZE - 1),
+                        strerror( (ops[k].res < 0) ? -ops[k].res : EIO ));
+                failed++;
+            }
+        }
+    }
+    free(order);
+    free(ops);
+    free(staging);
+
+    return failed;
+}
+
+void wb_atexit(void) {
+    wb_flush(containerFd);
+}
+
+void crc_load() {
+    // Table of container named by super; containers without FEAT_CRC get none
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+
+    crc_flush(containerFd);
+    free(crcTable.crc);
+    free(crcTable.dirty);
+    memset(&crcTable, 0, sizeof(crcTable));
+
+    if ((super.features & FEAT_CRC) == 0 || super.crcTableLen <= 0) {
+        return;
+    }
+    unsigned int* crc = (unsigned int *)calloc( (size_t)super.crcTableLen * CRC_PER_SECTOR, sizeof(unsigned int) );
+
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+
+    for (int i=0; i<super.crcTableLen; i++) {     // crcTable.crc still NULL, so not verified
+        sectorRead(buf, fd, super.crcTable + i);
+        memcpy(crc + i * CRC_PER_SECTOR, buf, BUF_SIZE);
+    }
+    containerClose(fd);
+
+    crcTable.crc = crc;
+    crcTable.dirty = (char *)calloc( super.crcTableLen, 1 );
+    crcTable.first = super.crcTable;
+    crcTable.len = super.crcTableLen;
+    crcTable.numSectors = super.numSectors;
+}
+
+void crc_setup(int first, int len, int numSectors) {
+    // Used by init; the whole table is written by the first crc_flush()
+    crc_flush(containerFd);
+    free(crcTable.crc);
+    free(crcTable.dirty);
+    memset(&crcTable, 0, sizeof(crcTable));
+
+    if (len <= 0) {
+        return;
+    }
+    crcTable.crc = (unsigned int *)calloc( (size_t)len * CRC_PER_SECTOR, sizeof(unsigned int) );
+    crcTable.dirty = (char *)malloc( len );
+    memset(crcTable.dirty, 1, len);
+    crcTable.first = first;
+    crcTable.len = len;
+    crcTable.numSectors = numSectors;
+}
+
+void crc_resize(int first, int len, int numSectors) {
+    // Container grew; a table that moved is written whole by the next crc_flush()
+    if (crcTable.crc == NULL) {
+        return;
+    }
+    if (len != crcTable.len) {
+        crcTable.crc = (unsigned int *)realloc( crcTable.crc, (size_t)len * CRC_PER_SECTOR * sizeof(unsigned int) );
+        memset(crcTable.crc + (long)crcTable.len * CRC_PER_SECTOR, 0,
+               (size_t)(len - crcTable.len) * CRC_PER_SECTOR * sizeof(unsigned int));
+        crcTable.dirty = (char *)realloc( crcTable.dirty, len );
+        memset(crcTable.dirty, 1, len);
+        crcTable.first = first;
+        crcTable.len = len;
+    }
+    crcTable.numSectors = numSectors;
+}
+
+void crc_update(int sector, char* buf) {
+    if (sector < 0 || sector >= crcTable.numSectors || gen_own(sector)
+        || (sector >= crcTable.first && sector < crcTable.first + crcTable.len)) {
+        return;
+    }
+    crcTable.crc[sector] = crc32c(buf, BUF_SIZE);
+    crcTable.dirty[ sector / CRC_PER_SECTOR ] = 1;
+}
+
+int crc_verify(int sector, char* buf) {
+    if (sector < 0 || sector >= crcTable.numSectors || gen_own(sector)
+        || (sector >= crcTable.first && sector < crcTable.first + crcTable.len)) {
+        return 1;
+    }
+    return crcTable.crc[sector] == crc32c(buf, BUF_SIZE);
+}
+
+void crc_flush(int fd) {
+    /* Writes table sectors holding checksums changed since the last flush.
+     *  Called from die(), so it writes with pwrite() itself and only reports
+     *  errors rather than going through sectorWrite().
+     */
+    struct UringOp* ops = NULL;
+    int* idx = NULL;    // table sector of each op
+    int n = 0;
+
+    if (crcTable.crc == NULL || fd < 0) {
+        return;
+    }
+    ops = (struct UringOp *)calloc( crcTable.len, sizeof(struct UringOp) );
+    idx = (int *)malloc( crcTable.len * sizeof(int) );
+
+    for (int i=0; i<crcTable.len; i++) {   // table sectors are written straight from memory
+        if (crcTable.dirty[i]) {
+            ops[n].buf = (char *)( crcTable.crc + i * CRC_PER_SECTOR );
+            ops[n].len = BUF_SIZE;
+            ops[n].offset = (off_t)(crcTable.first + i) * BUF_SIZE;
+            ops[n].write = 1;
+            idx[ n++ ] = i;
+        }
+    }
+    ioRun(fd, ops, n);
+
+    for (int k=0; k<n; k++) {
+        if (ops[k].res != BUF_SIZE) {
+            dprintf(2, "Error occured writing checksum sector %d; %s\n", crcTable.first + idx[k],
+                    strerror( (ops[k].res < 0) ? -ops[k].res : EIO ));
+            continue;
+        }
+        crcTable.dirty[ idx[k] ] = 0;
+    }
+    free(ops);
+    free(idx);
+}
+
+void crc_atexit(void) {
+    crc_flush(containerFd);
+}
+
+void gen_load() {
+    // Table of container named by super; containers without FEAT_CHANGES get none
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+
+    gen_setup(0, 0, 0);
+
+    if ((super.features & FEAT_CHANGES) == 0 || super.genTableLen <= 0) {
+        return;
+    }
+    unsigned int* gen = (unsigned int *)calloc( (size_t)super.genTableLen * GEN_PER_SECTOR, sizeof(unsigned int) );
+
+    genTable.first = super.genTable;    // before reading it, its sectors have no checksum
+    genTable.len = super.genTableLen;
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+
+    for (int i=0; i<genTable.len; i++) {
+        sectorRead(buf, fd, genTable.first + i);
+        memcpy(gen + i * GEN_PER_SECTOR, buf, BUF_SIZE);
+    }
+    containerClose(fd);
+
+    genTable.gen = gen;
+    genTable.dirty = (char *)calloc( genTable.len, 1 );
+    genTable.numSectors = super.numSectors;
+}
+
+void gen_setup(int first, int len, int numSectors) {
+    // Used by init; the whole table is written by the first gen_flush()
+    gen_flush(containerFd);
+    free(genTable.gen);
+    free(genTable.dirty);
+    memset(&genTable, 0, sizeof(genTable));
+
+    if (len <= 0) {
+        return;
+    }
+    genTable.gen = (unsigned int *)calloc( (size_t)len * GEN_PER_SECTOR, sizeof(unsigned int) );
+    genTable.dirty = (char *)malloc( len );
+    memset(genTable.dirty, 1, len);
+    genTable.first = first;
+    genTable.len = len;
+    genTable.numSectors = numSectors;
+}
+
+void gen_resize(int first, int len, int numSectors) {
+    // Container grew; a table that moved is written whole by the next gen_flush()
+    if (genTable.gen == NULL) {
+        return;
+    }
+    if (len != genTable.len) {
+        genTable.gen = (unsigned int *)realloc( genTable.gen, (size_t)len * GEN_PER_SECTOR * sizeof(unsigned int) );
+        memset(genTable.gen + (long)genTable.len * GEN_PER_SECTOR, 0,
+               (size_t)(len - genTable.len) * GEN_PER_SECTOR * sizeof(unsigned int));
+        genTable.dirty = (char *)realloc( genTable.dirty, len );
+        memset(genTable.dirty, 1, len);
+        genTable.first = first;
+        genTable.len = len;
+    }
+    genTable.numSectors = numSectors;
+}
+
+int gen_own(int sector) {
+    return genTable.len > 0 && sector >= genTable.first && sector < genTable.first + genTable.len;
+}
+
+void gen_mark(int sector, int n) {
+    for (int s = (sector > 0) ? sector : 0; s < sector + n && s < genTable.numSectors; s++) {
+        if (!gen_own(s) && genTable.gen[s] != (unsigned int)super.generation) {
+            genTable.gen[s] = super.generation;
+            genTable.dirty[ s / GEN_PER_SECTOR ] = 1;
+        }
+    }
+}
+
+void gen_flush(int fd) {
+    /* Writes table sectors holding generations changed since the last flush,
+     *  straight from memory like crc_flush(). Goes after it and dd_flush(),
+     *  whose writes change generations of their table sectors.
+     */
+    struct UringOp* ops = NULL;
+    int* idx = NULL;    // table sector of each op
+    int n = 0;
+
+    if (genTable.gen == NULL || fd < 0) {
+        return;
+    }
+    ops = (struct UringOp *)calloc( genTable.len, sizeof(struct UringOp) );
+    idx = (int *)malloc( genTable.len * sizeof(int) );
+
+    for (int i=0; i<genTable.len; i++) {
+        if (genTable.dirty[i]) {
+            ops[n].buf = (char *)( genTable.gen + i * GEN_PER_SECTOR );
+            ops[n].len = BUF_SIZE;
+            ops[n].offset = (off_t)(genTable.first + i) * BUF_SIZE;
+            ops[n].write = 1;
+            idx[ n++ ] = i;
+        }
+    }
+    ioRun(fd, ops, n);
+
+    for (int k=0; k<n; k++) {
+        if (ops[k].res != BUF_SIZE) {
+            dprintf(2, "Error occured writing change sector %d; %s\n", genTable.first + idx[k],
+                    strerror( (ops[k].res < 0) ? -ops[k].res : EIO ));
+            continue;
+        }
+        genTable.dirty[ idx[k] ] = 0;
+    }
+    free(ops);
+    free(idx);
+}
+
+void gen_atexit(void) {
+    gen_flush(containerFd);
+}
+
+void dd_load() {
+    // Table of container named by super; containers without FEAT_DEDUP get none
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+
+    if ((super.features & FEAT_DEDUP) == 0 || super.dedupTableLen <= 0) {
+        dd_setup(0, 0, 0);
+        return;
+    }
+    dd_setup(super.dedupTable, super.dedupTableLen, super.numSectors);
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+
+    for (int i=0; i<ddTable.len; i++) {
+        sectorRead(buf, fd, ddTable.first + i);
+
+        for (int j=0; j<DD_PER_SECTOR && i * DD_PER_SECTOR + j < ddTable.numSectors; j++) {
+            int sector = i * DD_PER_SECTOR + j;
+
+            memcpy(&ddTable.refs[sector], buf + j * 8, 4);
+            memcpy(&ddTable.hash[sector], buf + j * 8 + 4, 4);
+
+            if (ddTable.refs[sector] > 0) {
+                dd_index(sector);
+            }
+        }
+    }
+    containerClose(fd);
+    memset(ddTable.dirty, 0, ddTable.len);
+}
+
+void dd_setup(int first, int len, int numSectors) {
+    // Used by init; the whole table is written by the first dd_flush()
+    dd_flush(containerFd);
+    free(ddTable.refs);
+    free(ddTable.hash);
+    free(ddTable.bucket);
+    free(ddTable.next);
+    free(ddTable.dirty);
+    memset(&ddTable, 0, sizeof(ddTable));
+
+    if (len <= 0) {
+        return;
+    }
+    ddTable.mask = 1;
+
+    while (ddTable.mask < numSectors) {     // a bucket per block when every sector is one
+        ddTable.mask <<= 1;
+    }
+    ddTable.refs = (int *)calloc( numSectors, sizeof(int) );
+    ddTable.hash = (unsigned int *)calloc( numSectors, sizeof(unsigned int) );
+    ddTable.bucket = (int *)calloc( ddTable.mask, sizeof(int) );
+    ddTable.next = (int *)calloc( numSectors, sizeof(int) );
+    ddTable.mask--;
+    ddTable.dirty = (char *)malloc( len );
+    memset(ddTable.dirty, 1, len);
+    ddTable.first = first;
+    ddTable.len = len;
+    ddTable.numSectors = numSectors;
+}
+
+void dd_resize(int first, int len, int numSectors) {
+    // Container grew; records are kept, the hash index is rebuilt for the new size
+    int* refs = ddTable.refs;
+    unsigned int* hash = ddTable.hash;
+    int old = ddTable.numSectors;
+
+    if (ddTable.refs == NULL) {
+        return;
+    }
+    ddTable.refs = NULL;    // dd_setup() must not flush or free them
+    ddTable.hash = NULL;
+    ddTable.len = 0;
+    dd_setup(first, len, numSectors);
+    memcpy(ddTable.refs, refs, old * sizeof(int));
+    memcpy(ddTable.hash, hash, old * sizeof(unsigned int));
+    free(refs);
+    free(hash);
+
+    for (int i=0; i<old; i++) {
+        if (ddTable.refs[i] > 0) {
+            dd_index(i);
+        }
+    }
+}
+
+void dd_set(int sector, int refs, unsigned int hash) {
+    ddTable.refs[sector] = refs;
+    ddTable.hash[sector] = hash;
+    ddTable.dirty[ sector / DD_PER_SECTOR ] = 1;
+}
+
+void dd_index(int sector) {
+    int h = ddTable.hash[sector] & ddTable.mask;
+
+    ddTable.next[sector] = ddTable.bucket[h];
+    ddTable.bucket[h] = sector;
+    ddTable.blocks++;
+}
+
+void dd_unindex(int sector) {
+    int* p = &ddTable.bucket[ ddTable.hash[sector] & ddTable.mask ];
+
+    while (*p != 0) {
+        if (*p == sector) {
+            *p = ddTable.next[sector];
+            ddTable.next[sector] = 0;
+            ddTable.blocks--;
+            return;
+        }
+        p = &ddTable.next[*p];
+    }
+}
+
+int dd_ref(char* data, int goal) {
+    // Blocks with the same hash are read to compare, so a hash collision only costs a read
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct File f = { .back=0, .frwd=0 };
+    unsigned int h = crc32c(data, 504);
+    int sector = 0;
+
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+
+    for (int b = ddTable.bucket[ h & ddTable.mask ]; b != 0; b = ddTable.next[b]) {
+        if (ddTable.hash[b] != h) {
+            continue;
+        }
+        sectorRead(buf, fd, b);
+
+        if (memcmp(buf+8, data, 504) == 0) {
+            dd_set(b, ddTable.refs[b] + 1, h);
+            containerClose(fd);
+            return b;
+        }
+    }
+    currState.alloc_goal = goal;
+    sector = allocSector();
+    memcpy(f.data, data, 504);
+    file2buf(buf, f);
+    sectorWrite(buf, fd, sector);
+    dd_set(sector, 1, h);
+    dd_index(sector);
+    containerClose(fd);
+
+    return sector;
+}
+
+void dd_unref(int block) {
+    if (block <= 0 || block >= ddTable.numSectors || ddTable.refs[block] <= 0) {
+        return;     // not a block
+    }
+    dd_set(block, ddTable.refs[block] - 1, ddTable.hash[block]);
+
+    if (ddTable.refs[block] == 0) {
+        dd_unindex(block);
+        currState.curr_sector = block;
+        append2FreeList();
+    }
+}
+
+void dd_stats() {
+    // Each reference to a block past its first is a sector not written
+    long long refs = 0;
+    int maps = 0;
+
+    if (ddTable.refs == NULL) {
+        printf("Container %s has no dedup table, see -O dedup\n", opt.filename);
+        return;
+    }
+    for (int i=0; i<ddTable.numSectors; i++) {
+        if (ddTable.refs[i] > 0) {
+            refs += ddTable.refs[i];
+        }
+        else if (ddTable.refs[i] == DD_MAP) {
+            maps++;
+        }
+    }
+    if (opt.machine) {
+        printf("%d\t%lld\t%d\t%.2f\n", ddTable.blocks, refs, maps, (ddTable.blocks > 0) ? (double)refs / ddTable.blocks : 1.0);
+        return;
+    }
+    printf("Container %s: %d blocks for %lld block references\n", opt.filename, ddTable.blocks, refs);
+    printf("  Dedup ratio: %.2f\n", (ddTable.blocks > 0) ? (double)refs / ddTable.blocks : 1.0);
+    printf("  Saved:       %lld sectors (%lld bytes of data)\n", refs - ddTable.blocks, (refs - ddTable.blocks) * 504);
+    printf("  Block maps:  %d sectors\n", maps);
+}
+
+void ra_stats() {
+    /* Counts are for this run of jvol, so in batch mode they cover the
+     *  commands before stats. Sectors still in a window are not yet wasted.
+     */
+    long pending = 0;
+
+    if (scache.slots > 0) {     // -D reads whole cache pages instead
+        return;
+    }
+    for (int i=0; i<RA_STREAMS; i++) {
+        for (int k=0; k<readAhead.s[i].len; k++) {
+            pending += !readAhead.s[i].used[k];
+        }
+    }
+    if (opt.machine) {
+        printf("%ld\t%ld\t%ld\t%ld\n", readAhead.hits, readAhead.reads, readAhead.ahead, readAhead.wasted);
+        return;
+    }
+    printf("Readahead: %ld chain sectors from %ld reads, %ld from windows\n",
+           readAhead.hits + readAhead.reads, readAhead.reads, readAhead.hits);
+    printf("  Read ahead:  %ld sectors, %ld never used, %ld not used yet\n", readAhead.ahead, readAhead.wasted, pending);
+    printf("  Used:        %.1f%% of sectors read ahead\n", (readAhead.ahead > 0) ? 100.0 * readAhead.hits / readAhead.ahead : 0.0);
+}
+
+void wb_stats() {
+    // Counts are for this run of jvol, like ra_stats()
+    if (opt.machine) {
+        printf("%ld\t%ld\n", wback.writes, wback.flushed);
+        return;
+    }
+    printf("Write-back: %ld sector writes, %ld sectors written out\n", wback.writes, wback.flushed);
+}
+
+void dio_stats() {
+    if (scache.slots == 0) {
+        return;
+    }
+    if (opt.machine) {
+        printf("%d\t%ld\t%ld\t%ld\t%ld\n", scache.slots * (SC_PAGE / 1024), scache.hits, scache.misses,
+               scache.evicted[SC_META], scache.evicted[SC_DATA]);
+        return;
+    }
+    printf("Sector cache: %d KB in %d pages, %ld hits, %ld misses\n", scache.slots * (SC_PAGE / 1024), scache.slots,
+           scache.hits, scache.misses);
+    printf("  Evicted:     %ld metadata and %ld file data pages\n", scache.evicted[SC_META], scache.evicted[SC_DATA]);
+}
+
+void dd_flush(int fd) {
+    /* Writes table sectors holding records changed since the last flush. Like
+     *  crc_flush() it uses pwrite() itself; table sectors get their checksum
+     *  here, so it goes before crc_flush().
+     */
+    struct UringOp* ops = NULL;
+    char* bufs = NULL;
+    int* idx = NULL;    // table sector of each op
+    int n = 0;
+
+    if (ddTable.refs == NULL || fd < 0) {
+        return;
+    }
+    for (int i=0; i<ddTable.len; i++) {
+        n += ddTable.dirty[i];
+    }
+    if (n == 0) {
+        return;
+    }
+    ops = (struct UringOp *)calloc( n, sizeof(struct UringOp) );
+    bufs = (char *)calloc( n, BUF_SIZE );
+    idx = (int *)malloc( n * sizeof(int) );
+    n = 0;
+
+    for (int i=0; i<ddTable.len; i++) {
+        if (!ddTable.dirty[i]) {
+            continue;
+        }
+        char* buf = bufs + (long)n * BUF_SIZE;
+
+        for (int j=0; j<DD_PER_SECTOR && i * DD_PER_SECTOR + j < ddTable.numSectors; j++) {
+            memcpy(buf + j * 8, &ddTable.refs[ i * DD_PER_SECTOR + j ], 4);
+            memcpy(buf + j * 8 + 4, &ddTable.hash[ i * DD_PER_SECTOR + j ], 4);
+        }
+        ops[n].buf = buf;
+        ops[n].len = BUF_SIZE;
+        ops[n].offset = (off_t)(ddTable.first + i) * BUF_SIZE;
+        ops[n].write = 1;
+        idx[ n++ ] = i;
+    }
+    ioRun(fd, ops, n);
+
+    for (int k=0; k<n; k++) {
+        if (ops[k].res != BUF_SIZE) {
+            dprintf(2, "Error occured writing dedup sector %d; %s\n", ddTable.first + idx[k],
+                    strerror( (ops[k].res < 0) ? -ops[k].res : EIO ));
+            continue;
+        }
+        if (crcTable.crc != NULL) {
+            crc_update(ddTable.first + idx[k], ops[k].buf);
+        }
+        ddTable.dirty[ idx[k] ] = 0;
+    }
+    free(ops);
+    free(bufs);
+    free(idx);
+}
+
+void dd_atexit(void) {
+    dd_flush(containerFd);
+}
+
+void usage() {
+    printf("jvol - manipulate an elementry filesystem in a file\n\n");
+    printf("Usage: \n");
+    printf("    jvol [-h] [-c cmd] -f filename [-p file] [-lmR] [-O features] [-a policy] [-t msec] [-r] [-z] [-q depth] [-D KB] [-M [-S file]] [-g generation] [-o dir]\n\n");
+    printf("    -c command: {init, mkdir, touch, gulp, append, cat, ls, rm, cp, mv, du,\n");
+    printf("        find, reindex, batch, defrag, analyze, fsck, scrub, stats, save,\n");
+    printf("        trim, seek, snapshot, rmsnap, export-delta, apply-delta, import, export}.\n\n");
+    printf("    -a where new sectors are taken from; head (first free, the default), near (after parent\n");
+    printf("        dir or previous sector of file), contig (near, and whole file in one run when it fits)\n");
+    printf("        or group (contig, and new dirs spread over %d sector groups). With init it is saved\n", ALLOC_GROUP_SIZE);
+    printf("        as the container's default, with other commands it applies to that command only.\n\n");
+    printf("    -D open the container O_DIRECT, with a cache of this many KB (at least %d) in its place.\n", 4 * SC_PAGE / 1024);
+    printf("        The page cache is left alone and memory use is fixed; file data is evicted before\n");
+    printf("        metadata, so cat and gulp of big files keep dirs cached.\n\n");
+    printf("    -g export-delta: send the sectors changed after this generation (0, the default: all).\n\n");
+    printf("    -h print this help message; no operations are performed.\n\n");
+    printf("    -M read the container into memory once and run every command against it; the -f file\n");
+    printf("        is not written (it need not exist for init). Meant for batch. -D is ignored. Not for a\n");
+    printf("        striped container (exits 255).\n\n");
+    printf("    -S with -M, save the container to this file (may be the -f file) once jvol is done\n");
+    printf("        without error. save: the file to write a snapshot to now, the -f file if not given.\n\n");
+    printf("    -i Input file to read data from.\n\n");
+    printf("    -l ls: long listing with sector and full size of each file.\n");
+    printf("        analyze: list every file, not just the worst.\n\n");
+    printf("    -m ls: machine-readable listing; one tab separated line per entry:\n");
+    printf("        type, sector, size, sectors, depth, path. No header.\n");
+    printf("        analyze: the report as one JSON object.\n");
+    printf("        stats: blocks, references, map sectors and ratio on one tab separated line; then\n");
+    printf("        readahead hits, reads, sectors read ahead and never used; with -D, cache KB, hits,\n");
+    printf("        misses and metadata and file data pages evicted; then sector writes and sectors\n");
+    printf("        written out.\n\n");
+    printf("    -q keep up to this many sector reads and writes in flight through io_uring where a command\n");
+    printf("        knows several sectors it needs (dir walks, analyze, dedup blocks, table write-back).\n");
+    printf("        Without it, or where io_uring is not available, each is a pread or pwrite.\n\n");
+    printf("    -r fsck: return sectors not reached from the tree or free list to the free list.\n\n");
+    printf("    -R ls: list the whole subtree, paths are relative to the listed dir.\n\n");
+    printf("    -f operate on this container file. A comma list of files (up to %d, e.g. on different disks)\n", STRIPE_MAX);
+    printf("        is one container striped over them %d sectors at a time; name them in the same order\n", STRIPE_UNIT);
+    printf("        every time. Reads and writes spanning several of them go to all at once, through\n");
+    printf("        io_uring with -q, else a thread per file. file@name reads snapshot name of the\n");
+    printf("        container instead; nothing can be written through it.\n\n");
+    printf("    -o export: host dir to make the files and dirs in, in place of an archive on stdout.\n\n");
+    printf("    -O init: comma list of features; nameidx (name index for find), agg (on by default),\n");
+    printf("        crc (CRC32C of every sector, checked on each read), inline (user files up to %d bytes\n", INLINE_DEFAULT);
+    printf("        kept in their dir sector, inline=N for up to N bytes, at most %d), dedup (gulped\n", INLINE_MAX);
+    printf("        data kept once in blocks shared by every file holding it; stats reports what it saves),\n");
+    printf("        grow (container doubles when fewer than 1/%d of its sectors are free, grow=N for at most\n", GROW_WATERMARK);
+    printf("        N sectors, %d by default), trim (sectors freed by a command are punched out of the\n", GROW_DEFAULT);
+    printf("        container file when it ends, see trim), sparse (gulp leaves runs of %d zero bytes out\n", SP_CHUNK);
+    printf("        of the file, they read back as zeros; with dedup too, blocks of zeros are left out. Files\n");
+    printf("        gulped with -z keep their zeros, compressed; see seek), changes (generation of every\n");
+    printf("        sector kept, see export-delta).\n");
+    printf("        Prefix a feature with no to turn it off, e.g. -O nameidx,noagg.\n\n");
+    printf("    -p operate on this file (path) with cmd given for -c arg.\n\n");
+    printf("    -s Source file from environment.\n\n");
+    printf("    -t defrag: stop after this many msec; run defrag again to continue.\n\n");
+    printf("    -z gulp: store the file compressed, in groups of %d bytes that are each read back on\n", CZ_GROUP);
+    printf("        their own. Appends to a compressed file stay compressed; gulp without -z stores it as is.\n\n");
+    printf("Behavior: \n");
+    printf("    If -f option is given with no other options, container file will be created and initialized.\n");
+    printf("        However, if the given filename already exists, it will NOT be overwritten and program\n");
+    printf("        will exit with error. Init command will allow overwriting of existing container.\n\n");
+    printf("    batch runs one command per line read from the -i file (or stdin). Lines take the same\n");
+    printf("        options as jvol, without -f (e.g. -c gulp -p a/b -i file). The container stays open\n");
+    printf("        and resolved paths stay cached between commands; the first failing command ends the batch.\n\n");
+    printf("    defrag moves file sectors and dir extentions so each file and each dir's entries are one\n");
+    printf("        run, dirs followed by their files, and rewrites the free list in sector order so\n");
+    printf("        free space is at the tail. First sectors of dirs stay where they are.\n\n");
+    printf("    analyze reads the whole container in large sequential reads and reports fragments per\n");
+    printf("        file, average run length, dir extention chains, free space extents, free list length\n");
+    printf("        against free sectors found by the scan, and the most fragmented files.\n\n");
+    printf("    fsck checks that every sector is reached exactly once from the tree, the free list or the\n");
+    printf("        super sector, that .back of each chain sector names the one before it, and that dir\n");
+    printf("        entries are well formed. Exits 1 when anything is wrong. Reading every sector header,\n");
+    printf("        following the tree a dir at a time and checking each sector are split over one thread\n");
+    printf("        per CPU (up to %d); the free list and name index are followed meanwhile.\n\n", FSCK_MAX_THREADS);
+    printf("    scrub reads the whole container at low priority and checks every sector against its\n");
+    printf("        checksum (containers made with -O crc). Exits 1 when a sector does not match.\n\n");
+    printf("    trim punches holes in the container file for free sectors, whole %d byte pages of them,\n", SC_PAGE);
+    printf("        so they take no space on the host. Punched sectors read back as zeros.\n\n");
+    printf("    seek lists where file -p has data and where holes (zeros with no sector behind them),\n");
+    printf("        as SEEK_DATA and SEEK_HOLE would find them; files not stored sparse are all data.\n\n");
+    printf("    snapshot -p name keeps the container as it is now in the file <container>@name (up to %d\n", SNAP_MAX);
+    printf("        of them), without copying it: a sector is copied there when it first changes. Read\n");
+    printf("        it with -f <container>@name while commands keep writing the container. Without -p\n");
+    printf("        lists the snapshots and the sectors each holds. rmsnap -p name drops one.\n\n");
+    printf("    export-delta writes the sectors changed after generation -g to stdout (containers made\n");
+    printf("        with -O changes), and says which generation the delta brings a replica to; give that\n");
+    printf("        as -g next time. apply-delta reads one from -i (or stdin) into the -f container, which\n");
+    printf("        must be at a generation between the two. A replica starts as any container (e.g. just\n");
+    printf("        made by init) given the delta from -g 0. It keeps its own snapshots and striping.\n");
+    printf("        A delta is checked whole before any of it is written; a damaged one changes nothing.\n\n");
+    printf("    import copies the host dir -i, with every file and dir below it, into dir -p (made if it\n");
+    printf("        is not there; its parent must be). Threads list dirs and read files ahead while the\n");
+    printf("        container is written in one pass. Names longer than 9 characters are skipped.\n\n");
+    printf("    export writes dir -p with everything below it (or file -p) to stdout as a tar archive,\n");
+    printf("        e.g. jvol -c export -f c -p d | tar x, or below host dir -o. Each file is read a run\n");
+    printf("        of sectors at a time while the next one is asked for. Works on snapshots.\n\n");
+    printf("    There are semantics with the cp, and mv commands; the presence of -s or -o options indicate\n");
+    printf("        interaction with underlying filesystem and direction of data flow. The absence of -s or -o\n");
+    printf("        demands two paths be supplied with -p option seperated by a comma (i.e. -p src/path,dest/path).\n\n");
+}
+
+int cmdReadOnly() {
+    // Commands that may be given a snapshot (-f file@name)
+    switch (opt.cmd) {
+        case 5:     // cat
+        case 6:     // ls
+        case 10:    // du
+        case 11:    // find
+        case 15:    // analyze
+        case 17:    // scrub
+        case 18:    // stats
+        case 21:    // seek
+        case 27:    // export
+            return 1;
+        case 16:    // fsck
+            return !opt.repair;
+        case 22:    // snapshot
+            return opt.path == NULL;
+    }
+    return 0;
+}
+
+int parseCmd(char* c) {
+    //DEBUG
+    //printf("Command: %s, length: %lu\n", c, strlen(c));
+    // {init, mkdir, touch, gulp, append, cat, ls, rm, cp, mv, du, find, reindex, batch, defrag, analyze, fsck, scrub, stats}
+    if ( strncmp("init", c, strlen(c)) == 0 ) {
+        opt.init = 1;
+        return 0;
+    }
+    //else if ( strncmp("mkdir", c, strlen(c)) == 0 ) {
+    else if ( strcmp("mkdir", c) == 0 ) {
+        return 1;
+    }
+    else if ( strncmp("touch", c, strlen(c)) == 0 ) {
+        return 2;
+    }
+    else if ( strncmp("gulp", c, strlen(c)) == 0  ) {
+        return 3;
+    }
+    else if ( strncmp("append", c, strlen(c)) == 0  ) {
+        return 4;
+    }
+    else if ( strncmp("cat", c, strlen(c)) == 0 ) {
+        return 5;
+    }
+    else if ( strncmp("ls", c, strlen(c)) == 0 ) {
+        return 6;
+    }
+    else if ( strncmp("rm", c, strlen(c)) == 0 ) {
+        return 7;
+    }
+    else if ( strncmp("cp", c, strlen(c)) == 0 ) {
+        return 8;
+    }
+    else if ( strncmp("mv", c, strlen(c)) == 0 ) {
+        return 9;
+    }
+    else if ( strcmp("du", c) == 0 ) {
+        return 10;
+    }
+    else if ( strcmp("find", c) == 0 ) {
+        return 11;
+    }
+    else if ( strcmp("reindex", c) == 0 ) {
+        return 12;
+    }
+    else if ( strcmp("batch", c) == 0 ) {
+        return 13;
+    }
+    else if ( strcmp("defrag", c) == 0 ) {
+        return 14;
+    }
+    else if ( strcmp("analyze", c) == 0 ) {
+        return 15;
+    }
+    else if ( strcmp("fsck", c) == 0 ) {
+        return 16;
+    }
+    else if ( strcmp("scrub", c) == 0 ) {
+        return 17;
+    }
+    else if ( strcmp("stats", c) == 0 ) {
+        return 18;
+    }
+    else if ( strcmp("save", c) == 0 ) {
+        return 19;
+    }
+    else if ( strcmp("trim", c) == 0 ) {
+        return 20;
+    }
+    else if ( strcmp("seek", c) == 0 ) {
+        return 21;
+    }
+    else if ( strcmp("snapshot", c) == 0 ) {
+        return 22;
+    }
+    else if ( strcmp("rmsnap", c) == 0 ) {
+        return 23;
+    }
+    else if ( strcmp("export-delta", c) == 0 ) {
+        return 24;
+    }
+    else if ( strcmp("apply-delta", c) == 0 ) {
+        return 25;
+    }
+    else if ( strcmp("import", c) == 0 ) {
+        return 26;
+    }
+    else if ( strcmp("export", c) == 0 ) {
+        return 27;
+    }
+    else {
+        return 0;
+    }
+}
+
+void handleArgs(int ac, char** av) {
+    int c;
+    int p_num = 1;  // Path number
+    char* p_token;  // For string splitting
+
+
+    while ( (c = getopt(ac, av, "h?a:c:D:f:g:i:lmMo:O:p:q:rRs:S:t:z") ) != -1) {
+        switch(c) {
+            case 'f':
+                opt.filename = optarg;
+                break;
+            case 'a':
+                opt.alloc = optarg;
+                break;
+            case 'c':
+                opt.cmd = parseCmd(optarg);
+                break;
+            case '?':
+            case 'h':
+                usage();
+                exit(0);
+                break;
+            case 'i':
+                opt.src = optarg;
+                break;
+            case 'l':
+                opt.longList = 1;
+                break;
+            case 'm':
+                opt.machine = 1;
+                break;
+            case 'o':
+                opt.output = optarg;
+                break;
+            case 'O':
+                opt.features = optarg;
+                break;
+            case 'r':
+                opt.repair = 1;
+                break;
+            case 'R':
+                opt.recursive = 1;
+                break;
+            case 't':
+                opt.budget = atoi(optarg);
+                break;
+            case 'g':
+                opt.since = atoi(optarg);
+                break;
+            case 'z':
+                opt.compress = 1;
+                break;
+            case 'q':
+                opt.queueDepth = atoi(optarg);
+                break;
+            case 'D':
+                opt.direct = atoi(optarg);
+                break;
+            case 'M':
+                opt.memory = 1;
+                break;
+            case 'S':
+                opt.snapshot = optarg;
+                break;
+            case 'p':
+                p_token = strtok(optarg, ",");
+
+                while (p_token != NULL) {
+
+                    switch (p_num) {
+                        case 1: // Src path
+                            opt.path = p_token;
+                            break;
+                        case 2: // Dst path
+                            opt.dst_path = p_token;
+                            break;
+                    }
+                    p_token = strtok(NULL, ",");
+                    p_num++;
+                }
+                break;
+            default:
+                usage();
+                exit(255);
+        }
+    }
+}
+
+int parseFeatures(char* list, int* inlineMax, int* growMax) {
+    // Comma list from -O, "no" in front of a feature turns it off. inline may
+    //  be given as inline=N for the largest file kept inline, grow as grow=N
+    //  for the most sectors the container grows to
+    int features = FEAT_AGGREGATES;     // on unless turned off
+    char* token;
+
+    *inlineMax = INLINE_DEFAULT;
+    *growMax = GROW_DEFAULT;
+
+    if (list == NULL) {
+        return features;
+    }
+    token = strtok(list, ",");
+
+    while (token != NULL) {
+        int off = (strncmp(token, "no", 2) == 0);
+        char* name = off ? token + 2 : token;
+        int bit = 0;
+
+        if ( strcmp("agg", name) == 0 ) {
+            bit = FEAT_AGGREGATES;
+        }
+        else if ( strcmp("nameidx", name) == 0 ) {
+            bit = FEAT_NAMEIDX;
+        }
+        else if ( strcmp("crc", name) == 0 ) {
+            bit = FEAT_CRC;
+        }
+        else if ( strcmp("dedup", name) == 0 ) {
+            bit = FEAT_DEDUP;
+        }
+        else if ( strcmp("trim", name) == 0 ) {
+            bit = FEAT_TRIM;
+        }
+        else if ( strcmp("sparse", name) == 0 ) {
+            bit = FEAT_SPARSE;
+        }
+        else if ( strcmp("changes", name) == 0 ) {
+            bit = FEAT_CHANGES;
+        }
+        else if ( strncmp("inline", name, 6) == 0 && (name[6] == '\0' || (name[6] == '=' && !off)) ) {
+            bit = FEAT_INLINE;
+
+            if (name[6] == '=') {
+                *inlineMax = atoi(name + 7);
+
+                if (*inlineMax < 1 || *inlineMax > INLINE_MAX) {
+                    printf("Inline files may be 1 to %d bytes, not %s\n", INLINE_MAX, name + 7);
+                    exit(255);
+                }
+            }
+        }
+        else if ( strncmp("grow", name, 4) == 0 && (name[4] == '\0' || (name[4] == '=' && !off)) ) {
+            bit = FEAT_GROW;
+
+            if (name[4] == '=') {
+                *growMax = atoi(name + 5);
+
+                if (*growMax < CONTAINER_SIZE/BUF_SIZE) {
+                    printf("A container may grow to %d sectors or more, not %s\n", CONTAINER_SIZE/BUF_SIZE, name + 5);
+                    exit(255);
+                }
+            }
+        }
+        else {
+            printf("Unknown feature %s\n", token);
+            exit(255);
+        }
+        features = off ? (features & ~bit) : (features | bit);
+        token = strtok(NULL, ",");
+    }
+    return features;
+}
+
+int alloc_parse(char* name) {
+    if ( strcmp("head", name) == 0 ) {
+        return ALLOC_HEAD;
+    }
+    else if ( strcmp("near", name) == 0 ) {
+        return ALLOC_NEAR;
+    }
+    else if ( strcmp("contig", name) == 0 ) {
+        return ALLOC_CONTIG;
+    }
+    else if ( strcmp("group", name) == 0 ) {
+        return ALLOC_GROUP;
+    }
+    printf("Unknown allocation policy %s\n", name);
+    exit(255);
+}
+
+void alloc_loadMap() {
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d;
+    int sector = 0;
+
+    freeMap_reset(&freeMap, (super.magic != 0) ? super.numSectors : CONTAINER_SIZE/BUF_SIZE);
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    sectorRead(buf, fd, 0);
+    buf2dir(buf, &d);
+    sector = d.free;
+
+    while (sector > 0 && sector < freeMap.numSectors && !freeMap_isFree(&freeMap, sector)) {
+        freeMap_append(&freeMap, sector);
+        freeRead(buf, fd, sector);
+        buf2dir(buf, &d);
+        sector = d.frwd;
+    }
+    containerClose(fd);
+}
+
+void alloc_sync(int head) {
+    // Sectors are only ever taken off the head of the free list (root .free
+    //  moves to next_free), so drop from the map until its head matches
+    while (freeMap.head != head && freeMap.head != 0) {
+        freeMap_unlink(&freeMap, freeMap.head);
+    }
+    if (freeMap.head != head) {     // list changed some other way
+        alloc_loadMap();
+    }
+}
+
+int alloc_target() {
+    int goal = currState.alloc_goal;
+    int len = currState.alloc_len;
+    int n = freeMap.numSectors;
+
+    switch (allocPolicy) {
+        case ALLOC_GROUP:
+            if (currState.alloc_dir) {
+                // emptiest group, looking from parent's group onward so ties stay close
+                int groups = (n + ALLOC_GROUP_SIZE - 1) / ALLOC_GROUP_SIZE;
+                int best = goal / ALLOC_GROUP_SIZE;
+                int bestFree = -1;
+
+                for (int i=0; i<groups; i++) {
+                    int g = (goal / ALLOC_GROUP_SIZE + i) % groups;
+                    int nFree = freeMap_countFree(&freeMap, g * ALLOC_GROUP_SIZE, (g + 1) * ALLOC_GROUP_SIZE);
+
+                    if (nFree > bestFree) {
+                        best = g;
+                        bestFree = nFree;
+                    }
+                }
+                return freeMap_findNear(&freeMap, best * ALLOC_GROUP_SIZE, 1, n);
+            }
+            // fall through - files follow their dir, as with contig
+        case ALLOC_CONTIG:
+            if (len > 1) {
+                int start = freeMap_findRun(&freeMap, goal, len, 1, n);
+
+                if (start != 0) {
+                    return start;
+                }
+            }
+            // fall through - no run that long, first free will do
+        case ALLOC_NEAR:
+            return freeMap_findNear(&freeMap, goal, 1, n);
+    }
+    return 0;
+}
+
+void alloc_place() {
+    /* Policy picks a free sector for currState.alloc_goal; it is unlinked from
+     *  where it is in the free list and put at the head, so every caller of
+     *  get2FreeSectors() can go on taking the head sector. Goal is used up.
+     */
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d;
+    int target = 0;
+    int head = 0;
+
+    if (allocPolicy == ALLOC_HEAD || currState.alloc_goal < 0) {
+        currState.alloc_goal = -1;
+        return;
+    }
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorRead(buf, fd, 0);
+    buf2dir(buf, &d);
+    head = d.free;
+
+    if (!freeMap.valid) {
+        alloc_loadMap();
+    }
+    else {
+        alloc_sync(head);
+    }
+    target = alloc_target();
+    currState.alloc_goal = -1;
+    currState.alloc_len = 0;
+    currState.alloc_dir = 0;
+
+    if (target == 0 || target == head) {
+        containerClose(fd);
+        return;
+    }
+    //DEBUG
+    //printf("Allocating sector %d instead of %d\n", target, head);
+
+    // sector before target now links past it
+    freeRead(buf, fd, freeMap.prev[target]);
+    buf2dir(buf, &d);
+    d.frwd = freeMap.next[target];
+    dir2buf(buf, d);
+    sectorWrite(buf, fd, currState.curr_sector);
+
+    // target links to old head
+    freeRead(buf, fd, target);
+    buf2dir(buf, &d);
+    d.frwd = head;
+    dir2buf(buf, d);
+    sectorWrite(buf, fd, target);
+
+    // root .free is target
+    sectorRead(buf, fd, 0);
+    buf2dir(buf, &d);
+    d.free = target;
+    dir2buf(buf, d);
+    sectorWrite(buf, fd, 0);
+    containerClose(fd);
+
+    freeMap_unlink(&freeMap, target);
+    freeMap_prepend(&freeMap, target);
+}
+
+int growWanted(int head, int next) {
+    // The map knows how many sectors are free when a policy loaded it;
+    //  otherwise the list is only seen to run low when it is down to one
+    if (!(super.features & FEAT_GROW) || super.numSectors >= super.growMax) {
+        return 0;
+    }
+    if (freeMap.valid && freeMap.numSectors == super.numSectors) {
+        return freeMap.count < super.numSectors / GROW_WATERMARK;
+    }
+    return head == 0 || next == 0;
+}
+
+int containerGrow() {
+    /* Container doubles (up to super .growMax). Tables that no longer cover
+     *  every sector are moved to the start of the new sectors; the rest go
+     *  onto the end of the free list as one run, followed by the tables' old
+     *  sectors.
+     */
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d;
+    int old = super.numSectors;
+    int numSectors = (old * 2 < super.growMax) ? old * 2 : super.growMax;
+    int first = old;    // next of the new sectors not used by a table
+    int freed[4][2] = { {0, 0}, {0, 0}, {0, 0}, {0, 0} };   // old place and length of moved tables
+    int origSector = currState.curr_sector;
+    int len = 0;
+
+    if (numSectors <= old) {
+        return 0;
+    }
+    int aggLen = (numSectors + AGG_PER_SECTOR - 1) / AGG_PER_SECTOR;
+    int oldAgg = super.aggTable;
+    int oldAggLen = super.aggTableLen;
+
+    if (aggLen > super.aggTableLen) {
+        freed[0][0] = super.aggTable;
+        freed[0][1] = super.aggTableLen;
+        super.aggTable = first;
+        super.aggTableLen = aggLen;
+        first += aggLen;
+    }
+    len = (numSectors + CRC_PER_SECTOR - 1) / CRC_PER_SECTOR;
+
+    if (crcTable.crc != NULL && len > crcTable.len) {
+        freed[1][0] = crcTable.first;
+        freed[1][1] = crcTable.len;
+        super.crcTable = first;
+        super.crcTableLen = len;
+        first += len;
+    }
+    len = (numSectors + DD_PER_SECTOR - 1) / DD_PER_SECTOR;
+
+    if (ddTable.refs != NULL && len > ddTable.len) {
+        freed[2][0] = ddTable.first;
+        freed[2][1] = ddTable.len;
+        super.dedupTable = first;
+        super.dedupTableLen = len;
+        first += len;
+    }
+    len = (numSectors + GEN_PER_SECTOR - 1) / GEN_PER_SECTOR;
+
+    if (genTable.gen != NULL && len > genTable.len) {
+        freed[3][0] = genTable.first;
+        freed[3][1] = genTable.len;
+        super.genTable = first;
+        super.genTableLen = len;
+        first += len;
+    }
+    // before any new sector is written, so each gets its checksum and generation
+    crc_resize(super.crcTable, super.crcTableLen, numSectors);
+    dd_resize(super.dedupTable, super.dedupTableLen, numSectors);
+    gen_resize(super.genTable, super.genTableLen, numSectors);
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+
+    for (int i=0; super.aggTable != oldAgg && i<aggLen; i++) {
+        memset(buf, 0, BUF_SIZE);
+
+        if (i < oldAggLen) {
+            sectorRead(buf, fd, oldAgg + i);
+        }
+        sectorWrite(buf, fd, super.aggTable + i);
+    }
+
+    // New free sectors as empty dirs linked in order, as init makes them
+    d.back = 0x00000000;
+    d.free = 0xADDEADDE;
+    d.filler = 0xEFBEEFBE;
+
+    for (int i=0; i<31; i++) {
+        d.Idx[i].link = 0x00000000;
+        d.Idx[i].type = 'F';
+        strncpy(d.Idx[i].name, "         \0", 10);
+        d.Idx[i].size = 0x0000;
+    }
+    for (int i=first; i<numSectors; i++) {
+        d.frwd = (i < numSectors - 1) ? i + 1 : 0;
+        memset(buf, 0, BUF_SIZE);
+        dir2buf(buf, d);
+        sectorWrite(buf, fd, i);
+    }
+    super.numSectors = numSectors;
+    superWrite();
+
+    // One link puts the run on the end of the free list
+    currState.last_free = getLastFree();
+    freeRead(buf, fd, currState.last_free);
+    buf2dir(buf, &d);
+
+    if (currState.last_free == 0) {
+        d.free = first;
+    }
+    else {
+        d.frwd = first;
+    }
+    dir2buf(buf, d);
+    sectorWrite(buf, fd, currState.last_free);
+    currState.last_free = numSectors - 1;
+    freeMap.valid = 0;  // sized for the old container
+
+    for (int t=0; t<4; t++) {
+        for (int i=0; i<freed[t][1]; i++) {
+            currState.curr_sector = freed[t][0] + i;
+            append2FreeList();
+        }
+    }
+    currState.curr_sector = origSector;
+    containerClose(fd);
+
+    return numSectors - old;
+}
+
+int freeFix(char* buf, int sector) {
+    /* A free sector punched by trim reads back as zeros; it stands for an
+     *  empty free dir linked to the next sector. Only for sectors known to be
+     *  on the free list: other sectors may be zeros too. Returns 1 if it was one.
+     */
+    struct Dir d = { .back=0x00000000, .frwd=sector + 1, .free=0xADDEADDE, .filler=0xEFBEEFBE };
+
+    for (int i=0; i<BUF_SIZE; i++) {
+        if (buf[i] != 0) {
+            return 0;
+        }
+    }
+    for (int i=0; i<31; i++) {
+        d.Idx[i].link = 0x00000000;
+        d.Idx[i].type = 'F';
+        strncpy(d.Idx[i].name, "         \0", 10);
+        d.Idx[i].size = 0x0000;
+    }
+    dir2buf(buf, d);
+
+    return 1;
+}
+
+void freeRead(char* buf, int fd, int sector) {
+    sectorRead(buf, fd, sector);
+    freeFix(buf, sector);
+}
+
+int trim_punch(int fd, int* sectors, int n) {
+    /* sectors are on the free list and each links to the next sector, in any
+     *  order. Pages all of whose sectors are given are punched, each run of
+     *  them as one hole; the other sectors keep their link.
+     */
+    int per = SC_PAGE / BUF_SIZE;
+    int punched = 0;
+    char zero[BUF_SIZE];
+
+    memset(zero, 0, BUF_SIZE);
+    qsort(sectors, n, sizeof(int), wb_cmp);
+
+    for (int i=0; i<n && !trimList.unsupported; ) {
+        int j = i + 1;
+
+        while (j < n && sectors[j] <= sectors[j-1] + 1) {
+            j++;
+        }
+        int from = (sectors[i] + per - 1) / per * per;     // whole pages of run
+        int to = (sectors[j-1] + 1) / per * per;
+
+        i = j;
+
+        if (from >= to) {
+            continue;
+        }
+        if (devPunch(fd, (off_t)from * BUF_SIZE, (long)(to - from) * BUF_SIZE) < 0) {
+            if (errno == EOPNOTSUPP) {
+                dprintf(2, "%s can not have holes punched, free sectors keep their space\n", opt.filename);
+                trimList.unsupported = 1;
             }
-            //DEBUG
-            printf("writing file size: %d\n", d.Idx[i].size);
+            else {
+                dprintf(2, "Error occured punching sectors %d to %d; %s\n", from, to - 1, strerror(errno));
+            }
+            continue;
+        }
+        for (int s=from; s<to; s++) {   // zeros now, whatever was held or cached
+            wb_drop(&wback, s);
+            crc_update(s, zero);
+        }
+        for (int page = from / per; scache.slots > 0 && page < to / per; page++) {
+            sc_forget(&scache, page);
+        }
+        ra_drop(&readAhead, from, to - from);
+        punched += to - from;
+        trimList.ranges++;
+    }
+    trimList.punched += punched;
+
+    return punched;
+}
+
+void trim_flush(int fd) {
+    // Sectors freed this command that still are free and link to the next sector
+    char buf[512] = {0};
+    struct Dir d;
+    int n = 0;
+
+    if (trimList.count == 0 || fd < 0) {
+        return;
+    }
+    for (int i=0; i<trimList.count; i++) {
+        int sector = trimList.sector[i];
+        int empty = 1;
+
+        freeRead(buf, fd, sector);
+        buf2dir(buf, &d);
 
-            break;  // finished looking through dir idx
+        for (int k=0; k<31; k++) {
+            empty &= (d.Idx[k].type == 'F');
+        }
+        if (empty && d.back == 0 && d.frwd == sector + 1 && d.free == (int)0xADDEADDE
+            && d.filler == (int)0xEFBEEFBE && (!freeMap.valid || freeMap_isFree(&freeMap, sector))) {
+            trimList.sector[ n++ ] = sector;
         }
     }
-    dir2buf(sectBuf, d);
-    sectorWrite(sectBuf, fd_out, sector);
-    containerClose(fd_out);
+    trim_punch(fd, trimList.sector, n);
+    trimList.count = 0;
 }
 
-void seek_file(int base, double offset) {   // SEEK base offset 
-    // base=-1: start of file; base=0: curr loc in file; base=1: EOF
+void trim() {
+    // Walks the whole free list; sectors punched before read as the links they stand for
+    int fd = 0;         // File descriptor of container
+    char buf[512] = {0};
+    struct Dir d;
+    int numSectors = (super.magic != 0) ? super.numSectors : CONTAINER_SIZE/BUF_SIZE;
+    int* list = (int *)malloc( numSectors * sizeof(int) );
+    int n = 0;
+    int onList = 0;
+    int punched = 0;
+    long ranges = trimList.ranges;
+
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+    sectorRead(buf, fd, 0);
+    buf2dir(buf, &d);
+
+    for (int sector = d.free; sector > 0 && sector < numSectors && onList < numSectors; onList++) {
+        chainRead(buf, fd, sector);
+        freeFix(buf, sector);
+        buf2dir(buf, &d);
+
+        if (d.frwd == sector + 1) {
+            list[ n++ ] = sector;
+        }
+        sector = d.frwd;
+    }
+    punched = trim_punch(fd, list, n);
+    containerClose(fd);
+    free(list);
+
+    printf("Punched %d of %d free sectors (%d KB) in %ld holes\n", punched, onList,
+           punched * BUF_SIZE / 1024, trimList.ranges - ranges);
 }
 
-void dir2buf(char* b, struct Dir d) {
-    char **p = &b;
+void snapshot() {
+    /* Taking one creates its file, with an empty map as big as the container
+     *  needs, and adds it to super's list; no other sector is read or written.
+     *  The super sector itself is the first one copied.
+     */
+    char path[4096];
+    char hdr[SNAP_HEADER] = {0};
+    char* name = opt.path;
+    int magic = SNAP_MAGIC;
+    int fd = -1;
+
+    if (super.magic == 0) {
+        printf("Container %s has no super sector, only containers made by init keep snapshots\n", opt.filename);
+        exit(1);
+    }
+    if (name == NULL) {     // list them
+        for (int i=0; i<super.snapCount && i<SNAP_MAX; i++) {
+            struct Snapshot s;
 
-    memcpy(*p+0, &d.back, 4);
-    memcpy(*p+4, &d.frwd, 4);
-    memcpy(*p+8, &d.free, 4);
-    memcpy(*p+12, &d.filler, 4);
+            if ( !snap_open(&s, super.snapName[i], CONTAINER_READ) ) {
+                printf(opt.machine ? "%s\t-\t-\tmissing\n" : "%-9s  missing; %s\n", super.snapName[i], strerror(errno));
+                continue;
+            }
+            if (opt.machine) {
+                printf("%s\t%d\t%ld\t%s\n", s.name, s.numSectors, s.slots, s.broken ? "broken" : "ok");
+            }
+            else {
+                printf("%-9s  %d sectors, %ld copied (%ld KB)%s\n", s.name, s.numSectors, s.slots,
+                       s.slots * BUF_SIZE / 1024, s.broken ? ", no longer whole" : "");
+            }
+            close(s.fd);
+            free(s.slot);
+        }
+        return;
+    }
+    if (memImage.active) {
+        printf("Snapshots are kept of the container file; not with -M\n");
+        exit(255);
+    }
+    if (strlen(name) == 0 || strlen(name) > 9 || strpbrk(name, "/@") != NULL) {
+        printf("Snapshot name %s must be 1 to 9 characters, without / or @\n", name);
+        exit(255);
+    }
+    for (int i=0; i<super.snapCount; i++) {
+        if (strcmp(super.snapName[i], name) == 0) {
+            printf("Snapshot %s exists\n", name);
+            exit(1);
+        }
+    }
+    if (super.snapCount == SNAP_MAX) {
+        printf("A container keeps at most %d snapshots, see rmsnap\n", SNAP_MAX);
+        exit(1);
+    }
+    snap_path(path, sizeof(path), name);
+    memcpy(hdr, &magic, 4);
+    memcpy(hdr+4, &super.numSectors, 4);
+
+    if ((fd = open(path, O_CREAT | O_EXCL | O_RDWR, CONTAINER_PERMS)) < 0
+        || pwrite(fd, hdr, SNAP_HEADER, 0) != SNAP_HEADER
+        || ftruncate(fd, SNAP_DATA(super.numSectors)) != 0      // map is a hole until sectors are copied
+        || fsync(fd) != 0) {
+        dprintf(2, "Could not create snapshot %s; %s\n", path, strerror(errno));
+
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+        exit(1);
+    }
+    close(fd);
 
-    for (int i=0; i<31; i++) {
-        //    base+( hdrOffset+(arrOffset)+fieldOffset ), StructSrc, len2cp)
-        memcpy(*p+( 16+(i*16) ), &d.Idx[i].link, 4);
-        memcpy(*p+( 16+(i*16)+4 ), &d.Idx[i].name, 9);    // Not copying the NUL term.
-        memcpy(*p+( 16+(i*16)+4+9 ), &d.Idx[i].type, 1);
-        memcpy(*p+( 16+(i*16)+4+9+1 ), &d.Idx[i].size, 2);
+    snap_release();
+    strncpy(super.snapName[ super.snapCount++ ], name, 10);
+    superWrite();
+
+    printf("Snapshot %s of %d sectors in %s\n", name, super.numSectors, path);
+}
+
+void snap_rm() {
+    // Off super's list first, so no command copies into the file once it is gone
+    char path[4096];
+    int i = 0;
+
+    if (memImage.active) {
+        printf("Snapshots are kept of the container file; not with -M\n");
+        exit(255);
+    }
+    while (opt.path != NULL && i < super.snapCount && strcmp(super.snapName[i], opt.path) != 0) {
+        i++;
+    }
+    if (opt.path == NULL || i == super.snapCount) {
+        printf("No snapshot %s of %s\n", (opt.path != NULL) ? opt.path : "", opt.filename);
+        exit(1);
+    }
+    for (; i < super.snapCount - 1; i++) {
+        memcpy(super.snapName[i], super.snapName[i+1], 10);
+    }
+    memset(super.snapName[ --super.snapCount ], 0, 10);
+    superWrite();
+
+    if (wb_flush(containerFd) > 0) {
+        die(NULL, 3);
+    }
+    snap_release();
+
+    snap_path(path, sizeof(path), opt.path);
+
+    if (unlink(path) != 0 && errno != ENOENT) {
+        dprintf(2, "Could not remove %s; %s\n", path, strerror(errno));
+        exit(1);
     }
+    printf("Removed snapshot %s\n", opt.path);
 }
-void file2buf(char* b, struct File f) {
-    char **p = &b;
 
-    /* struct File
-            char data[504];
-            int back;
-            int frwd;
+void delta_export() {
+    /* Runs of consecutive changed sectors are read DELTA_RUN at a time (all
+     *  in flight with -q). A change table sector is in when it holds a
+     *  generation after -g. The generation moves on once the delta is out,
+     *  so the next one starts where this one ends.
      */
-    memcpy(*p+0, &f.back, 4);
-    memcpy(*p+4, &f.frwd, 4);
-    memcpy(*p+8, &f.data, 504);
+    int fd = 0;         // File descriptor of container
+    unsigned int hdr[4] = { DELTA_MAGIC, opt.since, super.generation, super.numSectors };
+    int run[3] = { 0, 0, 0 };   // first sector, count, CRC32C
+    char* bufs = (char *)malloc( (long)DELTA_RUN * BUF_SIZE );
+    int* list = (int *)malloc( DELTA_RUN * sizeof(int) );
+    unsigned int sum = crc32c(hdr, DELTA_HEADER);  // of header and every run's CRC32C, see DELTA_HEADER
+    unsigned int link[2];
+    long sectors = 0;
+    int runs = 0;
+    int n = 0;
+
+    if (genTable.gen == NULL) {
+        dprintf(2, "Container %s keeps no changes (init with -O changes)\n", opt.filename);
+        exit(1);
+    }
+    if (opt.since < 0 || opt.since > super.generation) {
+        dprintf(2, "Container %s is at generation %d\n", opt.filename, super.generation);
+        exit(1);
+    }
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    fwrite(hdr, 4, 4, stdout);
+
+    for (int s=0; s<=genTable.numSectors; s++) {
+        int changed = 0;
+
+        if (s < genTable.numSectors && s != super.self && gen_own(s)) {
+            for (int j=0; j<GEN_PER_SECTOR && !changed; j++) {
+                changed = genTable.gen[ (long)(s - genTable.first) * GEN_PER_SECTOR + j ] > (unsigned int)opt.since;
+            }
+        }
+        else if (s < genTable.numSectors && s != super.self) {
+            changed = genTable.gen[s] > (unsigned int)opt.since;
+        }
+        if (n > 0 && (!changed || n == DELTA_RUN || s == genTable.numSectors)) {
+            sectorReadMany(fd, list, n, bufs);
+            run[0] = list[0];
+            run[1] = n;
+            run[2] = crc32c(bufs, (long)n * BUF_SIZE);
+            fwrite(run, 4, 3, stdout);
+            fwrite(bufs, BUF_SIZE, n, stdout);
+            link[0] = sum;
+            link[1] = run[2];
+            sum = crc32c(link, 8);
+            sectors += n;
+            runs++;
+            n = 0;
+        }
+        if (changed) {
+            list[ n++ ] = s;
+        }
+    }
+    sectorReadMany(fd, &super.self, 1, bufs);   // last, see DELTA_HEADER
+    run[0] = super.self;
+    run[1] = 1;
+    run[2] = crc32c(bufs, BUF_SIZE);
+    fwrite(run, 4, 3, stdout);
+    fwrite(bufs, BUF_SIZE, 1, stdout);
+    link[0] = sum;
+    link[1] = run[2];
+    run[0] = runs + 1;
+    run[1] = 0;
+    run[2] = crc32c(link, 8);
+    fwrite(run, 4, 3, stdout);
+    fflush(stdout);
+    containerClose(fd);
+    free(bufs);
+    free(list);
+
+    if (ferror(stdout)) {
+        dprintf(2, "Could not write delta; %s\n", strerror(errno));
+        exit(3);
+    }
+    super.generation++;
+    superWrite();
+
+    dprintf(2, "Delta of %ld sectors changed after generation %d brings a replica to generation %d\n",
+            sectors + 1, opt.since, hdr[2]);
 }
-void buf2dir(char* b, struct Dir* d) {
-    char **p = &b;
 
-    //DEBUG
-    //printf("buf2dir() running\n");
-    //print_hex_memory(*p+0, 16);
-    //print_hex_memory(*p+32, 16);
+long delta_check(FILE* in, unsigned int* hdr, FILE* stage) {
+    // Reads runs to the end record, checking each and then the end record against them all
+    int run[3] = { 0, 0, 0 };
+    char* bufs = (char *)malloc( (long)DELTA_RUN * BUF_SIZE );
+    unsigned int sum = crc32c(hdr, DELTA_HEADER);
+    unsigned int link[2];
+    long sectors = 0;
+    int runs = 0;
+
+    while (fread(run, 4, 3, in) == 3 && run[1] != 0) {
+        // Run must lie in the container; run[0] + run[1] could overflow, so run[1] is held to what is left
+        if (run[0] < 0 || run[1] < 0 || run[1] > DELTA_RUN
+            || (unsigned int)run[0] > hdr[3] || (unsigned int)run[1] > hdr[3] - run[0]
+            || fread(bufs, BUF_SIZE, run[1], in) != (size_t)run[1]
+            || crc32c(bufs, (long)run[1] * BUF_SIZE) != (unsigned int)run[2]) {
+            printf("Delta is damaged after %ld sectors\n", sectors);
+            free(bufs);
+            return -1;
+        }
+        if (stage != NULL) {
+            fwrite(run, 4, 3, stage);
+            fwrite(bufs, BUF_SIZE, run[1], stage);
+        }
+        link[0] = sum;
+        link[1] = run[2];
+        sum = crc32c(link, 8);
+        sectors += run[1];
+        runs++;
+    }
+    free(bufs);
 
-    memcpy(&d->back, *p+0, 4);
-    memcpy(&d->frwd, *p+4, 4);
-    memcpy(&d->free, *p+8, 4);
-    memcpy(&d->filler, *p+12, 4);
+    if (run[1] != 0 || run[0] != runs || (unsigned int)run[2] != sum) {
+        printf("Delta ends early or is damaged after %ld sectors\n", sectors);
+        return -1;
+    }
+    if (stage != NULL) {
+        fwrite(run, 4, 3, stage);
+        fflush(stage);
 
-    /* struct FileIDX Idx[31];
-            int link;
-            char name[9];
-            char type;
-            short int size;
-    */
-    for (int i=0; i<31; i++) {
-        memcpy(&d->Idx[i].link, *p+( 16+(i*16) ), 4);
-        memcpy(&d->Idx[i].name, *p+( 16+(i*16)+4 ), 9); //init gave terminating \0
-        memcpy(&d->Idx[i].type, *p+( 16+(i*16)+4+9 ), 1);
-        memcpy(&d->Idx[i].size, *p+( 16+(i*16)+4+9+1 ), 2);
+        if (ferror(stage)) {
+            printf("Could not keep delta in a temporary file; %s\n", strerror(errno));
+            return -1;
+        }
     }
+    return sectors;
+}
 
-    //DEBUG
-    /*
-    for (int i=0; i<5; i++) {
-        printf("d->Idx[%d].name: %s\t.type: %c\n", i, (char *)d->Idx[i].name, (char)d->Idx[i].type);
+void delta_apply() {
+    /* The whole delta is read and checked before anything is written: again
+     *  from the start when -i (or stdin) is a file, else from a temporary file
+     *  it is kept in meanwhile. The tables come with the delta, so the ones
+     *  loaded are dropped unwritten. The super sector keeps this container's
+     *  own snapshots and striping; it comes last, so a container that failed
+     *  to take a delta all the way can be given it again.
+     */
+    FILE* in = stdin;
+    FILE* data = NULL;  // runs of the delta once checked
+    int fd = 0;         // File descriptor of container
+    unsigned int hdr[4];
+    int run[3] = { 0, 0, 0 };
+    char* bufs = (char *)malloc( (long)DELTA_RUN * BUF_SIZE );
+    struct UringOp op;
+    long sectors = 0;
+
+    if (opt.src != NULL && (in = fopen(opt.src, "r")) == NULL) {
+        dprintf(2, "Could not open delta %s; %s\n", opt.src, strerror(errno));
+        exit(255);
     }
-    */
+    if (fread(hdr, 4, 4, in) != 4 || hdr[0] != DELTA_MAGIC) {
+        printf("%s is not a delta\n", (opt.src != NULL) ? opt.src : "stdin");
+        exit(1);
+    }
+    if (super.magic == 0) {
+        printf("Container %s has no super sector, make it with init\n", opt.filename);
+        exit(1);
+    }
+    if (hdr[1] > (unsigned int)super.generation || hdr[2] < (unsigned int)super.generation) {
+        printf("Delta takes generation %u to %u, %s is at generation %d\n", hdr[1], hdr[2], opt.filename, super.generation);
+        exit(1);
+    }
+    data = (fseek(in, DELTA_HEADER, SEEK_SET) == 0) ? in : tmpfile();   // a pipe is read once
+
+    if (data == NULL) {
+        printf("Could not keep delta in a temporary file; %s\n", strerror(errno));
+        exit(3);
+    }
+    if (delta_check(in, hdr, (data != in) ? data : NULL) < 0) {
+        printf("Nothing of it was written to %s\n", opt.filename);
+        exit(3);
+    }
+    fseek(data, (data == in) ? DELTA_HEADER : 0, SEEK_SET);
+    crc_setup(0, 0, 0);
+    dd_setup(0, 0, 0);
+    gen_setup(0, 0, 0);
+    fd = containerOpen(opt.filename, CONTAINER_READWRITE);
+
+    while (fread(run, 4, 3, data) == 3 && run[1] > 0) {
+        if (fread(bufs, BUF_SIZE, run[1], data) != (size_t)run[1]
+            || crc32c(bufs, (long)run[1] * BUF_SIZE) != (unsigned int)run[2]) {
+            printf("Delta changed while being applied, after %ld sectors; apply it again\n", sectors);
+            die(&fd, 3);
+        }
+        if (super.self >= run[0] && super.self - run[0] < run[1]) {
+            char* b = bufs + (long)(super.self - run[0]) * BUF_SIZE;
+            struct Super theirs;
+
+            buf2super(b, &theirs);
+            theirs.stripes = super.stripes;
+            theirs.stripeUnit = super.stripeUnit;
+            theirs.snapCount = super.snapCount;
+            memcpy(theirs.snapName, super.snapName, sizeof(theirs.snapName));
+            super2buf(b, theirs);
+        }
+        memset(&op, 0, sizeof(op));
+        op.buf = bufs;
+        op.len = (long)run[1] * BUF_SIZE;
+        op.offset = (off_t)run[0] * BUF_SIZE;
+        op.write = 1;
+
+        if (ioRun(fd, &op, 1) > 0) {
+            printf("Error occured writing sectors %d-%d; %s\n", run[0], run[0] + run[1] - 1,
+                   strerror( (op.res < 0) ? -op.res : EIO ));
+            die(&fd, 3);
+        }
+        sectors += run[1];
+    }
+    if (data != in) {
+        fclose(data);
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    free(bufs);
+
+    // Everything read before is stale
+    ra_drop(&readAhead, 0, 1 << 30);
+    dcache_clear(&dcache);
+    freeMap.valid = 0;
+    superLoad();
+    superWrite();       // checksum of the super as patched
+
+    printf("Applied %ld sectors, %s is at generation %d\n", sectors, opt.filename, super.generation);
 }
-void buf2file(char* b, struct File* f) {
-    char **p = &b;
 
-    memcpy(&f->back, *p+0, 4);
-    memcpy(&f->frwd, *p+4, 4);
-    memcpy(&f->data, *p+8, 504);
+void import_add(struct Import* im, char* host, char* path, char type, long size) {
+    // Caller holds im->lock
+    if (im->count == im->max) {
+        im->max = (im->max > 0) ? im->max * 2 : 256;
+        im->e = (struct ImportEntry *)realloc( im->e, im->max * sizeof(struct ImportEntry) );
+    }
+    struct ImportEntry* e = &im->e[ im->count++ ];
+
+    e->host = strdup(host);
+    e->path = strdup(path);
+    e->type = type;
+    e->size = size;
+    e->ready = (type == 'D');   // the writer makes a dir before it is listed
+    e->data = NULL;
+    e->len = 0;
 }
 
-int containerOpen(char* p, int m) {
-    int fd = 0;
-    /* m =
-     * CONTAINER_CREAT create file, truncate, write-only, will overwrite existing file with same name
-     * CONTAINER_INIT create file, truncate, write-only, will error if file exists
-     * CONTAINER_READ read-only
-     * CONTAINER_WRITE write-only
-     * CONTAINER_READWRITE read/write
+void import_list(struct Import* im, char* host, char* path) {
+    // Adds entries of host dir; a dir is only listed once, so no one else adds to it
+    DIR* dir = opendir(host);
+    struct dirent* de = NULL;
+    char hostPath[4096];
+    char subPath[4096];
+    struct stat st;
+
+    if (dir == NULL) {
+        dprintf(2, "Could not open dir %s; %s\n", host, strerror(errno));
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(hostPath, sizeof(hostPath), "%s/%s", host, de->d_name);
+        snprintf(subPath, sizeof(subPath), "%s/%s", path, de->d_name);
+
+        if (lstat(hostPath, &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))
+            || strlen(de->d_name) > 9) {
+            printf("Skipped %s, %s\n", hostPath, (strlen(de->d_name) > 9)
+                   ? "names are at most 9 characters" : "not a file or dir");
+            pthread_mutex_lock(&im->lock);
+            im->skipped++;
+            pthread_mutex_unlock(&im->lock);
+            continue;
+        }
+        pthread_mutex_lock(&im->lock);
+        import_add(im, hostPath, subPath, S_ISDIR(st.st_mode) ? 'D' : 'U', st.st_size);
+        pthread_cond_broadcast(&im->changed);
+        pthread_mutex_unlock(&im->lock);
+    }
+    closedir(dir);
+}
+
+void* import_worker(void* arg) {
+    struct Import* im = arg;
+
+    pthread_mutex_lock(&im->lock);
+
+    while (1) {
+        // Files wait while the writer is IMPORT_AHEAD behind, dirs never do
+        while (im->next < im->count && im->e[ im->next ].type == 'U' && im->ahead > 0
+               && im->ahead + im->e[ im->next ].size > IMPORT_AHEAD) {
+            pthread_cond_wait(&im->changed, &im->lock);
+        }
+        if (im->next == im->count) {
+            if (im->busy == 0) {
+                break;      // nothing left, and no dir being listed can add more
+            }
+            pthread_cond_wait(&im->changed, &im->lock);
+            continue;
+        }
+        int i = im->next++;
+        char* host = im->e[i].host;     // im->e moves when it grows
+        char* path = im->e[i].path;
+        char type = im->e[i].type;
+        long size = im->e[i].size;
+        char* data = NULL;
+        long len = 0;
+
+        im->busy++;
+        im->ahead += (type == 'U') ? size : 0;
+        pthread_mutex_unlock(&im->lock);
+
+        if (type == 'D') {
+            import_list(im, host, path);
+        }
+        else if (size <= IMPORT_AHEAD) {
+            int fd = open(host, O_RDONLY);
+
+            if (fd >= 0) {      // on error the writer's gulp says what went wrong
+                int n = 0;
+
+                data = (char *)malloc( size + 1 );      // +1 == some, for an empty file
+
+                while (len < size && (n = read(fd, data + len,
+                                               (size - len < IMPORT_CHUNK) ? size - len : IMPORT_CHUNK)) > 0) {
+                    len += n;
+                }
+                if (n < 0) {    // the writer reads it and says why
+                    free(data);
+                    data = NULL;
+                    len = 0;
+                }
+                close(fd);
+            }
+        }
+        pthread_mutex_lock(&im->lock);
+        im->e[i].data = data;
+        im->e[i].len = len;
+        im->e[i].ready = 1;
+        im->busy--;
+        pthread_cond_broadcast(&im->changed);
+    }
+    pthread_cond_broadcast(&im->changed);
+    pthread_mutex_unlock(&im->lock);
+
+    return NULL;
+}
+
+void import_tree() {
+    /* Reader threads list the -i dir and read its files while this thread
+     *  makes each entry below -p in list order: a dir unless it is there
+     *  already, a file by gulp (so -z, dedup, inline and sparse apply). The
+     *  dentry cache keeps each path's dirs found since the writer made them.
      */
-    switch (m) {
-        case CONTAINER_CREAT:
-        case CONTAINER_INIT:
-            fd = open(opt.filename, m, CONTAINER_PERMS);
-        default:
-            fd = open(opt.filename, m);
+    struct Import im;
+    pthread_t tid[IMPORT_MAX_THREADS];
+    char* hostDir = opt.src;
+    char root[4096];
+    char path[4096];
+    struct stat st;
+    long long start = msecNow();
+    long long bytes = 0;
+    int dirs = 0;
+    int files = 0;
+
+    if (hostDir == NULL || stat(hostDir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("import needs a host dir to read with -i\n");
+        exit(1);
+    }
+    memset(&im, 0, sizeof(im));
+    pthread_mutex_init(&im.lock, NULL);
+    pthread_cond_init(&im.changed, NULL);
+    snprintf(root, sizeof(root), "%s", (opt.path != NULL) ? opt.path : "");
+    import_add(&im, hostDir, root, 'D', 0);
+
+    im.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    im.threads = (im.threads < 1) ? 1 : (im.threads > IMPORT_MAX_THREADS) ? IMPORT_MAX_THREADS : im.threads;
+
+    for (int i=0; i<im.threads; i++) {
+        if (pthread_create(&tid[i], NULL, import_worker, &im) != 0) {
+            dprintf(2, "Could not start import reader; %s\n", strerror(errno));
+            exit(255);
+        }
+    }
+    for (int w=0; ; w++) {
+        pthread_mutex_lock(&im.lock);
+
+        while (w < im.count && !im.e[w].ready) {
+            pthread_cond_wait(&im.changed, &im.lock);
+        }
+        while (w == im.count && (im.next < im.count || im.busy > 0)) {
+            pthread_cond_wait(&im.changed, &im.lock);
+        }
+        if (w == im.count) {
+            pthread_mutex_unlock(&im.lock);
             break;
+        }
+        struct ImportEntry e = im.e[w];
+        pthread_mutex_unlock(&im.lock);
+
+        free_pathElements(&userPath);
+        snprintf(path, sizeof(path), "%s", e.path);
+        parsePath(&userPath, path);
+        currState.alloc_len = 0;
+        currState.inline_size = 0;
+        currState.stream = 0;
+
+        if (e.type == 'D') {
+            if (userPath.elementCount > 0 && getFileSector() < 0) {
+                create_file('D');
+            }
+            dirs++;
+        }
+        else {
+            opt.src = e.host;
+            srcData.data = e.data;
+            srcData.len = e.len;
+            open_file( 'I', userPath.elementArr[ userPath.elementCount - 1 ] );
+            srcData.data = NULL;
+            opt.src = hostDir;
+            free(e.data);
+            bytes += e.size;
+            files++;
+        }
+        pthread_mutex_lock(&im.lock);
+        im.ahead -= (e.type == 'U') ? e.size : 0;
+        pthread_cond_broadcast(&im.changed);
+        pthread_mutex_unlock(&im.lock);
     }
-
-    if (fd < 0) {
-        dprintf(2, "Could not open container file %s with mode %d; %s\n", opt.filename, m, strerror(errno));
-        die(&fd, 1);
+    for (int i=0; i<im.threads; i++) {
+        pthread_join(tid[i], NULL);
     }
-    return fd;
-}
+    for (int i=0; i<im.count; i++) {    // a reader may list a dir after it is made
+        free(im.e[i].host);
+        free(im.e[i].path);
+    }
+    free(im.e);
 
-void containerClose(int fd) {
-    //TODO: error handling
-    close(fd);
+    printf("Imported %d dirs and %d files (%lld bytes) from %s with %d readers in %lld msec, %d skipped\n",
+           dirs, files, bytes, hostDir, im.threads, msecNow() - start, im.skipped);
 }
 
-void sectorRead(char* buf, int fd, int sector) {
-    /*
-     * zero's buffer in case of partial read.
-     * takes given sector number (zero-based) and calculates byte offset
-     * reads sector into given buffer
-     * updates global currState.curr_sector
-     */
-    memset(buf, 0, BUF_SIZE);
+int export_header(char* hdr, char* name, char type, long size, long mtime) {
+    // ustar header of regular file ('0') or dir ('5'); 0 if name does not fit
+    int len = strlen(name);
+    int split = 0;      // bytes of name going in prefix
+    unsigned int sum = 0;
 
-    //DEBUG
-    //printf("sectorRead sector num: %d\n", sector);
+    memset(hdr, 0, TAR_BLOCK);
 
-    int bytes_read = pread(fd, buf, BUF_SIZE, (sector*BUF_SIZE));
-    if (bytes_read != BUF_SIZE) { /* read error happened... */
-        dprintf(2, "Error occured reading sector at offset %d; %s\n", sector*BUF_SIZE, strerror(errno));
-        die(&fd, 3);
+    if (len > TAR_NAME) {
+        for (split = len - TAR_NAME - 1; split < len && name[split] != '/'; split++) {}
+
+        if (split > TAR_PREFIX || split >= len || len - split - 1 > TAR_NAME) {
+            return 0;
+        }
+        memcpy(hdr + 345, name, split);
+        name += split + 1;
+        len -= split + 1;
     }
-    currState.curr_sector = sector;
+    memcpy(hdr, name, len);
+    snprintf(hdr + 100, 8, "%07o", (type == '5') ? TAR_DIR_MODE : TAR_FILE_MODE);
+    snprintf(hdr + 108, 8, "%07o", 0);
+    snprintf(hdr + 116, 8, "%07o", 0);
+    snprintf(hdr + 124, 12, "%011lo", (unsigned long)size);
+    snprintf(hdr + 136, 12, "%011lo", (unsigned long)mtime);
+    hdr[156] = type;
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+    memset(hdr + 148, ' ', 8);          // counts as spaces while summed
+
+    for (int i=0; i<TAR_BLOCK; i++) {
+        sum += (unsigned char)hdr[i];
+    }
+    snprintf(hdr + 148, 8, "%06o", sum);
+
+    return 1;
 }
 
-void sectorWrite(char* buf, int fd, int offset) {
-    int bytes_written = 0;
+void export_chain(int fd, int sector, long size) {
+    /* Plain chain, exactly size bytes of it. chainRead() reads a chain laid
+     *  out in order a growing window at a time, and a file starting where the
+     *  last one ended keeps the window it had.
+     */
+    char buf[BUF_SIZE] = {0};
+    struct File f;
 
-    bytes_written = pwrite(fd, buf, BUF_SIZE, (offset*BUF_SIZE));
-    if (bytes_written != BUF_SIZE) { /* write error happened... */
-        dprintf(2, "Error occured writing sector at offset %d; %s\n", offset, strerror(errno));
-        die(&fd, 3);
+    while (size > 0 && sector != 0) {
+        int n = (size < 504) ? size : 504;
+
+        chainRead(buf, fd, sector);
+        buf2file(buf, &f);
+        fwrite(f.data, 1, n, stdout);
+        size -= n;
+        sector = f.frwd;
     }
-}
+    memset(buf, 0, BUF_SIZE);
 
-void usage() {
-    printf("jvol - manipulate an elementry filesystem in a file\n\n");
-    printf("Usage: \n");
-    printf("    jvol [-h] [-c cmd] -f filename [-p file]\n\n");
-    printf("    -c command: {init, mkdir, touch, gulp, append, cat, ls, rm, cp, mv}.\n\n");
-    printf("    -h print this help message; no operations are performed.\n\n");
-    printf("    -i Input file to read data from.\n\n");
-    printf("    -f operate on this container file.\n\n");
-    printf("    -p operate on this file (path) with cmd given for -c arg.\n\n");
-    printf("    -s Source file from environment.\n\n");
-    printf("Behavior: \n");
-    printf("    If -f option is given with no other options, container file will be created and initialized.\n");
-    printf("        However, if the given filename already exists, it will NOT be overwritten and program\n");
-    printf("        will exit with error. Init command will allow overwriting of existing container.\n\n");
-    printf("    There are semantics with the cp, and mv commands; the presence of -s or -o options indicate\n");
-    printf("        interaction with underlying filesystem and direction of data flow. The absence of -s or -o\n");
-    printf("        demands two paths be supplied with -p option seperated by a comma (i.e. -p src/path,dest/path).\n\n");
+    for ( ; size > 0; size -= 504) {    // chain ended before its size, keep the archive whole
+        fwrite(buf, 1, (size < 504) ? size : 504, stdout);
+    }
 }
 
-int parseCmd(char* c) {
-    //DEBUG
-    //printf("Command: %s, length: %lu\n", c, strlen(c));
-    // {init, mkdir, touch, gulp, append, cat, ls, rm, cp, mv}
-    if ( strncmp("init", c, strlen(c)) == 0 ) {
-        opt.init = 1;
-        return 0;
-    }
-    //else if ( strncmp("mkdir", c, strlen(c)) == 0 ) {
-    else if ( strcmp("mkdir", c) == 0 ) {
-        return 1;
-    }
-    else if ( strncmp("touch", c, strlen(c)) == 0 ) {
-        return 2;
-    }
-    else if ( strncmp("gulp", c, strlen(c)) == 0  ) {
-        return 3;
-    }
-    else if ( strncmp("append", c, strlen(c)) == 0  ) {
-        return 4;
+long export_size(int fd, struct DirEntryPlus* e, short* size, char* type) {
+    // Bytes export_data() writes of file entry; gives its entry's .size and type
+    char buf[BUF_SIZE] = {0};
+    struct Dir d;
+    struct Aggregate a;
+
+    sectorRead(buf, fd, e->entry_sector);
+    buf2dir(buf, &d);
+    *size = d.Idx[ e->entry_idx ].size;
+    *type = d.Idx[ e->entry_idx ].type;
+
+    if (*type == 'I') {
+        return (*size < 0 || *size > INLINE_MAX) ? 0 : *size;
     }
-    else if ( strncmp("cat", c, strlen(c)) == 0 ) {
-        return 5;
+    if ((*size & (CZ_FLAG | DD_FLAG | SP_FLAG)) == 0 && (super.features & FEAT_AGGREGATES)) {
+        agg_get(e->sector, &a);
+        return a.bytes;
     }
-    else if ( strncmp("ls", c, strlen(c)) == 0 ) {
-        return 6;
+    fileTotals(fd, e->sector, *size, &a);
+
+    return a.bytes;
+}
+
+void export_data(int fd, struct DirEntryPlus* e, short size, char type, long bytes) {
+    // Data of file entry to stdout, as cat writes it
+    if (type == 'I') {
+        char buf[BUF_SIZE] = {0};
+        char data[INLINE_MAX] = {0};
+
+        sectorRead(buf, fd, e->entry_sector);
+        inline_get(buf, e->entry_idx, data, bytes);
+        fwrite(data, 1, bytes, stdout);
     }
-    else if ( strncmp("rm", c, strlen(c)) == 0 ) {
-        return 7;
+    else if (size & CZ_FLAG) {
+        cz_read(e->sector, size);
     }
-    else if ( strncmp("cp", c, strlen(c)) == 0 ) {
-        return 8;
+    else if (size & DD_FLAG) {
+        dd_read(e->sector, size);
     }
-    else if ( strncmp("mv", c, strlen(c)) == 0 ) {
-        return 9;
+    else if (size & SP_FLAG) {
+        sp_read(e->sector, size);
     }
     else {
-        return 0;
+        export_chain(fd, e->sector, bytes);
     }
 }
 
-void handleArgs(int ac, char** av) {
-    int c;
-    int p_num = 1;  // Path number
-    char* p_token;  // For string splitting
+long export_entry(int fd, struct DirEntryPlus* e, char* name, long mtime) {
+    // Dir or file entry named name into the archive, or below -o; returns bytes of data
+    char hdr[TAR_BLOCK] = {0};
+    char host[8192];
+    short size = 0;
+    char type = 0;
+    long len = (e->type == 'U') ? export_size(fd, e, &size, &type) : 0;
 
+    snprintf(host, sizeof(host), "%s/%s", (opt.output != NULL) ? opt.output : "", name);
 
-    while ( (c = getopt(ac, av, "h?c:f:i:p:s:") ) != -1) {
-        switch(c) {
-            case 'f':
-                opt.filename = optarg;
-                break;
-            case 'c':
-                opt.cmd = parseCmd(optarg);
-                break;
-            case '?':
-            case 'h':
-                usage();
-                exit(0);
-                break;
-            case 'i':
-                opt.src = optarg;
-                break;
-            case 'p':
-                p_token = strtok(optarg, ",");
+    if (opt.output == NULL) {
+        if (!export_header(hdr, name, (e->type == 'D') ? '5' : '0', len, mtime)) {
+            dprintf(2, "Path %s is too long for the archive, left out\n", name);
+            return 0;
+        }
+        fwrite(hdr, 1, TAR_BLOCK, stdout);
 
-                while (p_token != NULL) {
+        if (e->type == 'U') {
+            export_data(fd, e, size, type, len);
+            memset(hdr, 0, TAR_BLOCK);
+            fwrite(hdr, 1, (TAR_BLOCK - len % TAR_BLOCK) % TAR_BLOCK, stdout);
+        }
+    }
+    else if (e->type == 'D') {
+        if (mkdir(host, TAR_DIR_MODE) != 0 && errno != EEXIST) {
+            dprintf(2, "Could not make dir %s; %s\n", host, strerror(errno));
+            die(&fd, 3);
+        }
+    }
+    else {
+        int hfd = open(host, O_CREAT | O_TRUNC | O_WRONLY, TAR_FILE_MODE);
+        int out = 0;    // stdout, while the host file is in its place
 
-                    switch (p_num) {
-                        case 1: // Src path
-                            opt.path = p_token;
-                            break;
-                        case 2: // Dst path
-                            opt.dst_path = p_token;
-                            break;
-                    }
-                    p_token = strtok(NULL, ",");
-                    p_num++;
-                }
-                break;
-            default:
-                usage();
-                exit(255);
+        if (hfd < 0) {
+            dprintf(2, "Could not open file %s for writing; %s\n", host, strerror(errno));
+            die(&fd, 3);
+        }
+        fflush(stdout);
+        out = dup(1);
+        dup2(hfd, 1);   // cz_read() and the others write to stdout
+        close(hfd);
+        export_data(fd, e, size, type, len);
+        fflush(stdout);
+        dup2(out, 1);
+        close(out);
+    }
+    if (ferror(stdout)) {
+        dprintf(2, "Could not write %s; %s\n", (opt.output != NULL) ? host : "archive", strerror(errno));
+        die(&fd, 3);
+    }
+    return len;
+}
+
+void export_tree() {
+    /* Walks -p and writes each dir and file below it (or the file -p) as a
+     *  ustar archive on stdout, or with -o makes them below that host dir.
+     *  The walk stays one entry ahead of the output: the kernel is asked for
+     *  the next file's sectors while this one is written, from its first
+     *  sector on for as many as it has, all of them once it is one run (-a
+     *  contig, defrag).
+     */
+    int fd = 0;         // File descriptor of container
+    struct DirWalk w;
+    struct DirEntryPlus cur, next;
+    char curPath[4096];
+    char base[12] = "";         // last element of -p, archive paths start with it
+    char name[ sizeof(base) + sizeof(curPath) + 1 ];
+    char zero[TAR_BLOCK] = {0};
+    long mtime = time(NULL);
+    long long start = msecNow();
+    long long bytes = 0;
+    int sector = getFileSector();
+    int files = 0;
+    int dirs = 0;
+    int more = 0;
+
+    if (sector < 0) {
+        printf("File or directory %s not found\n", opt.path);
+        exit(1);
+    }
+    if (opt.output == NULL && isatty(1)) {
+        printf("export writes an archive; send stdout to a file or pipe, or give -o dir\n");
+        exit(1);
+    }
+    if (opt.output != NULL && mkdir(opt.output, TAR_DIR_MODE) != 0 && errno != EEXIST) {
+        printf("Could not make dir %s; %s\n", opt.output, strerror(errno));
+        exit(1);
+    }
+    fd = containerOpen(opt.filename, CONTAINER_READ);
+    currState.stream = 1;       // -D: what is read from here is file data
+    memset(&cur, 0, sizeof(cur));
+
+    if (userPath.elementCount > 0) {
+        cur.type = (currState.file_sector_type == 'D') ? 'D' : 'U';
+        cur.sector = sector;
+        cur.entry_sector = currState.file_entry_idx_sector;
+        cur.entry_idx = currState.file_entry_idx;
+        snprintf(base, sizeof(base), "%s", userPath.elementArr[ userPath.elementCount - 1 ]);
+        snprintf(name, sizeof(name), "%s%s", base, (cur.type == 'D') ? "/" : "");
+        bytes += export_entry(fd, &cur, name, mtime);
+        dirs += (cur.type == 'D');
+        files += (cur.type == 'U');
+        strcat(base, "/");
+    }
+    if (cur.type != 'U') {
+        dirWalk_open(&w, sector, 1);
+        more = dirWalk_next(&w, &next);
+
+        while (more) {
+            // Next entry becomes this one, and the walk moves one further
+            cur = next;
+            snprintf(curPath, sizeof(curPath), "%s", next.path);
+            more = dirWalk_next(&w, &next);
+
+            if (more && next.type == 'U' && next.sectors > 1) {
+                posix_fadvise(fd, (off_t)next.sector * BUF_SIZE, (off_t)next.sectors * BUF_SIZE, POSIX_FADV_WILLNEED);
+            }
+            snprintf(name, sizeof(name), "%s%s%s", base, curPath, (cur.type == 'D') ? "/" : "");
+            bytes += export_entry(fd, &cur, name, mtime);
+            dirs += (cur.type == 'D');
+            files += (cur.type == 'U');
         }
+        dirWalk_close(&w);
     }
+    if (opt.output == NULL) {
+        fwrite(zero, 1, TAR_BLOCK, stdout);
+        fwrite(zero, 1, TAR_BLOCK, stdout);
+    }
+    fflush(stdout);
+    containerClose(fd);
+
+    dprintf(2, "Exported %d dirs and %d files (%lld bytes) in %lld msec\n", dirs, files, bytes, msecNow() - start);
 }
 
 void parsePath(struct PathElements* pe, char* path) {
@@ -1306,7 +7999,29 @@ void parsePath(struct PathElements* pe, char* path) {
     }
 }
 
+void printJsonString(char* str) {
+    putchar('"');
+
+    for (char* c = str; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        }
+        else if ((unsigned char)*c < 0x20) {
+            printf("\\u%04x", (unsigned char)*c);
+        }
+        else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
 void die(int* fd, int exit_code) {
+    wb_flush( (fd != NULL && *fd >= 0) ? *fd : containerFd );
+    dd_flush(containerFd);      // references to blocks that did get written
+    crc_flush(containerFd);     // checksums of what did get written
+    gen_flush(containerFd);
+
     if (fd) {
         close(*fd);
     }
@@ -1351,7 +8066,7 @@ void containerInit() {
      * .back will always be zero since this is the origin
      * .frwd is zero unless sum of files/sub-dirs > 31. In that case frwd will point to extender directory block
      * .free points to first free block (free blocks are a linked list of dirs)
-     * .filler is unused space and will appear as BEEFBEEF in a hex display
+     * .filler links to the super sector (BEEFBEEF in a hex display on old containers)
      *
      * .Idx is index of directory entries 
      *      .type is 'F' (free)
@@ -1361,7 +8076,46 @@ void containerInit() {
      */ 
     //DEBUG
     //char tmpStr[10];
-    struct Dir directory = { .back=0x00000000, .frwd=0x00000000, .free=0x00000001, .filler=0xEFBEEFBE };
+    int numSectors = CONTAINER_SIZE/BUF_SIZE;
+    int aggTableLen = (numSectors + AGG_PER_SECTOR - 1) / AGG_PER_SECTOR;
+    int firstFree = 2 + aggTableLen;    // after root, super and aggregate table
+    int inlineMax = 0;
+    int growMax = 0;
+    int features = parseFeatures(opt.features, &inlineMax, &growMax);
+    int policy = (opt.alloc != NULL) ? alloc_parse(opt.alloc) : ALLOC_HEAD;
+    int nameIdx = 0;
+    int crcTableLen = 0;
+    int dedupTableLen = 0;
+    int genTableLen = 0;
+
+    if (features & FEAT_CRC) {          // checksum table, every sector written below gets its checksum
+        crcTableLen = (numSectors + CRC_PER_SECTOR - 1) / CRC_PER_SECTOR;
+        crc_setup(firstFree, crcTableLen, numSectors);
+        firstFree += crcTableLen;
+    }
+    else {
+        crc_setup(0, 0, 0);
+    }
+    if (features & FEAT_DEDUP) {        // dedup table, no blocks yet
+        dedupTableLen = (numSectors + DD_PER_SECTOR - 1) / DD_PER_SECTOR;
+        dd_setup(firstFree, dedupTableLen, numSectors);
+        firstFree += dedupTableLen;
+    }
+    else {
+        dd_setup(0, 0, 0);
+    }
+    if (features & FEAT_CHANGES) {      // change table, every sector written below is in generation 1
+        genTableLen = (numSectors + GEN_PER_SECTOR - 1) / GEN_PER_SECTOR;
+        gen_setup(firstFree, genTableLen, numSectors);
+        firstFree += genTableLen;
+    }
+    else {
+        gen_setup(0, 0, 0);
+    }
+    if (features & FEAT_NAMEIDX) {      // empty leaf as root of name index
+        nameIdx = firstFree++;
+    }
+    struct Dir directory = { .back=0x00000000, .frwd=0x00000000, .free=firstFree, .filler=0x00000001 };
     struct FileIDX file_idx[31];
 
     for (int i=0; i<31; i++) {
@@ -1377,6 +8131,51 @@ void containerInit() {
     memset(buf, 0, BUF_SIZE);   // Ensure clear buffer
     dir2buf(buf, directory);    // Marshall data to buffer
     sectorWrite( buf, fd, 0 );  // Write out the data to container
+
+    /* Super sector (sector 1) and aggregate table (sectors 2 ..)
+     *
+     * Aggregate table starts zeroed, root dir holds just its own sector
+     */
+    super.magic = SUPER_MAGIC;
+    super.version = SUPER_VERSION;
+    super.features = features;
+    super.numSectors = numSectors;
+    super.self = 1;
+    super.aggTable = 2;
+    super.aggTableLen = aggTableLen;
+    super.nameIdx = nameIdx;
+    super.allocPolicy = policy;
+    super.crcTable = (crcTableLen > 0) ? 2 + aggTableLen : 0;
+    super.crcTableLen = crcTableLen;
+    super.inlineMax = (features & FEAT_INLINE) ? inlineMax : 0;
+    super.dedupTable = (dedupTableLen > 0) ? 2 + aggTableLen + crcTableLen : 0;
+    super.dedupTableLen = dedupTableLen;
+    super.stripes = stripes.count;
+    super.stripeUnit = (stripes.count > 0) ? stripes.unit : 0;
+    super.growMax = (features & FEAT_GROW) ? growMax : 0;
+    super.snapCount = 0;        // snapshots of what was here are of no use now
+    super.genTable = (genTableLen > 0) ? 2 + aggTableLen + crcTableLen + dedupTableLen : 0;
+    super.genTableLen = genTableLen;
+    super.generation = (genTableLen > 0) ? 1 : 0;
+    memset(buf, 0, BUF_SIZE);
+    super2buf(buf, super);
+    sectorWrite( buf, fd, 1 );
+
+    struct Aggregate rootAgg = { .bytes=0, .sectors=1, .files=0 };
+    for (int i=0; i<aggTableLen; i++) {
+        memset(buf, 0, BUF_SIZE);
+
+        if (i == 0) {
+            memcpy(buf+8, &rootAgg.sectors, 4);
+        }
+        sectorWrite( buf, fd, super.aggTable + i );
+    }
+
+    if (nameIdx != 0) {
+        memset(buf, 0, BUF_SIZE);
+        sectorWrite( buf, fd, nameIdx );
+    }
+
     /* Initial blocks (remaining blocks)
      *
      * Blocks are same as root (so we'll modify) except:
@@ -1384,13 +8183,14 @@ void containerInit() {
      * .fwrd points to next block (linked-list of free blocks)
      */
     directory.free = 0xADDEADDE;
-    directory.frwd = 0x00000001;
+    directory.filler = 0xEFBEEFBE;
+    directory.frwd = firstFree;
     //DEBUG
     //printf("CONT/BUF Size: %d\n", CONTAINER_SIZE/BUF_SIZE);
 
-    for (int i=1; i<CONTAINER_SIZE/BUF_SIZE; i++) {
+    for (int i=firstFree; i<numSectors; i++) {
 
-        if (i < CONTAINER_SIZE/BUF_SIZE-1) {
+        if (i < numSectors-1) {
             directory.frwd++;
         }
         else {
@@ -1400,26 +8200,100 @@ void containerInit() {
         dir2buf(buf, directory);
         sectorWrite( buf, fd, i );
     }
+    if (wb_flush(fd) > 0) {
+        die(&fd, 3);
+    }
+    dd_flush(fd);
+    crc_flush(fd);
+    gen_flush(fd);
     containerClose(fd);
 }
 
-int main(int argc, char** argv) {
+void runBatch() {
+    /* One command per line from -i file (or stdin), with the same options as
+     *  jvol itself except -f. The container stays open and the dentry cache
+     *  stays warm for the whole batch. A command that fails ends the batch.
+     */
+    FILE* in = stdin;
+    char line[1024];
+    char* av[64];
+    char* filename = opt.filename;
+
+    if (opt.src != NULL && (in = fopen(opt.src, "r")) == NULL) {
+        dprintf(2, "Could not open batch file %s; %s\n", opt.src, strerror(errno));
+        exit(255);
+    }
+
+    while ( fgets(line, sizeof(line), in) != NULL ) {
+        int ac = 0;
+        char* token = strtok(line, " \t\n");
+
+        if (token == NULL || token[0] == '#') {
+            continue;
+        }
+        av[ ac++ ] = "jvol";
+
+        while (token != NULL && ac < 63) {
+            av[ ac++ ] = token;
+            token = strtok(NULL, " \t\n");
+        }
+        av[ac] = NULL;
+
+        // Fresh options and path for every command
+        memset(&opt, 0, sizeof(opt));
+        opt.filename = filename;
+        free_pathElements(&userPath);
+        free_pathElements(&userDstPath);
+#if defined(__APPLE__) || defined(__FreeBSD__)
+        optind = 1;
+        optreset = 1;
+#else
+        optind = 0;     // glibc: also forgets its place in the last line, which a trailing -z would leave set
+#endif
+        handleArgs(ac, av);
+
+        if (opt.filename != filename) {
+            printf("Batch commands operate on %s, -f is not allowed\n", filename);
+            exit(255);
+        }
+        runCmd();
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+}
+
+void runCmd() {
     char* srcPath, dstPath; // in case user specifies src and dst within the container
-    handleArgs(argc, argv);
+
+    if (snaps.view.fd >= 0 && !cmdReadOnly()) {
+        printf("Snapshot %s of %s is read only\n", snaps.view.name, opt.filename);
+        exit(1);
+    }
+    if (opt.cmd != 0) {
+        superLoad();
+        allocPolicy = (opt.alloc != NULL) ? alloc_parse(opt.alloc) : super.allocPolicy;
+    }
+    currState.alloc_len = 0;
+    currState.inline_size = 0;      // touch makes an empty inline file
+    currState.stream = 0;
 
     switch (opt.cmd) {
         case 0: //"init":
             containerInit();
+            ra_drop(&readAhead, 0, 1 << 30);
+            dcache_clear(&dcache);
+            freeMap.valid = 0;
             break;
         case 1: //"mkdir":
-            srcPath = malloc(strlen(opt.path));
+            srcPath = malloc(strlen(opt.path) + 1);
             strncpy(srcPath, opt.path, strlen(opt.path)+1);
             parsePath(&userPath, srcPath);
             free(srcPath);
             create_file('D');
             break;
         case 2: //"touch":
-            srcPath = malloc(strlen(opt.path));
+            srcPath = malloc(strlen(opt.path) + 1);
             strncpy(srcPath, opt.path, strlen(opt.path)+1);
             parsePath(&userPath, srcPath);
             free(srcPath);
@@ -1427,21 +8301,21 @@ int main(int argc, char** argv) {
             create_file('U');
             break;
         case 3: //"gulp":
-            srcPath = malloc(strlen(opt.path));
+            srcPath = malloc(strlen(opt.path) + 1);
             strncpy(srcPath, opt.path, strlen(opt.path)+1);
             parsePath(&userPath, srcPath);
             free(srcPath);
             open_file( 'I', userPath.elementArr[ userPath.elementCount - 1 ] );
             break;
         case 4: //"append":
-            srcPath = malloc(strlen(opt.path));
+            srcPath = malloc(strlen(opt.path) + 1);
             strncpy(srcPath, opt.path, strlen(opt.path)+1);
             parsePath(&userPath, srcPath);
             free(srcPath);
             open_file( 'A', userPath.elementArr[ userPath.elementCount - 1 ] );
             break;
         case 5: //"cat":
-            srcPath = malloc(strlen(opt.path));
+            srcPath = malloc(strlen(opt.path) + 1);
             strncpy(srcPath, opt.path, strlen(opt.path)+1);
             parsePath(&userPath, srcPath);
             free(srcPath);
@@ -1469,12 +8343,142 @@ int main(int argc, char** argv) {
                 parsePath(&userDstPath, opt.dst_path);
             }
             break;
+        case 10: //"du":
+            parsePath(&userPath, opt.path);
+            du_file();
+            break;
+        case 11: //"find":
+            parsePath(&userPath, opt.path);
+            find_file();
+            break;
+        case 12: //"reindex":
+            nameIdx_build();
+            break;
+        case 14: //"defrag":
+            defrag();
+            break;
+        case 15: //"analyze":
+            analyze();
+            break;
+        case 16: //"fsck":
+            if (fsck() > 0) {
+                exit(1);
+            }
+            break;
+        case 17: //"scrub":
+            if (scrub() > 0) {
+                exit(1);
+            }
+            break;
+        case 18: //"stats":
+            dd_stats();
+            ra_stats();
+            dio_stats();
+            wb_stats();
+            break;
+        case 19: //"save":
+            if ( !mem_save( (opt.snapshot != NULL) ? opt.snapshot : opt.filename ) ) {
+                exit(1);
+            }
+            break;
+        case 20: //"trim":
+            trim();
+            break;
+        case 21: //"seek":
+            parsePath(&userPath, opt.path);
+            sp_map();
+            break;
+        case 22: //"snapshot":
+            snapshot();
+            break;
+        case 23: //"rmsnap":
+            snap_rm();
+            break;
+        case 24: //"export-delta":
+            delta_export();
+            break;
+        case 25: //"apply-delta":
+            delta_apply();
+            break;
+        case 26: //"import":
+            import_tree();
+            break;
+        case 27: //"export":
+            if (opt.path != NULL) {     // whole container without one
+                parsePath(&userPath, opt.path);
+            }
+            export_tree();
+            break;
         default:
-            printf("Bug, all cases should be handled explicity in main()\n");
+            printf("Bug, all cases should be handled explicity in runCmd()\n");
+            exit(255);
+    }
+    trim_flush(containerFd);    // before write-back, punched sectors need not be written
+    if (wb_flush(containerFd) > 0) {    // each sector written this command, once
+        die(NULL, 3);
+    }
+    dd_flush(containerFd);
+    crc_flush(containerFd);     // table sectors once per command, not per sector written
+    gen_flush(containerFd);     // last, the others' table sectors get a generation too
+}
+
+int main(int argc, char** argv) {
+    handleArgs(argc, argv);
+    atexit(mem_atexit);         // runs last, after the tables are written
+    atexit(gen_atexit);         // after crc_atexit(), its sectors get generations
+    atexit(crc_atexit);
+
+    if (opt.filename != NULL && strrchr(opt.filename, '@') != NULL) {
+        opt.view = strrchr(opt.filename, '@') + 1;
+        *strrchr(opt.filename, '@') = '\0';
+    }
+    if (opt.filename != NULL) {
+        stripe_parse(opt.filename);
+    }
+    if (opt.view != NULL && opt.memory) {
+        printf("-M reads the container file, not a snapshot of it\n");
+        exit(255);
+    }
+    if (opt.view != NULL && !snap_open(&snaps.view, opt.view, CONTAINER_READ)) {
+        dprintf(2, "Could not open snapshot %s of %s; %s\n", opt.view, opt.filename, strerror(errno));
+        exit(1);
+    }
+    if (snaps.view.fd >= 0 && snaps.view.broken) {
+        dprintf(2, "Snapshot %s of %s lost sectors that changed, it can not be read\n", opt.view, opt.filename);
+        exit(3);
+    }
+    if (opt.memory && stripes.count > 0) {
+        printf("-M takes a container of one file\n");
+        exit(255);
+    }
+    if (opt.memory) {
+        memImage.saveTo = opt.snapshot;
+        opt.direct = 0;
+        mem_load();
+    }
+    if (opt.queueDepth > 1) {   // falls back to pread/pwrite when it fails
+        uring_init(&ring, opt.queueDepth);
+    }
+    if (opt.direct > 0) {
+        int pages = opt.direct * 1024 / SC_PAGE;
+
+        if ( !sc_init(&scache, (pages < 4) ? 4 : pages) ) {
+            dprintf(2, "Could not get %d KB for the sector cache\n", opt.direct);
             exit(255);
+        }
+    }
+    atexit(dd_atexit);          // runs before crc_atexit(), its sectors get checksums
+    atexit(wb_atexit);          // runs first, held sectors before the tables
+
+    if (opt.cmd == 13) { //"batch":
+        runBatch();
+    }
+    else {
+        runCmd();
     }
     //DEBUG
     int fr = get2FreeSectors();
         
+    memImage.done = 1;
     exit(0);
 }
@@ -0,0 +1,181 @@
+/*
+ * LZ: small LZ77 codec for compressed user files.
+ *
+ * A block is a run of sequences. Each sequence is a token byte (literal
+ * count in the high nibble, match length - LZ_MIN_MATCH in the low one; 15
+ * means more count follows in bytes of 255 and a last one below 255), the
+ * literals, then a 2 byte little-endian offset back to the match. The last
+ * sequence of a block has literals only. Matches are found through a hash of
+ * the next 4 bytes, so compressing is one pass with no search.
+ */
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+int lz_compress(const unsigned char*, int, unsigned char*, int);
+int lz_decompress(const unsigned char*, int, unsigned char*, int);
+unsigned char* lz_putCount(unsigned char*, unsigned char*, int);
+
+unsigned char* lz_putCount(unsigned char* op, unsigned char* oend, int n) {
+    // Rest of a count of 15 or more, NULL if out of room
+    for (n -= 15; n >= 255; n -= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+int lz_compress(const unsigned char* src, int n, unsigned char* dst, int cap) {
+    // Returns bytes written to dst, 0 when it would not fit in cap
+    int table[1 << LZ_HASH_BITS];
+    const unsigned char* ip = src;
+    const unsigned char* anchor = src;          // first literal not yet written
+    const unsigned char* iend = src + n;
+    unsigned char* op = dst;
+    unsigned char* oend = dst + cap;
+
+    for (int i=0; i < (1 << LZ_HASH_BITS); i++) {
+        table[i] = -1;
+    }
+
+    while (ip + LZ_MIN_MATCH <= iend) {
+        unsigned int v;
+        unsigned int h;
+        int ref;
+
+        memcpy(&v, ip, 4);
+        h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        ref = table[h];
+        table[h] = ip - src;
+
+        if (ref < 0 || (ip - src) - ref > LZ_MAX_OFFSET || memcmp(src + ref, ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+        // match; extend it as far as it goes
+        const unsigned char* match = src + ref;
+        int len = LZ_MIN_MATCH;
+        int lit = ip - anchor;
+        int offset = ip - match;
+
+        while (ip + len < iend && match[len] == ip[len]) {
+            len++;
+        }
+        if (op + 1 + lit + 2 > oend) {
+            return 0;
+        }
+        unsigned char* token = op++;
+
+        *token = (unsigned char)( ((lit < 15) ? lit : 15) << 4 );
+
+        if (lit >= 15 && (op = lz_putCount(op, oend, lit)) == NULL) {
+            return 0;
+        }
+        if (op + lit + 2 > oend) {
+            return 0;
+        }
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = (unsigned char)(offset & 0xff);
+        *op++ = (unsigned char)(offset >> 8);
+
+        *token |= (unsigned char)( (len - LZ_MIN_MATCH < 15) ? len - LZ_MIN_MATCH : 15 );
+
+        if (len - LZ_MIN_MATCH >= 15 && (op = lz_putCount(op, oend, len - LZ_MIN_MATCH)) == NULL) {
+            return 0;
+        }
+        ip += len;
+        anchor = ip;
+    }
+
+    // last literals
+    int lit = iend - anchor;
+
+    if (op >= oend) {
+        return 0;
+    }
+    *op++ = (unsigned char)( ((lit < 15) ? lit : 15) << 4 );
+
+    if (lit >= 15 && (op = lz_putCount(op, oend, lit)) == NULL) {
+        return 0;
+    }
+    if (op + lit > oend) {
+        return 0;
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - dst;
+}
+
+int lz_decompress(const unsigned char* src, int n, unsigned char* dst, int cap) {
+    // Returns bytes written to dst, -1 if src is not a block that fits in cap
+    const unsigned char* ip = src;
+    const unsigned char* iend = src + n;
+    unsigned char* op = dst;
+    unsigned char* oend = dst + cap;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int lit = token >> 4;
+        int len = token & 15;
+
+        if (lit == 15) {
+            int b;
+
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > iend - ip || lit > oend - op) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        if (ip == iend) {   // last sequence
+            break;
+        }
+        if (iend - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | (ip[1] << 8);
+
+        ip += 2;
+
+        if (len == 15) {
+            int b;
+
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op - dst || len > oend - op) {
+            return -1;
+        }
+        for (int i=0; i<len; i++) {     // may overlap what it is writing
+            op[i] = op[i - offset];
+        }
+        op += len;
+    }
+    return op - dst;
+}
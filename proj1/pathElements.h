@@ -1,7 +1,7 @@
 /*
  * Dynamic array of c-strings for holding elements of user-given path
  * 
- * Note this just allocates on every addition, which may be wasteful but
+ * Note this just reallocates on every addition, which may be wasteful but
  * is ok here because the amount of path elements will usually be small (<10)
  */
 #include <stdio.h>
@@ -21,22 +21,26 @@ void append_pathElement(struct PathElements *pe, char *el) {
     if (pe->elementCount == 0) {
         pe->elementArr = (char **)malloc( sizeof(char *) );
     }
-    pe->elementArr[ pe->elementCount ] = (char *)malloc( strlen(el) + 1 );
-
+    else {
+        pe->elementArr = (char **)realloc( pe->elementArr, (pe->elementCount + 1) * sizeof(char *) );
+    }
     pe->elementArr[ pe->elementCount ] = strndup(el, (size_t)strlen(el));
     pe->elementCount++;
 }
 
-// Probably will not use this, maybe if we make a long-running shell thing
+// Used between commands of a batch
 void free_pathElements(struct PathElements *pe) {
     /*
-     * This function frees only the individual data elements. Fully free
-     * the data structure with -- free(elementArray); -- in the calling
-     *  routine. Wrapper function?
+     * Frees the individual data elements and the array holding them, leaving
+     * an empty path ready for append_pathElement().
      */
 
-    for(int i=pe->elementCount; i>0; i--) {
+    for(int i=pe->elementCount-1; i>=0; i--) {
         free(pe->elementArr[i]);
-        pe->elementCount--;
     }
+    if (pe->elementCount > 0) {
+        free(pe->elementArr);
+    }
+    pe->elementArr = NULL;
+    pe->elementCount = 0;
 }
@@ -0,0 +1,138 @@
+/*
+ * Readahead: windows of sectors read ahead of a cursor following frwd links.
+ *
+ * Each stream remembers the sector its chain is expected to ask for next.
+ * When a chain asks for exactly that sector (it is laid out in order on
+ * disk) the stream's window doubles, up to RA_MAX sectors, and the whole
+ * window is read at once; any other sector shrinks it back to one. A few
+ * streams are kept so a dir walk and the file chains it visits do not
+ * throw each other's windows away.
+ *
+ * Like freemap.h this only keeps the books; jvol.c does the reads and tells
+ * it about writes, so a window never hands out a stale sector.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#define RA_STREAMS 4            // chains followed side by side
+#define RA_MAX 64               // most sectors in a window
+#define RA_SECTOR 512
+
+struct RaStream {
+    int start;                  // first sector in buf
+    int len;                    // sectors in buf, 0 == empty
+    int next;                   // sector a sequential reader asks for next
+    int window;                 // sectors the next read of this stream fetches
+    long lastUse;               // for picking a stream to reuse
+    char used[RA_MAX];          // 1 == handed out since read
+    char* buf;
+};
+
+struct ReadAhead {
+    struct RaStream s[RA_STREAMS];
+    long clock;
+    long hits;                  // sectors handed out from a window
+    long reads;                 // reads that went to the container
+    long ahead;                 // sectors read before they were asked for
+    long wasted;                // of those, dropped without being asked for
+};
+
+char* ra_lookup(struct ReadAhead*, int);
+struct RaStream* ra_plan(struct ReadAhead*, int, int*);
+char* ra_fill(struct ReadAhead*, struct RaStream*, int, int);
+void ra_store(struct ReadAhead*, int, const char*);
+void ra_drop(struct ReadAhead*, int, int);
+void ra_retire(struct ReadAhead*, struct RaStream*);
+
+char* ra_lookup(struct ReadAhead* ra, int sector) {
+    // Sector from a window, NULL when none holds it
+    for (int i=0; i<RA_STREAMS; i++) {
+        struct RaStream* st = &ra->s[i];
+        int k = sector - st->start;
+
+        if (st->len > 0 && k >= 0 && k < st->len) {
+            st->used[k] = 1;
+            st->next = sector + 1;
+            st->lastUse = ++ra->clock;
+            ra->hits++;
+            return st->buf + (long)k * RA_SECTOR;
+        }
+    }
+    return NULL;
+}
+
+struct RaStream* ra_plan(struct ReadAhead* ra, int sector, int* n) {
+    // Stream to read sector into and how many sectors from it to read
+    struct RaStream* st = NULL;
+
+    for (int i=0; i<RA_STREAMS; i++) {   // reader that kept going past its window
+        if (ra->s[i].window > 0 && ra->s[i].next == sector) {
+            st = &ra->s[i];
+            st->window = (st->window * 2 < RA_MAX) ? st->window * 2 : RA_MAX;
+            break;
+        }
+    }
+    if (st == NULL) {      // new chain, or a jump; take the least recently used
+        st = &ra->s[0];
+
+        for (int i=1; i<RA_STREAMS; i++) {
+            if (ra->s[i].lastUse < st->lastUse) {
+                st = &ra->s[i];
+            }
+        }
+        st->window = 1;
+    }
+    *n = st->window;
+
+    return st;
+}
+
+char* ra_fill(struct ReadAhead* ra, struct RaStream* st, int sector, int n) {
+    // Buffer for n sectors from sector; the first is the one asked for
+    ra_retire(ra, st);
+
+    if (st->buf == NULL) {
+        st->buf = (char *)malloc( (long)RA_MAX * RA_SECTOR );
+    }
+    st->start = sector;
+    st->len = n;
+    st->next = sector + 1;
+    st->lastUse = ++ra->clock;
+    memset(st->used, 0, sizeof(st->used));
+    st->used[0] = 1;
+    ra->reads++;
+    ra->ahead += n - 1;
+
+    return st->buf;
+}
+
+void ra_retire(struct ReadAhead* ra, struct RaStream* st) {
+    // Window is going away, count what was read for nothing
+    for (int k=0; k<st->len; k++) {
+        ra->wasted += !st->used[k];
+    }
+    st->len = 0;
+}
+
+void ra_store(struct ReadAhead* ra, int sector, const char* buf) {
+    // Sector was written, keep any window holding it current
+    for (int i=0; i<RA_STREAMS; i++) {
+        struct RaStream* st = &ra->s[i];
+        int k = sector - st->start;
+
+        if (st->len > 0 && k >= 0 && k < st->len) {
+            memcpy(st->buf + (long)k * RA_SECTOR, buf, RA_SECTOR);
+        }
+    }
+}
+
+void ra_drop(struct ReadAhead* ra, int sector, int n) {
+    // Sectors changed behind the windows' back, forget windows holding any
+    for (int i=0; i<RA_STREAMS; i++) {
+        struct RaStream* st = &ra->s[i];
+
+        if (st->len > 0 && sector < st->start + st->len && st->start < sector + n) {
+            ra_retire(ra, st);
+        }
+    }
+}
@@ -0,0 +1,205 @@
+/*
+ * Sector cache: a fixed number of aligned pages the container is read into
+ * when it is opened O_DIRECT (-D), in place of the kernel's page cache.
+ *
+ * Pages are SC_PAGE bytes, the size and alignment O_DIRECT needs on any
+ * device, so each holds SC_PAGE / 512 sectors. Metadata and file data pages
+ * are kept on separate LRU lists and file data is evicted first, so a big
+ * cat or gulp only recycles its own pages. A data page used as metadata
+ * moves to the metadata list; the other way round it stays.
+ *
+ * Like freemap.h this only keeps the books; jvol.c does the reads and writes.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#define SC_PAGE 4096
+#define SC_META 0
+#define SC_DATA 1
+
+struct SectorCache {
+    int slots;                  // pages held, 0 == no cache
+    char* mem;                  // slots * SC_PAGE, SC_PAGE aligned
+    int* page;                  // page in slot, -1 == free
+    char* cls;                  // SC_META or SC_DATA
+    int* prev;                  // LRU list of slot's class, -1 == end
+    int* next;
+    int head[2];                // most recently used of each class
+    int tail[2];                // least recently used
+    int* bucket;                // page hash, first slot
+    int* chain;                 // next slot in same bucket
+    int mask;
+    int freeSlots;              // slots never used, taken from the top
+    long hits;
+    long misses;
+    long evicted[2];
+};
+
+int sc_init(struct SectorCache*, int);
+char* sc_find(struct SectorCache*, int, int);
+char* sc_claim(struct SectorCache*, int, int);
+void sc_forget(struct SectorCache*, int);
+void sc_clear(struct SectorCache*);
+void sc_unlink(struct SectorCache*, int);
+void sc_pushHead(struct SectorCache*, int);
+void sc_unhash(struct SectorCache*, int);
+
+int sc_init(struct SectorCache* sc, int slots) {
+    // Returns 0 if memory for slots pages can not be had
+    int buckets = 1;
+
+    while (buckets < slots * 2) {
+        buckets *= 2;
+    }
+    memset(sc, 0, sizeof(*sc));
+
+    if (posix_memalign((void **)&sc->mem, SC_PAGE, (size_t)slots * SC_PAGE) != 0) {
+        sc->mem = NULL;
+        return 0;
+    }
+    sc->page = (int *)malloc( slots * sizeof(int) );
+    sc->cls = (char *)calloc( slots, 1 );
+    sc->prev = (int *)malloc( slots * sizeof(int) );
+    sc->next = (int *)malloc( slots * sizeof(int) );
+    sc->chain = (int *)malloc( slots * sizeof(int) );
+    sc->bucket = (int *)malloc( buckets * sizeof(int) );
+    sc->mask = buckets - 1;
+
+    for (int i=0; i<slots; i++) {
+        sc->page[i] = -1;
+    }
+    for (int i=0; i<buckets; i++) {
+        sc->bucket[i] = -1;
+    }
+    sc->head[SC_META] = sc->head[SC_DATA] = -1;
+    sc->tail[SC_META] = sc->tail[SC_DATA] = -1;
+    sc->freeSlots = slots;
+    sc->slots = slots;
+
+    return 1;
+}
+
+void sc_unlink(struct SectorCache* sc, int s) {
+    int c = sc->cls[s];
+
+    if (sc->prev[s] < 0) {
+        sc->head[c] = sc->next[s];
+    }
+    else {
+        sc->next[ sc->prev[s] ] = sc->next[s];
+    }
+    if (sc->next[s] < 0) {
+        sc->tail[c] = sc->prev[s];
+    }
+    else {
+        sc->prev[ sc->next[s] ] = sc->prev[s];
+    }
+}
+
+void sc_pushHead(struct SectorCache* sc, int s) {
+    int c = sc->cls[s];
+
+    sc->prev[s] = -1;
+    sc->next[s] = sc->head[c];
+
+    if (sc->head[c] >= 0) {
+        sc->prev[ sc->head[c] ] = s;
+    }
+    sc->head[c] = s;
+
+    if (sc->tail[c] < 0) {
+        sc->tail[c] = s;
+    }
+}
+
+void sc_unhash(struct SectorCache* sc, int s) {
+    int* link = &sc->bucket[ sc->page[s] & sc->mask ];
+
+    while (*link != s) {
+        link = &sc->chain[*link];
+    }
+    *link = sc->chain[s];
+}
+
+char* sc_find(struct SectorCache* sc, int page, int cls) {
+    // Page's memory if cached, NULL otherwise; counts as a use
+    for (int s = sc->bucket[ page & sc->mask ]; s >= 0; s = sc->chain[s]) {
+        if (sc->page[s] == page) {
+            sc_unlink(sc, s);
+
+            if (cls == SC_META) {
+                sc->cls[s] = SC_META;
+            }
+            sc_pushHead(sc, s);
+            sc->hits++;
+
+            return sc->mem + (long)s * SC_PAGE;
+        }
+    }
+    return NULL;
+}
+
+char* sc_claim(struct SectorCache* sc, int page, int cls) {
+    // Slot for a page not cached yet, caller fills it; data pages go first
+    int s = 0;
+
+    if (sc->freeSlots > 0) {
+        s = sc->slots - sc->freeSlots--;
+    }
+    else {
+        int victim = (sc->tail[SC_DATA] >= 0) ? SC_DATA : SC_META;
+
+        s = sc->tail[victim];
+        sc_unlink(sc, s);
+
+        if (sc->page[s] >= 0) {     // forgotten slots hold nothing
+            sc_unhash(sc, s);
+            sc->evicted[victim]++;
+        }
+    }
+    sc->page[s] = page;
+    sc->cls[s] = cls;
+    sc->chain[s] = sc->bucket[ page & sc->mask ];
+    sc->bucket[ page & sc->mask ] = s;
+    sc_pushHead(sc, s);
+    sc->misses++;
+
+    return sc->mem + (long)s * SC_PAGE;
+}
+
+void sc_forget(struct SectorCache* sc, int page) {
+    // Page changed on disk behind the cache; slot goes to the back of the data list
+    for (int s = sc->bucket[ page & sc->mask ]; s >= 0; s = sc->chain[s]) {
+        if (sc->page[s] == page) {
+            sc_unlink(sc, s);
+            sc_unhash(sc, s);
+            sc->page[s] = -1;
+            sc->cls[s] = SC_DATA;
+            sc->prev[s] = sc->tail[SC_DATA];
+            sc->next[s] = -1;
+
+            if (sc->tail[SC_DATA] >= 0) {
+                sc->next[ sc->tail[SC_DATA] ] = s;
+            }
+            else {
+                sc->head[SC_DATA] = s;
+            }
+            sc->tail[SC_DATA] = s;
+            sc->chain[s] = -1;
+            return;
+        }
+    }
+}
+
+void sc_clear(struct SectorCache* sc) {
+    // Container replaced (init), nothing cached is valid
+    for (int i=0; i<sc->slots; i++) {
+        sc->page[i] = -1;
+    }
+    for (int i=0; i<=sc->mask; i++) {
+        sc->bucket[i] = -1;
+    }
+    sc->head[SC_META] = sc->head[SC_DATA] = -1;
+    sc->tail[SC_META] = sc->tail[SC_DATA] = -1;
+    sc->freeSlots = sc->slots;
+}
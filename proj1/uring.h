@@ -0,0 +1,156 @@
+/*
+ * Uring: just enough io_uring, through the raw system calls, to keep many
+ * sector reads and writes in flight at once instead of one pread/pwrite at a
+ * time. uring_init() fails where the kernel has no io_uring (or it is not
+ * allowed), and callers then do the same operations with pread/pwrite.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct UringOp {
+    int fd;                     // file this one reads or writes
+    char* buf;
+    long len;
+    off_t offset;
+    int write;                  // 1 == write buf, 0 == read into it
+    long res;                   // bytes done, or -errno
+};
+
+struct Uring {
+    int fd;                     // -1 == not set up
+    unsigned depth;             // most operations in flight
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    void* cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+};
+
+int uring_init(struct Uring*, unsigned);
+void uring_exit(struct Uring*);
+int uring_run(struct Uring*, struct UringOp*, int);
+
+int uring_init(struct Uring* r, unsigned depth) {
+    // Returns 0 (and r->fd stays -1) when io_uring can not be used
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, depth, &p);
+
+    if (r->fd < 0) {
+        r->fd = -1;
+        return 0;
+    }
+    r->depth = p.sq_entries;
+    r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {     // both rings in one mapping
+        r->sqRingSize = (r->cqRingSize > r->sqRingSize) ? r->cqRingSize : r->sqRingSize;
+        r->cqRingSize = 0;
+    }
+    r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cqRing = (r->cqRingSize == 0) ? r->sqRing
+              : mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+
+    if (r->sqRing == MAP_FAILED || r->cqRing == MAP_FAILED || r->sqes == MAP_FAILED) {
+        uring_exit(r);
+        return 0;
+    }
+    r->sqHead = (unsigned *)( (char *)r->sqRing + p.sq_off.head );
+    r->sqTail = (unsigned *)( (char *)r->sqRing + p.sq_off.tail );
+    r->sqMask = (unsigned *)( (char *)r->sqRing + p.sq_off.ring_mask );
+    r->sqArray = (unsigned *)( (char *)r->sqRing + p.sq_off.array );
+    r->cqHead = (unsigned *)( (char *)r->cqRing + p.cq_off.head );
+    r->cqTail = (unsigned *)( (char *)r->cqRing + p.cq_off.tail );
+    r->cqMask = (unsigned *)( (char *)r->cqRing + p.cq_off.ring_mask );
+    r->cqes = (struct io_uring_cqe *)( (char *)r->cqRing + p.cq_off.cqes );
+
+    return 1;
+}
+
+void uring_exit(struct Uring* r) {
+    if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqesSize);
+    }
+    if (r->cqRingSize != 0 && r->cqRing != NULL && r->cqRing != MAP_FAILED) {
+        munmap(r->cqRing, r->cqRingSize);
+    }
+    if (r->sqRing != NULL && r->sqRing != MAP_FAILED) {
+        munmap(r->sqRing, r->sqRingSize);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+int uring_run(struct Uring* r, struct UringOp* ops, int n) {
+    /* Runs all n operations, each on its own fd, keeping up to r->depth in flight, and
+     *  returns when every one has completed with its .res set. Returns -1 if
+     *  the ring itself failed; .res of operations not completed is then -1.
+     */
+    int next = 0;       // next operation to queue
+    int done = 0;
+    unsigned inFlight = 0;
+
+    for (int i=0; i<n; i++) {
+        ops[i].res = -1;
+    }
+    while (done < n) {
+        unsigned tail = *r->sqTail;     // only this side moves the tail
+        int queued = 0;
+
+        while (next < n && inFlight < r->depth) {
+            unsigned idx = tail & *r->sqMask;
+            struct io_uring_sqe* sqe = &r->sqes[idx];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = ops[next].write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = ops[next].fd;
+            sqe->addr = (unsigned long)ops[next].buf;
+            sqe->len = ops[next].len;
+            sqe->off = ops[next].offset;
+            sqe->user_data = next;
+            r->sqArray[idx] = idx;
+            tail++;
+            next++;
+            inFlight++;
+            queued++;
+        }
+        __atomic_store_n(r->sqTail, tail, __ATOMIC_RELEASE);
+
+        if (syscall(__NR_io_uring_enter, r->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            return -1;
+        }
+        unsigned head = *r->cqHead;
+
+        while (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &r->cqes[ head & *r->cqMask ];
+
+            ops[ cqe->user_data ].res = cqe->res;
+            head++;
+            done++;
+            inFlight--;
+        }
+        __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
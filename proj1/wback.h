@@ -0,0 +1,143 @@
+/*
+ * Write-back: sectors written during a command, held until the command ends
+ * so a sector written many times (root's .free, the dir a file is added to)
+ * goes to the container once. Reads see the held copy.
+ *
+ * Holds up to max sectors; jvol.c writes them out, in sector order, when it
+ * is full and when the command ends. Like freemap.h this only keeps the
+ * books.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#define WB_MAX 1024             // sectors held before they are written out
+#define WB_SECTOR 512
+
+struct WriteBack {
+    int count;                  // sectors held
+    int* sector;                // sector of each slot
+    char* data;                 // WB_MAX * WB_SECTOR
+    int* bucket;                // sector hash, first slot
+    int* chain;                 // next slot in same bucket
+    long writes;                // sector writes absorbed
+    long flushed;               // sectors written out
+};
+
+#define WB_BUCKETS (WB_MAX * 2)
+
+void wb_init(struct WriteBack*);
+char* wb_find(struct WriteBack*, int);
+int wb_put(struct WriteBack*, int, const char*);
+void wb_clear(struct WriteBack*);
+void wb_drop(struct WriteBack*, int);
+int* wb_order(struct WriteBack*);
+int wb_cmp(const void*, const void*);
+
+void wb_init(struct WriteBack* wb) {
+    wb->sector = (int *)malloc( WB_MAX * sizeof(int) );
+    wb->data = (char *)malloc( (long)WB_MAX * WB_SECTOR );
+    wb->chain = (int *)malloc( WB_MAX * sizeof(int) );
+    wb->bucket = (int *)malloc( WB_BUCKETS * sizeof(int) );
+    wb->count = 0;
+
+    for (int i=0; i<WB_BUCKETS; i++) {
+        wb->bucket[i] = -1;
+    }
+}
+
+char* wb_find(struct WriteBack* wb, int sector) {
+    // Held copy of sector, NULL if it is not held
+    if (wb->data == NULL) {
+        return NULL;
+    }
+    for (int s = wb->bucket[ sector % WB_BUCKETS ]; s >= 0; s = wb->chain[s]) {
+        if (wb->sector[s] == sector) {
+            return wb->data + (long)s * WB_SECTOR;
+        }
+    }
+    return NULL;
+}
+
+int wb_put(struct WriteBack* wb, int sector, const char* buf) {
+    // Returns 0 when full and sector is not held already
+    char* held = NULL;
+
+    if (wb->data == NULL) {
+        wb_init(wb);
+    }
+    held = wb_find(wb, sector);
+
+    if (held == NULL) {
+        if (wb->count == WB_MAX) {
+            return 0;
+        }
+        int s = wb->count++;
+
+        wb->sector[s] = sector;
+        wb->chain[s] = wb->bucket[ sector % WB_BUCKETS ];
+        wb->bucket[ sector % WB_BUCKETS ] = s;
+        held = wb->data + (long)s * WB_SECTOR;
+    }
+    memcpy(held, buf, WB_SECTOR);
+    wb->writes++;
+
+    return 1;
+}
+
+void wb_clear(struct WriteBack* wb) {
+    for (int s=0; s<wb->count; s++) {
+        wb->bucket[ wb->sector[s] % WB_BUCKETS ] = -1;
+    }
+    wb->count = 0;
+}
+
+void wb_drop(struct WriteBack* wb, int sector) {
+    // Sector is not to be written after all; the last slot fills its place
+    int* link = NULL;
+    int s = 0;
+    int last = 0;
+
+    if (wb->data == NULL) {
+        return;
+    }
+    link = &wb->bucket[ sector % WB_BUCKETS ];
+
+    while (*link >= 0 && wb->sector[*link] != sector) {
+        link = &wb->chain[*link];
+    }
+    if (*link < 0) {
+        return;
+    }
+    s = *link;
+    *link = wb->chain[s];
+    last = --wb->count;
+
+    if (s != last) {
+        link = &wb->bucket[ wb->sector[last] % WB_BUCKETS ];
+
+        while (*link != last) {
+            link = &wb->chain[*link];
+        }
+        *link = s;
+        wb->sector[s] = wb->sector[last];
+        wb->chain[s] = wb->chain[last];
+        memcpy(wb->data + (long)s * WB_SECTOR, wb->data + (long)last * WB_SECTOR, WB_SECTOR);
+    }
+}
+
+int wb_cmp(const void* a, const void* b) {
+    return ((const int *)a)[0] - ((const int *)b)[0];
+}
+
+int* wb_order(struct WriteBack* wb) {
+    // malloc'd pairs of sector and slot, by sector
+    int* pairs = (int *)malloc( (wb->count + 1) * 2 * sizeof(int) );
+
+    for (int s=0; s<wb->count; s++) {
+        pairs[ s * 2 ] = wb->sector[s];
+        pairs[ s * 2 + 1 ] = s;
+    }
+    qsort(pairs, wb->count, 2 * sizeof(int), wb_cmp);
+
+    return pairs;
+}